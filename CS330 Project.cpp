@@ -1,7 +1,42 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <vector>           // vector
+#include <string>           // string
+#include <cstring>          // strcmp
+#include <algorithm>        // min, max, swap_ranges
+#include <thread>           // thread
+#include <mutex>            // mutex
+#include <condition_variable> // condition_variable
+#include <future>           // future, packaged_task
+#include <functional>       // function
+#include <queue>            // queue
+#include <memory>           // shared_ptr
+#include <chrono>           // seconds
+#include <fstream>          // ofstream
+#include <atomic>           // atomic
+#include <map>              // map
+#include <sstream>          // istringstream
+#include <cmath>            // ceil, fmod, sqrt
+#include <cstddef>          // offsetof
+#include <cstdint>          // uint32_t, uint64_t
+#include <cassert>          // assert
+#include <cstdio>           // remove
 #include <GL/glew.h>        // GLEW library
-#include <GLFW/glfw3.h>  
+#include <GLFW/glfw3.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>        // Mesh file mapping
+#else
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat
+#include <fcntl.h>          // open
+#include <unistd.h>         // close
+#endif  
+#ifdef __linux__
+#include <EGL/egl.h>        // Headless context creation
+#include <EGL/eglext.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION // GLFW library
 #include "Debug/stb_image.h"
 // GLM Math Header inclusions
@@ -12,6 +47,32 @@
 
 using namespace std; // Standard namespace
 
+// Frame profiler: built into debug builds, and into release builds only when CS330_PROFILE is defined
+#if !defined(NDEBUG) && !defined(CS330_PROFILE)
+#define CS330_PROFILE
+#endif
+
+// SSE frustum tests wherever the target guarantees SSE2 (every x64 build); a scalar loop elsewhere
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CS330_SSE
+#include <emmintrin.h>
+#endif
+
+// Wider mip filter passes where the target guarantees AVX2 (/arch:AVX2, -mavx2)
+#if defined(__AVX2__)
+#define CS330_AVX2
+#include <immintrin.h>
+#endif
+
+// Profiler hooks; they expand to nothing when the profiler is compiled out
+#ifdef CS330_PROFILE
+#define UPROFILE_FRAME() gProfiler.BeginFrame()
+#define UPROFILE_SCOPE(section) ProfileScope profileScope##section(gProfiler, section)
+#else
+#define UPROFILE_FRAME()
+#define UPROFILE_SCOPE(section)
+#endif
+
 /*Shader program Macro*/
 #ifndef GLSL
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
@@ -26,1970 +87,8653 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
-    // Stores the GL data relative to a given mesh
-    struct GLMesh
+    // Size of the framebuffer URender draws into: the window, or the offscreen target in headless mode
+    int gFramebufferWidth = WINDOW_WIDTH;
+    int gFramebufferHeight = WINDOW_HEIGHT;
+
+    // Simulated time between headless and benchmark frames, so their output does not depend on render speed
+    const float FIXED_FRAME_TIME = 1.0f / 60.0f;
+
+    // Headless mode: no window, frames go into an offscreen framebuffer and then to disk
+    struct HeadlessTarget
     {
-        GLuint vao, vao1, vao2, vao3, vao4, vao5, vao6, vao7, vao8, vao9, vao10, vao11, vao12, vao13, vao14;         // Handle for the vertex array object
-        GLuint vbos[2], vbos1[2], vbos2[2], vbos3[2], vbos4[2], vbos5[2], vbos6[2], vbos7[2], vbos8[2], vbos9[2], vbos10[2], vbos11[2], vbos12[2], vbos13[2], vbos14[2];     // Handles for the vertex buffer objects
-        GLuint nIndices, nRoofIndices, nGrassIndices, nDriveWayIndices, nSecondBaseIndices, nTopHouseIndices, nRightHouseIndices, nLeftHouseIndices,
-            nTopRoofIndices, nWindowIndices, nWalkUpIndices, nFrontDoorIndices, nGarageIndices, nFrontWindowIndices, nFenceIndices, nLampIndices;    // Number of indices of the mesh
+#ifdef __linux__
+        EGLDisplay display;
+        EGLContext context;
+#endif
+        GLuint framebuffer;
+        GLuint renderbuffers[2];    // Color and depth
     };
 
-    // Main GLFW window
-    GLFWwindow* gWindow = nullptr;
-    // Triangle mesh data
-    GLMesh gMesh;
-    // Texture
-    GLuint gTextureId, roofTextureId, grassTextureId, drivewayTextureId, tophouseTextureId, rightleftHouseTextureID, topWindowTextureId, 
-        frontDoorTextureId, garageTextureId, frontWindowTextureId, fenceTextureId;
-    glm::vec2 gUVScale(1.0f, 1.0f);
-    glm::vec2 gRoofScale(2.0f, 2.0f);
-    glm::vec2 gGrassScale(1.0f, 1.0f);
-    glm::vec2 gDrivewayScale(1.0f, 1.0f);
-    GLint gTextWrapMode = GL_REPEAT;
+    bool gIsHeadless = false;
+    int gHeadlessFrameCount = 1;            // Frames rendered before exiting
+    int gHeadlessFrameIndex = 0;            // Frames written so far
+    std::string gHeadlessOutput = "frame";  // Path prefix of the written frames
+    bool gIsHeadlessRawOutput = false;      // Write raw RGBA instead of PNG
+    HeadlessTarget gHeadlessTarget;
 
-    // Shader program
-    GLuint gProgramId;
-    GLuint gLampProgramId;
+    // Camera pose at a point of a scripted flythrough
+    struct CameraKeyframe
+    {
+        float time;         // Seconds from the start of the path
+        glm::vec3 position;
+        float yaw;          // Degrees, as used by Camera
+        float pitch;
+    };
 
-    Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
-    float gLastX = WINDOW_WIDTH / 2.0f;
-    float gLastY = WINDOW_HEIGHT / 2.0F;
-    bool gFirstMouse = true;
-    float gDeltaTime = 0.0f;
-    float gLastFrame = 0.0f;
+    // Benchmark mode: the camera follows a path instead of the mouse and keyboard, and frame times are reported
+    struct Benchmark
+    {
+        bool isEnabled = false;
+        int warmupFrames = 120;
+        int measuredFrames = 600;
+        int frameIndex = 0;                 // Frames run so far, warm-up included
+        std::string output;                 // Path of the JSON report
+        std::string cameraPathFile;         // Recorded path to follow; empty for the built-in spline
+        std::vector<CameraKeyframe> path;
+        std::vector<double> frameTimesMs;   // Measured frames only
+        unsigned long long firstDrawCall = 0;   // gRenderStats.drawCalls when measuring started
+        unsigned long long firstUniformUpload = 0;      // and the other gRenderStats counters the report covers
+        unsigned long long firstUniformLookup = 0;
+        unsigned long long firstStateCall = 0;
+        unsigned long long firstFilteredStateCall = 0;
+        std::chrono::steady_clock::time_point frameStart;
+    };
 
-    // Object and light color
-    glm::vec3 gObjectColor(1.0f, 0.2f, 0.0f);
-    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
+    Benchmark gBenchmark;
 
-    // Light position and scale
-    glm::vec3 gLightPosition(-8.0f, 6.0f, 6.0f);
-    glm::vec3 gLightScale(0.3f);
+    // Check the SIMD paths and the mesh tools against known results before running (--self-check)
+    bool gIsSelfChecking = false;
 
-    bool gIsLampOrbiting = true;
-}
+    // Writes the live camera path to a file that --camera-path can replay
+    std::string gCameraRecordFile;
+    std::ofstream gCameraRecording;
+    float gCameraRecordTime = 0.0f;
 
-/* User-defined Function prototypes to:
- * initialize the program, set the window size,
- * redraw graphics on the window when resized,
- * and render graphics on the screen
- */
-bool UInitialize(int, char* [], GLFWwindow** window);
-void UResizeWindow(GLFWwindow* window, int width, int height);
-void UProcessInput(GLFWwindow* window);
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
-void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+    // Floats per interleaved vertex: position (3), normal (3), texture coordinate (2)
+    const GLuint FLOATS_PER_VERTEX = 8;
 
+    // Materials a mesh part can be shaded with
+    enum MaterialId
+    {
+        MATERIAL_HOUSE,
+        MATERIAL_ROOF,
+        MATERIAL_GRASS,
+        MATERIAL_DRIVEWAY,
+        MATERIAL_WALKWAY,
+        MATERIAL_TOP_HOUSE,
+        MATERIAL_RIGHT_LEFT_HOUSE,
+        MATERIAL_TOP_WINDOW,
+        MATERIAL_FRONT_DOOR,
+        MATERIAL_GARAGE,
+        MATERIAL_FRONT_WINDOW,
+        MATERIAL_FENCE,
+        MATERIAL_COUNT
+    };
 
-/* Vertex Shader Source Code*/
-const GLchar* objectVertexShaderSource = GLSL(440,
+    // Axis-aligned bounding box
+    struct BoundingBox
+    {
+        glm::vec3 min;
+        glm::vec3 max;
+    };
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
+    // Detail levels per part: the full mesh plus up to three quadric-simplified reductions
+    const GLuint MAX_LOD_LEVELS = 4;
 
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
+    // Triangle budget of each reduced level relative to the one before it
+    const float LOD_REDUCTION = 0.5f;
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    // A reduced level is only kept if it drops at least this share of the previous level's triangles
+    const float LOD_MIN_GAIN = 0.1f;
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    // Projected size (bounding radius over half the screen height) below which a house drops to the next level;
+    // halving with each level keeps a house's triangle count proportional to its screen coverage
+    const float LOD_SCREEN_SIZES[MAX_LOD_LEVELS - 1] = { 0.4f, 0.2f, 0.1f };
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    // Relative margin around each switch size, so a house hovering at one does not pop back and forth
+    const float LOD_HYSTERESIS = 0.1f;
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-}
-);
+    // One row of the mesh's draw table, suballocated from the shared vertex and index buffers
+    struct GLMeshPart
+    {
+        std::string name;   // Part name, for debugging
+        GLint baseVertex;   // First vertex of the part in the shared vertex buffer
+        GLuint firstIndex;  // First index of the part in the shared index buffer
+        GLsizei indexCount; // Number of indices of the part
+        GLuint material;    // MaterialId the part is shaded with
+        BoundingBox bounds; // Of the part's vertices, in mesh space
+        GLuint lodCount;    // Detail levels; level 0 is the full part (firstIndex, indexCount)
+        GLuint lodFirstIndex[MAX_LOD_LEVELS];   // Reduced levels index the part's own vertices
+        GLsizei lodIndexCount[MAX_LOD_LEVELS];
+    };
 
+    // Symmetric 4x4 error quadric (upper triangle, row by row) accumulated from triangle planes
+    struct Quadric
+    {
+        double m[10];
+    };
 
-/* Fragment Shader Source Code*/
-const GLchar* objectFragmentShaderSource = GLSL(440,
+    // Stores the GL data relative to a given mesh
+    struct GLMesh
+    {
+        GLuint vao;         // Handle for the vertex array object
+        GLuint vbos[2];     // Handles for the shared vertex and index buffer objects
+        std::vector<GLMeshPart> parts; // Draw table, one row per house part
+        GLuint lampPart;    // Row of the draw table the lamp is drawn with
+        BoundingBox bounds; // Of every part, in mesh space
+    };
 
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+    // Read-only view of a whole file; mapped rather than read, so its pages load as the upload touches them
+    struct MappedFile
+    {
+        const unsigned char* data;
+        size_t size;
+#ifdef _WIN32
+        HANDLE file;
+        HANDLE mapping;
+#endif
+    };
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    /* Binary mesh file: a header, the vertex stream, the index stream and the part table
+     * Both streams and the table start on MESH_FILE_ALIGNMENT, so each uploads straight from the mapped
+     * file. Reduced detail levels are stored in the index stream, so loading does no simplification.
+     * Values are in the byte order of the machine that wrote them; every target of this project is
+     * little-endian.
+     */
+    const char MESH_FILE_MAGIC[8] = { 'C', 'S', '3', '3', '0', 'M', 'S', 'H' };
+    const uint32_t MESH_FILE_VERSION = 1;
+    const size_t MESH_FILE_ALIGNMENT = 64;
+    const size_t MESH_PART_NAME_LENGTH = 32;
+
+    struct MeshFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;    // sizeof(MeshFileHeader)
+        uint32_t vertexStride;  // Bytes per vertex: position, normal and UV floats
+        uint32_t indexSize;     // Bytes per index
+        uint32_t partCount;
+        uint32_t lampPart;
+        uint64_t vertexOffset;
+        uint64_t vertexBytes;
+        uint64_t indexOffset;
+        uint64_t indexBytes;
+        uint64_t partOffset;    // partCount MeshFilePart rows
+        float boundsMin[3];
+        float boundsMax[3];
+    };
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform vec2 uvScale;
+    // One row of the part table, mirroring GLMeshPart
+    struct MeshFilePart
+    {
+        char name[MESH_PART_NAME_LENGTH];
+        int32_t baseVertex;
+        uint32_t firstIndex;
+        int32_t indexCount;
+        uint32_t material;
+        float boundsMin[3];
+        float boundsMax[3];
+        uint32_t lodCount;
+        uint32_t lodFirstIndex[MAX_LOD_LEVELS];
+        int32_t lodIndexCount[MAX_LOD_LEVELS];
+    };
 
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+    // The layouts are the file format; a change to either needs a new MESH_FILE_VERSION
+    static_assert(sizeof(MeshFileHeader) == 96, "Mesh file header layout changed");
+    static_assert(sizeof(MeshFilePart) == 108, "Mesh file part layout changed");
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.3f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+    // Mesh file to load instead of the built-in house (--mesh), and the file to export it to (--export-mesh)
+    std::string gMeshFile;
+    std::string gMeshExportFile;
 
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+    // Main GLFW window
+    GLFWwindow* gWindow = nullptr;
+    // Triangle mesh data
+    GLMesh gMesh;
+    // Scene textures, one layer of the texture array each
+    enum TextureLayer
+    {
+        LAYER_HOUSE,
+        LAYER_ROOF,
+        LAYER_GRASS,
+        LAYER_DRIVEWAY,
+        LAYER_SIDE_HOUSE,
+        LAYER_RIGHT_LEFT_HOUSE,
+        LAYER_TOP_WINDOW,
+        LAYER_FRONT_DOOR,
+        LAYER_GARAGE,
+        LAYER_OFFICE_WINDOW,
+        LAYER_FENCE,
+        LAYER_COUNT
+    };
 
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+    // Source image of each texture layer
+    const char* const TEXTURE_FILES[LAYER_COUNT] = {
+        "House Texture.jpg",
+        "Roof Tile.jpg",
+        "Kentucky Bluegrass Lawn.jpg",
+        "Driveway.jpg",
+        "Side House Texture.jpg",
+        "RightLeftHouseTexture.jpg",
+        "TopHouseWindowTexture.jpg",
+        "FrontDoor.jpg",
+        "Garage.jpg",
+        "OfficeWindow.jpg",
+        "Fence.jpg"
+    };
 
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    // Largest layer edge; every image is resampled to one square power-of-two size up to this
+    const int MAX_TEXTURE_LAYER_SIZE = 512;
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    // Block-compressed copy of one texture layer with its whole mip chain, as baked into the KTX2
+    // cache next to the source image (House Texture.jpg -> House Texture.jpg.ktx2)
+    struct CompressedImage
+    {
+        GLenum format;                      // GL_COMPRESSED_RGB_S3TC_DXT1_EXT (BC1) or GL_COMPRESSED_RGBA_S3TC_DXT5_EXT (BC3); 0 if not loaded
+        int size;                           // Edge of the square base level
+        std::vector<unsigned char> data;    // Every level, base level first
+        std::vector<size_t> levelOffsets;
+        std::vector<size_t> levelSizes;
+    };
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
+    const char* const TEXTURE_CACHE_EXTENSION = ".ktx2";
+    // Key of the KTX2 key/value entry holding the hash a cache file was baked from
+    const char* const TEXTURE_CACHE_HASH_KEY = "CS330sourceHash";
+    // Part of every hash; bump it whenever the baked output changes so older caches miss
+    const uint64_t TEXTURE_CACHE_VERSION = 2;
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
+    // Vulkan format numbers KTX2 files identify their block format with
+    const uint32_t VK_FORMAT_BC1_RGB_UNORM_BLOCK = 131;
+    const uint32_t VK_FORMAT_BC3_UNORM_BLOCK = 137;
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    // Bake the compressed texture cache before loading (--bake-textures)
+    bool gIsBakingTextures = false;
 
-        //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    // Downsampling filter of the CPU-built mip chains
+    enum MipFilter
+    {
+        MIP_FILTER_BOX,     // 2x2 average
+        MIP_FILTER_KAISER   // 8-tap Kaiser-windowed sinc (alpha 4), sharper and with less aliasing
+    };
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-}
-);
+    // Separable 2:1 downsampling kernel in 2.14 fixed point. Output texel x is centered between source texels
+    // 2x and 2x + 1; tap t reads texel 2x + firstOffset + t. The tap count is even, so taps pair up for madd.
+    struct MipKernel
+    {
+        int tapCount;
+        int firstOffset;
+        int16_t weights[8];
+    };
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+    // Integer weights are part of the output, so they are written out rather than computed at startup;
+    // each set sums to exactly 1 << MIP_WEIGHT_BITS
+    const int MIP_WEIGHT_BITS = 14;
+    const MipKernel MIP_KERNELS[] = {
+        { 2, 0, { 8192, 8192 } },
+        { 8, -3, { -204, -704, 1916, 7184, 7184, 1916, -704, -204 } }
+    };
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+    // Mip chains are filtered in linear light at 15 bits per channel, so the SIMD passes can use signed 16-bit madd
+    const int LINEAR_MAX = 32767;
+
+    // 8-bit sRGB to 15-bit linear, rounded to nearest. Spelled out rather than computed with std::pow, so
+    // every build and machine decodes identically.
+    const int16_t SRGB_TO_LINEAR[256] = {
+        0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 99, 110, 120, 132, 144, 157,
+        170, 184, 198, 213, 229, 246, 263, 281, 299, 319, 338, 359, 380, 403, 425, 449,
+        473, 498, 524, 551, 578, 606, 635, 665, 695, 727, 759, 792, 825, 860, 895, 931,
+        968, 1006, 1045, 1085, 1125, 1167, 1209, 1252, 1296, 1341, 1386, 1433, 1481, 1529, 1578, 1629,
+        1680, 1732, 1785, 1839, 1894, 1950, 2007, 2065, 2123, 2183, 2244, 2305, 2368, 2432, 2496, 2562,
+        2629, 2696, 2765, 2834, 2905, 2977, 3049, 3123, 3198, 3273, 3350, 3428, 3507, 3587, 3668, 3750,
+        3833, 3917, 4002, 4088, 4176, 4264, 4354, 4444, 4536, 4629, 4723, 4818, 4914, 5011, 5109, 5209,
+        5309, 5411, 5514, 5618, 5723, 5829, 5936, 6045, 6154, 6265, 6377, 6490, 6604, 6720, 6836, 6954,
+        7073, 7193, 7315, 7437, 7561, 7686, 7812, 7939, 8067, 8197, 8328, 8460, 8593, 8728, 8863, 9000,
+        9139, 9278, 9419, 9560, 9704, 9848, 9994, 10140, 10288, 10438, 10588, 10740, 10893, 11048, 11204, 11360,
+        11519, 11678, 11839, 12001, 12164, 12329, 12495, 12662, 12831, 13000, 13172, 13344, 13518, 13693, 13869, 14047,
+        14226, 14406, 14588, 14771, 14955, 15141, 15328, 15516, 15706, 15897, 16089, 16283, 16478, 16675, 16872, 17071,
+        17272, 17474, 17677, 17882, 18088, 18295, 18504, 18714, 18926, 19138, 19353, 19569, 19786, 20004, 20224, 20445,
+        20668, 20892, 21118, 21345, 21573, 21803, 22034, 22267, 22501, 22736, 22973, 23211, 23451, 23692, 23935, 24179,
+        24425, 24672, 24920, 25170, 25421, 25674, 25928, 26184, 26441, 26700, 26960, 27222, 27485, 27749, 28016, 28283,
+        28552, 28823, 29095, 29368, 29643, 29920, 30197, 30477, 30758, 31040, 31324, 31610, 31897, 32185, 32475, 32767
+    };
 
-void main()
-{
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
+    MipFilter gMipFilter = MIP_FILTER_KAISER;
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
+    // Widest SIMD path the mip filter passes may take, where the build has it; --self-check steps it down to
+    // compare each path with the scalar one
+    enum MipSimd
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        MIP_SIMD_SCALAR,
+        MIP_SIMD_SSE2,
+        MIP_SIMD_AVX2
+    };
+    MipSimd gMipSimd = MIP_SIMD_AVX2;
 
-        for (int i = width * channels; i > 0; --i)
+    // Texture array holding every scene texture
+    GLuint gTextureArrayId;
+
+    // Fixed-size pool of worker threads for CPU work that can run off the GL thread
+    class ThreadPool
+    {
+    public:
+        ~ThreadPool()
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            Stop();
         }
-    }
-}
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+        // Starts the workers; a count of 0 (unknown core count) still starts one
+        void Start(unsigned threadCount)
+        {
+            stopping = false;
+            for (unsigned i = 0; i < std::max(threadCount, 1u); ++i)
+                workers.emplace_back([this] { WorkerLoop(); });
+        }
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+        // Finishes the queued tasks and joins the workers
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            for (std::thread& worker : workers)
+                worker.join();
+            workers.clear();
+        }
 
-    // Create the shader program
-    if (!UCreateShaderProgram(objectVertexShaderSource, objectFragmentShaderSource, gProgramId))
-        return EXIT_FAILURE;
+        // Queues a task and returns a future for its result
+        template <typename Function>
+        auto Submit(Function function) -> std::future<decltype(function())>
+        {
+            typedef decltype(function()) Result;
+            std::shared_ptr<std::packaged_task<Result()>> task = std::make_shared<std::packaged_task<Result()>>(function);
+            std::future<Result> result = task->get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push([task] { (*task)(); });
+            }
+            condition.notify_one();
+            return result;
+        }
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+    private:
+        void WorkerLoop()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        std::queue<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool stopping = false;
+    };
+
+    // Workers for image decoding and other startup work
+    ThreadPool gThreadPool;
+    glm::vec2 gUVScale(1.0f, 1.0f);
+    glm::vec2 gRoofScale(2.0f, 2.0f);
+    glm::vec2 gGrassScale(1.0f, 1.0f);
+    glm::vec2 gDrivewayScale(1.0f, 1.0f);
+    GLint gTextWrapMode = GL_REPEAT;
 
-    // Load texture
-    const char* texFilename = "House Texture.jpg";
-    if (!UCreateTexture(texFilename, gTextureId))
+    // Feature bits of the object shader; every combination in use is compiled as its own program,
+    // with a #define of the feature's name for each bit set
+    enum ShaderFeature
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    
-    texFilename = "Roof Tile.jpg";
-    if (!UCreateTexture(texFilename, roofTextureId))
+        SHADER_FEATURE_TEXTURE = 1 << 0,            // Sample the scene texture array, otherwise shade with objectColor
+        SHADER_FEATURE_SPECULAR = 1 << 1,           // Add the Phong specular highlight
+        SHADER_FEATURE_DRAW_PARAMETERS = 1 << 2,    // Read per-draw data by gl_DrawIDARB, for the indirect paths
+        SHADER_FEATURE_DEPTH_ONLY = 1 << 3          // Position only and an empty fragment shader, for the depth prepass
+    };
+
+    const GLuint SHADER_FEATURE_COUNT = 4;
+    const GLuint SHADER_VARIANT_COUNT = 1 << SHADER_FEATURE_COUNT;
+    const char* const SHADER_FEATURE_NAMES[SHADER_FEATURE_COUNT] = {
+        "SHADER_FEATURE_TEXTURE", "SHADER_FEATURE_SPECULAR", "SHADER_FEATURE_DRAW_PARAMETERS", "SHADER_FEATURE_DEPTH_ONLY"
+    };
+
+    // Features the render path and pass choose, rather than the material
+    const GLuint SHADER_FEATURES_OF_PATH = SHADER_FEATURE_DRAW_PARAMETERS | SHADER_FEATURE_DEPTH_ONLY;
+
+    // How each material is shaded: its texture layer and UV scale, and the shader features it needs.
+    // Matte surfaces leave out the specular term, so they get the cheaper variant.
+    struct GLMaterial
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        GLuint textureLayer;
+        const glm::vec2* uvScale;
+        GLuint features;            // ShaderFeature bits; never SHADER_FEATURES_OF_PATH, which the render path adds
+    };
+
+    const GLuint MATERIAL_MATTE = SHADER_FEATURE_TEXTURE;
+    const GLuint MATERIAL_GLOSSY = SHADER_FEATURE_TEXTURE | SHADER_FEATURE_SPECULAR;
+
+    constexpr GLMaterial gMaterials[MATERIAL_COUNT] = {
+        { LAYER_HOUSE, &gUVScale, MATERIAL_GLOSSY },                // MATERIAL_HOUSE
+        { LAYER_ROOF, &gRoofScale, MATERIAL_MATTE },                // MATERIAL_ROOF
+        { LAYER_GRASS, &gGrassScale, MATERIAL_MATTE },              // MATERIAL_GRASS
+        { LAYER_DRIVEWAY, &gDrivewayScale, MATERIAL_MATTE },        // MATERIAL_DRIVEWAY
+        { LAYER_DRIVEWAY, &gUVScale, MATERIAL_MATTE },              // MATERIAL_WALKWAY
+        { LAYER_SIDE_HOUSE, &gUVScale, MATERIAL_GLOSSY },           // MATERIAL_TOP_HOUSE
+        { LAYER_RIGHT_LEFT_HOUSE, &gUVScale, MATERIAL_GLOSSY },     // MATERIAL_RIGHT_LEFT_HOUSE
+        { LAYER_TOP_WINDOW, &gUVScale, MATERIAL_GLOSSY },           // MATERIAL_TOP_WINDOW
+        { LAYER_FRONT_DOOR, &gUVScale, MATERIAL_GLOSSY },           // MATERIAL_FRONT_DOOR
+        { LAYER_GARAGE, &gUVScale, MATERIAL_GLOSSY },               // MATERIAL_GARAGE
+        { LAYER_OFFICE_WINDOW, &gUVScale, MATERIAL_GLOSSY },        // MATERIAL_FRONT_WINDOW
+        { LAYER_FENCE, &gUVScale, MATERIAL_MATTE }                  // MATERIAL_FENCE
+    };
 
-    texFilename = "Kentucky Bluegrass Lawn.jpg";
-    if (!UCreateTexture(texFilename, grassTextureId))
+    // The render path decides SHADER_FEATURES_OF_PATH, not the material
+    constexpr bool UHasOnlyMaterialFeatures(GLuint index)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        return index == MATERIAL_COUNT
+            || ((gMaterials[index].features & SHADER_FEATURES_OF_PATH) == 0 && UHasOnlyMaterialFeatures(index + 1));
     }
+    static_assert(UHasOnlyMaterialFeatures(0), "Materials must not set SHADER_FEATURES_OF_PATH");
 
-    texFilename = "Driveway.jpg";
-    if (!UCreateTexture(texFilename, drivewayTextureId))
+    // Uniform locations resolved once when a program is linked (-1 when the program does not use one)
+    struct GLProgramUniforms
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        GLint model;
+        GLint objectColor;
+        GLint uvScale;
+        GLint texture;
+        GLint textureLayer;
+        GLint drawOffset;   // First command of the current glMultiDrawElementsIndirect, added to gl_DrawIDARB
+        GLint shadowMap;
+    };
 
-    texFilename = "Side House Texture.jpg";
-    if (!UCreateTexture(texFilename, tophouseTextureId))
+    // A program handed to the driver but not yet checked, so several compile at once: with
+    // GL_KHR_parallel_shader_compile on driver threads, while the CPU goes on loading textures
+    struct ShaderProgramBuild
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        GLuint programId;
+        GLuint shaders[2];          // Compiled stages; none when the program came from the cache
+        GLenum stages[2];
+        GLsizei shaderCount;
+        uint64_t hash;              // Of the sources and the driver, naming the cache file
+        bool isCached;
+    };
 
-    texFilename = "RightLeftHouseTexture.jpg";
-    if (!UCreateTexture(texFilename, rightleftHouseTextureID))
+    // Header of a program cache file (program-HASH.bin); the glGetProgramBinary blob follows
+    struct ProgramCacheHeader
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        char magic[4];              // "CSPB"
+        uint32_t version;           // PROGRAM_CACHE_VERSION
+        uint64_t hash;              // Must match the name's; guards against renamed files
+        uint32_t binaryFormat;      // As returned by glGetProgramBinary
+        uint32_t binaryLength;
+    };
+    static_assert(sizeof(ProgramCacheHeader) == 24, "Program cache header layout");
+
+    // Part of every program hash; bump it whenever the cache file layout changes
+    const uint32_t PROGRAM_CACHE_VERSION = 1;
 
-    texFilename = "TopHouseWindowTexture.jpg";
-    if (!UCreateTexture(texFilename, topWindowTextureId))
+    // Off with --no-shader-cache, or when the driver offers no program binary formats
+    bool gIsProgramCacheEnabled = true;
+
+    // Per-frame camera and light data shared by every program (std140 layout of the FrameData block)
+    struct GLFrameData
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 lightPosition;    // xyz used
+        glm::vec4 lightColor;       // rgb used
+        glm::vec4 viewPosition;     // xyz used
+        glm::vec4 overdrawView;     // x is 1 when the houses draw as an overdraw heatmap
+    };
+
+    // Uniform buffer binding point of the FrameData block
+    const GLuint FRAME_DATA_BINDING = 0;
+
+    // Frames the streaming ring buffer keeps in flight, one region each
+    const GLuint STREAM_REGION_COUNT = 3;
+    // Initial bytes per region; a frame that needs more grows the buffer
+    const GLsizeiptr STREAM_REGION_SIZE = 1 << 20;
 
-    texFilename = "FrontDoor.jpg";
-    if (!UCreateTexture(texFilename, frontDoorTextureId))
+    /* Ring buffer for data written every frame, mapped once with GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT
+     * It is split into STREAM_REGION_COUNT regions used round robin, one per frame. Each region is fenced
+     * when its frame has been submitted, and the CPU only writes a region again after its fence signals,
+     * which with three regions it normally has two frames earlier.
+     */
+    struct GLStreamBuffer
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        GLuint buffer;
+        unsigned char* mapping;         // The whole buffer, mapped for its lifetime
+        GLsizeiptr regionSize;
+        GLuint region;                  // Region the current frame writes
+        GLsizeiptr head;                // Next free byte of that region
+        GLsync fences[STREAM_REGION_COUNT];
+        GLint uniformAlignment;         // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+        GLint storageAlignment;         // GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT
+        std::vector<GLuint> retiredBuffers; // Replaced by grows this frame, deleted at the next frame
+        std::vector<unsigned char> overflow;    // Takes the writes of blocks a failed grow could not place
+    };
 
-    texFilename = "Garage.jpg";
-    if (!UCreateTexture(texFilename, garageTextureId))
+    // Block suballocated from the stream buffer; valid until the end of the frame that allocated it
+    struct StreamBlock
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        void* data;         // Where the CPU writes
+        GLuint buffer;      // Stream buffer the block was allocated from; a later grow this frame does not move it
+        GLintptr offset;    // Where the GPU reads, in that buffer
+        GLsizeiptr size;
+    };
+    // Shader storage binding point of the indirect path's per-draw data
+    const GLuint DRAW_DATA_BINDING = 1;
 
-    texFilename = "OfficeWindow.jpg";
-    if (!UCreateTexture(texFilename, frontDoorTextureId))
+    // How URender submits the house parts
+    enum RenderPath
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
+        RENDER_PATH_DIRECT,     // One bind-uniform-bind-texture-draw sequence per part
+        RENDER_PATH_INDIRECT    // Every part in one glMultiDrawElementsIndirect call
+    };
 
-    texFilename = "Fence.jpg";
-    if (!UCreateTexture(texFilename, fenceTextureId))
+    // Command layout read by glMultiDrawElementsIndirect
+    struct DrawElementsIndirectCommand
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
 
-    
+    // Per-draw data the indirect path fetches with gl_DrawID (std430 layout of DrawData)
+    struct GLDrawData
+    {
+        glm::mat4 model;
+        glm::vec2 uvScale;
+        GLuint textureLayer;    // Layer of the scene texture array sampled by the draw
+        GLuint padding;
+    };
 
-    /*glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 1);
+    // Commands of the part table shaded by one object shader variant, submitted in one indirect call
+    struct GLIndirectBatch
+    {
+        GLuint features;        // Variant, SHADER_FEATURE_DRAW_PARAMETERS included
+        GLsizei firstCommand;
+        GLsizei commandCount;
+    };
 
-    
+    // GL data for submitting a mesh's part table in one indirect call per shader variant
+    struct GLIndirectDraws
+    {
+        GLuint commandBuffer;   // DrawElementsIndirectCommand per part
+        GLuint drawDataBuffer;  // GLDrawData per part
+        GLsizei drawCount;
+        std::vector<DrawElementsIndirectCommand> commands;  // CPU copy, rewritten when the instance count changes
+        std::vector<GLuint> partOrder;          // Part of each run of MAX_LOD_LEVELS commands, grouped by variant
+        std::vector<GLIndirectBatch> batches;
+    };
 
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 2);*/
+    // First vertex attribute location of the per-instance data; a mat4 takes four locations
+    const GLuint INSTANCE_MODEL_LOCATION = 3;
+    const GLuint INSTANCE_VARIATION_LOCATION = 7;
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.74902f, 0.847059f, 0.847059f, 1.0f);
+    // Per-house data read through instanced vertex attributes (divisor 1)
+    struct GLInstanceData
+    {
+        glm::mat4 model;        // Placement of the house; the mesh's own model matrix is applied first
+        glm::vec4 variation;    // rgb tint applied to the house's textures, a unused
+    };
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    // Instance buffer with bulk add, remove and update. Instances stay densely packed so one instanced draw
+    // covers them all; handles stay valid while other instances are removed around them.
+    struct GLInstanceBuffer
     {
-        // per-frame timing
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        GLuint buffer;
+        size_t capacity;                        // Instances the GL buffer has room for; grows by doubling
+        std::vector<GLInstanceData> instances;  // CPU copy, in draw order
+        std::vector<GLuint> handleSlots;        // Handle -> index in instances, or INSTANCE_SLOT_FREE
+        std::vector<GLuint> slotHandles;        // Index in instances -> handle
+        std::vector<GLuint> freeHandles;        // Handles of removed instances, reused first
+        size_t dirtyBegin;                      // Range of instances changed since the last upload
+        size_t dirtyEnd;
+        bool isLayoutChanged;                   // Instances added or removed since the BVH was built, or too many moved to refit
+        std::vector<GLuint> movedSlots;         // Instances updated since the BVH was refit; at most one per instance
+        std::vector<GLubyte> lods;              // Detail level each instance was last drawn at, for hysteresis
+        unsigned long long version;             // Bumped by every add, remove and update
+    };
 
-        // input
-        // -----
-        UProcessInput(gWindow);
+    const size_t INITIAL_INSTANCE_CAPACITY = 64;
 
-        // Render this frame
-        URender();
+    // Slot of a handle whose instance has been removed
+    const GLuint INSTANCE_SLOT_FREE = ~0u;
 
-        glfwPollEvents();
-    }
+    // Vertex buffer binding the instance attributes read from; past the bindings glVertexAttribPointer uses for 0-7
+    const GLuint INSTANCE_BINDING = 8;
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
+    // Bounding volume hierarchy node; children are allocated as a pair, so a node's right child is left + 1
+    struct BvhNode
+    {
+        BoundingBox bounds;
+        GLuint parent;
+        GLuint left;        // 0 for leaves (the root is never a child)
+        GLuint firstItem;   // Items of the whole subtree are contiguous in InstanceBvh::items
+        GLuint itemCount;
+    };
 
-    // Release texture
-    UDestroyTexture(gTextureId);
-    UDestroyTexture(roofTextureId);
-    UDestroyTexture(grassTextureId);
-    UDestroyTexture(drivewayTextureId);
-    UDestroyTexture(tophouseTextureId);
-    UDestroyTexture(rightleftHouseTextureID);
-    UDestroyTexture(topWindowTextureId);
-    UDestroyTexture(frontDoorTextureId);
-    UDestroyTexture(garageTextureId);
-    UDestroyTexture(frontWindowTextureId);
-    UDestroyTexture(fenceTextureId);
+    // BVH over instance world bounds. Moving instances refits it; adding or removing instances rebuilds it.
+    struct InstanceBvh
+    {
+        std::vector<BvhNode> nodes;         // Parents before children; nodes[0] is the root
+        std::vector<GLuint> items;          // Instance slots, grouped by leaf
+        std::vector<BoundingBox> bounds;    // World bounds per instance slot
+        std::vector<GLuint> slotLeaves;     // Instance slot -> leaf node holding it
+        std::vector<char> isNodeDirty;      // Scratch for refits
+    };
 
-    // Release shader program
-    UDestroyShaderProgram(gProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    // Instances per BVH leaf
+    const GLuint BVH_LEAF_SIZE = 4;
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
-}
+    // Traversal stack entries. Median splits keep a BVH over 2^32 instances within 31 levels, and a
+    // depth-first walk holds at most one pending sibling per level.
+    const int BVH_STACK_SIZE = 64;
 
+    // View frustum planes (ax + by + cz + d >= 0 inside), stored plane-per-lane for the SSE test;
+    // lanes 6 and 7 repeat the far plane
+    struct Frustum
+    {
+        alignas(16) float a[8];
+        alignas(16) float b[8];
+        alignas(16) float c[8];
+        alignas(16) float d[8];
+    };
 
-// Initialize GLFW, GLEW, and create a window
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
-{
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    enum FrustumTest
+    {
+        FRUSTUM_OUTSIDE,
+        FRUSTUM_INTERSECTS,
+        FRUSTUM_INSIDE
+    };
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
+    // Frustum culling results of the last frame
+    struct CullStats
+    {
+        GLuint nodesTested;
+        GLuint visibleInstances;
+        GLuint culledInstances;
+        GLuint occludedInstances;   // Of the frustum-visible houses, rejected by the Hi-Z test (one frame late)
+    };
+
+    // Shader storage bindings of the occlusion culling passes
+    const GLuint OCCLUSION_CANDIDATE_BINDING = 2;
+    const GLuint OCCLUSION_VISIBLE_BINDING = 3;
+    const GLuint OCCLUSION_COUNTER_BINDING = 4;
+    const GLuint OCCLUSION_COMMAND_BINDING = 5;
 
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+    // Texture unit the occlusion passes sample depth from; unit 0 keeps the scene texture array
+    const GLuint OCCLUSION_TEXTURE_UNIT = 1;
+
+    // Work group sizes of the occlusion compute shaders
+    const GLuint OCCLUSION_TILE_SIZE = 8;
+    const GLuint OCCLUSION_GROUP_SIZE = 64;
+
+    // GPU occlusion culling: a max-depth pyramid (Hi-Z) built from the previous frame's depth buffer, a compute
+    // pass that tests each frustum-visible house against it and compacts the survivors per detail level, and
+    // a pass that writes the indirect commands drawing them
+    struct GLOcclusionCulling
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
-    }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+        GLuint depthProgram;        // Depth buffer copy -> pyramid level 0
+        GLuint downsampleProgram;   // Pyramid level -> next level
+        GLuint cullProgram;         // Houses -> visible houses and counts
+        GLuint commandProgram;      // Counts -> indirect commands
+
+        GLuint depthTexture;        // Copy of the frame's depth buffer
+        GLuint hiZTexture;          // R32F, each texel the farthest depth beneath it
+        GLsizei width;
+        GLsizei height;
+        GLsizei levelCount;
+        glm::mat4 viewProjection;   // Of the frame the pyramid was built from
+        bool hasPyramid;
+
+        GLuint instanceBuffer;      // Houses that passed, each level starting at its bucket
+        size_t instanceCapacity;
+        GLuint commandBuffer;       // GPU-written copy of the indirect commands
+        GLuint counterBuffer;       // Houses that passed, per level
+        GLuint readbackBuffer;      // Counter copy read a frame later for the stats
+        GLsync readbackFence;
+        GLuint readbackCandidates;  // Houses tested in the frame being read back
+
+        // Uniform locations
+        GLint cullViewProjection;
+        GLint cullMeshModel;
+        GLint cullBoundsMin;
+        GLint cullBoundsMax;
+        GLint cullCandidateCount;
+        GLint cullLodBuckets;
+        GLint commandLodBuckets;
+        GLint commandCount;
+    };
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+    // Distance between neighboring houses of the --houses grid; one lot is about 7 x 8 units
+    const float HOUSE_SPACING = 9.0f;
 
-    if (GLEW_OK != GlewInitResult)
+    // GL calls issued by URender, accumulated over the whole run
+    struct RenderStats
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
-    }
+        unsigned long long frames;
+        unsigned long long drawCalls;
+        unsigned long long uniformUploads;
+        unsigned long long uniformLookups;
+        unsigned long long bufferUploads;
+        unsigned long long textureBinds;
+        unsigned long long programSwitches;     // glUseProgram calls of the draw programs
+        unsigned long long vaoBinds;
+        unsigned long long stateCalls;          // State changes requested through the state cache
+        unsigned long long filteredStateCalls;  // Of those, the ones the cache dropped as redundant
+        unsigned long long visibleInstances;
+        unsigned long long culledInstances;
+        unsigned long long occludedInstances;
+        unsigned long long streamStalls;    // Frames that waited for the GPU to release a stream region
+        unsigned long long indices;     // Indices submitted across all instances
+        unsigned long long lightAssignments;    // Entries in the clustered light lists
+        unsigned long long shadowUpdates;       // Frames that re-rendered the cached shadow map
+        unsigned long long shadedSamples;       // Samples that passed the depth test in the house color pass
+        unsigned long long sampledFrames;       // Frames whose shadedSamples have been read back
+    };
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    // One built permutation of the object shader
+    struct GLShaderVariant
+    {
+        GLuint programId;           // 0 if no material needs the variant
+        GLProgramUniforms uniforms;
+    };
 
-    return true;
-}
+    // Shader program
+    GLShaderVariant gObjectVariants[SHADER_VARIANT_COUNT];  // Indexed by ShaderFeature bits
 
+    // Passes of the draw list, in the order they run
+    enum DrawPass
+    {
+        DRAW_PASS_DEPTH,    // Depth prepass, with color writes off
+        DRAW_PASS_OPAQUE,   // Shaded houses
+        DRAW_PASS_LAMP      // Unlit lamp, once the houses have restored the depth test
+    };
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
-{
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    // Program field of a draw key: object shader variants by their ShaderFeature bits, then the lamp
+    const GLuint DRAW_PROGRAM_LAMP = SHADER_VARIANT_COUNT;
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-        gCamera.ProcessKeyboard(UP, gDeltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
-    }
-    
-    // Pause and resume lamp orbiting
-    static bool isLKeyDown = false;
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
-        gIsLampOrbiting = false;
-}
+    // A draw key holds, most significant byte first: pass, program, material + 1 (0 for none) and vertex array
+    // slot, then 32 bits of view depth. Sorted keys group draws by state, and within equal state go nearest first.
+    const unsigned DRAW_KEY_PASS_SHIFT = 56;
+    const unsigned DRAW_KEY_PROGRAM_SHIFT = 48;
+    const unsigned DRAW_KEY_MATERIAL_SHIFT = 40;
+    const unsigned DRAW_KEY_VAO_SHIFT = 32;
 
+    // One instanced draw of the frame; the state it needs is all in its key, except the model matrix
+    struct DrawItem
+    {
+        uint64_t key;
+        GLuint model;           // Index into DrawList::models
+        GLsizei indexCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint firstInstance;
+        GLuint instanceCount;
+    };
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
+    // Marks executor state it cannot know, e.g. after another path bound its own program
+    const GLuint DRAW_STATE_UNKNOWN = ~0u;
 
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos) {
-    if (gFirstMouse) {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
-    }
+    // The frame's draws, sorted by key, and the state the executor last set so that it only emits
+    // the transitions between consecutive keys
+    struct DrawList
+    {
+        std::vector<DrawItem> items;
+        std::vector<DrawItem> sortScratch;
+        std::vector<glm::mat4> models;
+        std::vector<GLuint> vaos;       // Vertex array of each key slot
+        GLuint program;                 // Program field of the last key, or DRAW_STATE_UNKNOWN
+        GLuint material;
+        GLuint vao;                     // Bound vertex array name
+        GLuint model;
+    };
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos;
+    DrawList gDrawList;
+    GLuint gLampProgramId;
+    GLProgramUniforms gLampProgramUniforms;
+
+    // Indirect submission of the house, toggled at runtime with the I key or --indirect
+    RenderPath gRenderPath = RENDER_PATH_DIRECT;
+    bool gIsIndirectSupported = false;
+    GLIndirectDraws gIndirectDraws;
+
+    // Every house of the neighborhood, drawn with one instanced draw per part
+    GLInstanceBuffer gHouseInstances;
+    int gHouseCount = 1;
+
+    // Frustum culling of the houses, toggled with the C key or --no-cull; visible houses are copied into
+    // a second buffer each frame and drawn from there
+    bool gIsCullingEnabled = true;
+    InstanceBvh gHouseBvh;
+    std::vector<GLuint> gVisibleSlots;
+    std::vector<GLInstanceData> gVisibleInstances;  // Ordered by detail level
+    StreamBlock gVisibleInstanceBlock = {};    // In gStreamBuffer
+    CullStats gCullStats = {};
+
+    // Distance-based detail levels for visible houses, toggled with the O key or --no-lod.
+    // Houses of level i are instances [gLodBuckets[i], gLodBuckets[i + 1]) of the drawn instance buffer.
+    bool gIsLodEnabled = true;
+    GLuint gLodBuckets[MAX_LOD_LEVELS + 1];
+
+    // Hi-Z occlusion culling of the frustum-visible houses, toggled with the H key or --occlusion.
+    // It draws through the indirect program, so it needs the same support as the indirect path.
+    bool gIsOcclusionEnabled = false;
+    bool gIsOcclusionSupported = false;
+    GLOcclusionCulling gOcclusion;
+
+    // Houses are first drawn depth only, then shaded with GL_EQUAL so each pixel runs the object shader once.
+    // Toggled with the Z key or --depth-prepass.
+    bool gIsDepthPrepassEnabled = false;
+
+    // Shows how many fragments each pixel shaded instead of the lit scene, toggled with the V key or --overdraw
+    bool gIsOverdrawView = false;
+
+    // Counts the samples the house color pass shades. Two queries alternate, so each result is read a frame
+    // after it was issued and normally without a stall.
+    struct GLSampleCounter
+    {
+        GLuint queries[2];
+        bool isPending[2];
+        unsigned frame;
+    };
 
-    gLastX = xpos;
-    gLastY = ypos;
+    GLSampleCounter gSampleCounter = {};
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
-}
+    // Depth range of the camera's projection
+    const float CAMERA_NEAR = 0.1f;
+    const float CAMERA_FAR = 100.0f;
 
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
-{
-    gCamera.ProcessMouseScroll(yoffset);
-}
+    // Point light of the neighborhood, as the object shader reads it (std430)
+    struct GLPointLight
+    {
+        glm::vec4 positionRadius;   // World-space position, and the distance at which the light fades out
+        glm::vec4 color;            // rgb intensity, a unused
+    };
 
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
-{
-    switch (button)
+    // Light list of one cluster: a range of the cluster light index list (std430 uvec2)
+    struct GLClusterRange
     {
-    case GLFW_MOUSE_BUTTON_LEFT:
+        GLuint offset;
+        GLuint count;
+    };
+
+    // How the object shader finds a fragment's cluster (std140 layout of the ClusterData block)
+    struct GLClusterData
     {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
-    }
-    break;
+        glm::uvec4 grid;            // Tiles across and down, depth slices, unused
+        glm::vec4 depth;            // Slice = log(view depth) * x + y
+        glm::vec4 screen;           // Tiles per pixel across and down in xy, zw unused
+    };
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    // Clustered forward lighting: the view frustum is cut into tiles across the screen and exponential slices
+    // in depth, and every cluster lists the point lights whose range touches it
+    const GLuint CLUSTER_TILES_X = 16;
+    const GLuint CLUSTER_TILES_Y = 9;
+    const GLuint CLUSTER_SLICES = 24;
+    const GLuint CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+    // Binding points of the clustered light data; storage bindings 2-5 belong to occlusion culling
+    const GLuint CLUSTER_DATA_BINDING = 1;      // Uniform buffer
+    const GLuint POINT_LIGHT_BINDING = 6;
+    const GLuint CLUSTER_RANGE_BINDING = 7;
+    const GLuint CLUSTER_INDEX_BINDING = 8;
+
+    // Lights of the neighborhood and this frame's cluster lists
+    struct ClusteredLights
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
-    }
-    break;
+        std::vector<GLPointLight> lights;       // World space, placed once with the houses
+        GLuint lightBuffer;                     // GL copy of lights
+        std::vector<GLuint> lightClusters;      // Per light in view: its index, then first and last tile across, down and slice
+        std::vector<GLClusterRange> ranges;     // CLUSTER_COUNT entries
+        std::vector<GLuint> indices;            // Every cluster's light indices, cluster after cluster
+    };
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    // Omnidirectional shadow map of the lamp: a cube of distances from the light, normalized by SHADOW_FAR.
+    // Static casters are rendered into a cached cube that is only redrawn when it goes stale; frames with
+    // dynamic casters copy it and draw those on top.
+    struct GLShadowMap
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
-    }
-    break;
+        GLuint program;
+        GLint modelUniform;
+        GLint viewProjectionUniform;
+        GLint lightUniform;
+        GLuint staticTexture;               // Cached static casters
+        GLuint compositeTexture;            // Static copy plus this frame's dynamic casters
+        GLuint sampledTexture;              // What this frame's objects are shaded with
+        GLuint framebuffer;
+        bool isValid;                       // staticTexture was rendered from lightPosition with casterVersion
+        glm::vec3 lightPosition;
+        unsigned long long casterVersion;   // GLInstanceBuffer::version of the static casters
+    };
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
-}
+    const GLsizei SHADOW_MAP_SIZE = 1024;
+    const float SHADOW_NEAR = 0.1f;
+    const float SHADOW_FAR = 50.0f;
 
+    // How far the lamp may move before the cached map is redrawn; shadows lag the light by at most this much
+    const float SHADOW_MOVE_THRESHOLD = 0.25f;
 
-// Functioned called to render a frame
-void URender()
-{
+    // Texture unit of the shadow cube and uniform buffer binding of the ShadowData block
+    const GLuint SHADOW_TEXTURE_UNIT = 2;
+    const GLuint SHADOW_DATA_BINDING = 2;
 
-    const float angularVelocity = glm::radians(45.0f);
-    if (gIsLampOrbiting)
+    // Lamp shadows, switched off with --no-shadows
+    bool gIsShadowEnabled = true;
+    GLShadowMap gShadowMap;
+
+    // Houses moving on their own, outside the instance buffer; drawn into every frame's shadow map
+    std::vector<GLInstanceData> gDynamicCasters;
+
+    // A small house driving around the middle lot, switched on with --moving-house
+    bool gIsHouseMoving = false;
+    const float MOVING_HOUSE_RADIUS = 0.5f * HOUSE_SPACING;
+    const float MOVING_HOUSE_ANGULAR_VELOCITY = 0.5f;   // Radians per second
+
+    // Porch lights, window glows and street lamps, switched off with --no-point-lights
+    bool gIsPointLightingEnabled = true;
+    ClusteredLights gClusteredLights;
+
+    // Per-frame data of every kind streams through this buffer
+    GLStreamBuffer gStreamBuffer;
+
+    RenderStats gRenderStats = {};
+
+    // Texture units, texture targets, buffer targets and capabilities the state cache tracks;
+    // calls for any others go straight to GL
+    const GLuint STATE_TEXTURE_UNITS = 4;
+    const GLuint STATE_TEXTURE_TARGET_COUNT = 3;
+    const GLenum STATE_TEXTURE_TARGETS[STATE_TEXTURE_TARGET_COUNT] = { GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_CUBE_MAP };
+    const GLuint STATE_BUFFER_TARGET_COUNT = 9;
+    const GLenum STATE_BUFFER_TARGETS[STATE_BUFFER_TARGET_COUNT] = {
+        GL_ARRAY_BUFFER, GL_ELEMENT_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER, GL_DRAW_INDIRECT_BUFFER,
+        GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GL_PIXEL_UNPACK_BUFFER, GL_PIXEL_PACK_BUFFER
+    };
+    const GLuint STATE_CAPABILITY_COUNT = 3;
+    const GLenum STATE_CAPABILITIES[STATE_CAPABILITY_COUNT] = { GL_DEPTH_TEST, GL_BLEND, GL_CULL_FACE };
+
+    // Vertex buffer binding points tracked, the minimum GL_MAX_VERTEX_ATTRIB_BINDINGS
+    const GLuint STATE_VERTEX_BINDING_COUNT = 16;
+
+    // A cached value the cache cannot vouch for; the next call setting it always reaches GL
+    const GLuint STATE_UNKNOWN = ~0u;
+
+    // Shadow copy of the GL state this file sets. Every bind, enable and fixed-function state call goes
+    // through the U wrappers, which drop a call that would not change the state before it reaches the driver.
+    // Image units are the exception: the Hi-Z build binds a new level to them for every dispatch, so a
+    // cache would never filter one.
+    struct GLStateCache
     {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 1.0f);
-        gLightPosition.x = newPosition.x;
-        gLightPosition.y = newPosition.y;
-        gLightPosition.z = newPosition.z;
-    }
+        GLuint program;
+        GLuint vertexArray;
+        GLuint activeTexture;   // Unit index
+        GLuint textures[STATE_TEXTURE_UNITS][STATE_TEXTURE_TARGET_COUNT];
+        GLuint buffers[STATE_BUFFER_TARGET_COUNT];  // Generic binding of each target
+        GLuint vertexBuffers[STATE_VERTEX_BINDING_COUNT];   // Of the bound vertex array
+        GLintptr vertexBufferOffsets[STATE_VERTEX_BINDING_COUNT];
+        GLsizei vertexBufferStrides[STATE_VERTEX_BINDING_COUNT];
+        GLuint framebuffer;     // Draw and read, which are always bound together
+        GLuint renderbuffer;
+        GLint viewport[4];
+        bool isViewportKnown;
+        GLuint capabilities[STATE_CAPABILITY_COUNT]; // GL_TRUE, GL_FALSE or STATE_UNKNOWN
+        GLuint depthFunc;
+        GLuint depthMask;
+        GLuint colorMask;       // One bit per channel, red lowest
+        GLuint blendSource;
+        GLuint blendDestination;
+        glm::vec4 clearColor;
+        bool isClearColorKnown;
+        GLuint packAlignment;
+        GLuint unpackAlignment;
+    };
 
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+    GLStateCache gStateCache;
 
-    // Clear the frame and z buffers
-    glClearColor(0.196078f, 0.6f, 0.8f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#ifdef CS330_PROFILE
+    // Sections of URender timed by the profiler
+    enum ProfileSection
+    {
+        PROFILE_FRAME,      // All of URender; CPU only, since GL_TIME_ELAPSED queries cannot nest
+        PROFILE_SETUP,      // Clear, frame data upload and texture bind
+        PROFILE_SHADOW,     // Shadow map redraw when stale, and dynamic casters
+        PROFILE_CULL,       // Frustum culling and the visible instance upload
+        PROFILE_LIGHTS,     // Point light binning and the cluster list upload
+        PROFILE_OCCLUSION,  // Hi-Z test and command compaction
+        PROFILE_PREPASS,    // Depth-only house parts, when the depth prepass is on
+        PROFILE_HOUSE,      // House parts, direct or indirect
+        PROFILE_LAMP,       // Lamp cube
+        PROFILE_HIZ,        // Depth pyramid build for the next frame's occlusion test
+        PROFILE_PRESENT,    // Buffer swap, or the headless readback and write
+        PROFILE_SECTION_COUNT
+    };
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(gMesh.vao);
+    const char* const PROFILE_SECTION_NAMES[PROFILE_SECTION_COUNT] = {
+        "Frame", "Setup", "Shadow", "Cull", "Lights", "Occlusion", "Prepass", "House", "Lamp", "HiZ", "Present"
+    };
 
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // One timed section, on the CPU or the GPU
+    struct ProfileEvent
+    {
+        unsigned long long frame;
+        GLuint section;
+        bool isGpu;
+        double startUs;     // Microseconds since the profiler started; GPU events reuse their section's CPU start
+        double durationUs;
+    };
 
-    // 1. Scales the object by 2
-    glm::mat4 scale = glm::scale(glm::vec3(2.0f, 2.0f, 2.0f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    glm::mat4 rotation = glm::rotate(50.0f, glm::vec3(0.0, 1.0f, 0.0f));
-    // 3. Place object at the origin
-    glm::mat4 translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
-    // Model matrix: transformations are applied right-to-left order
-    //glm::mat4 model = translation * rotation * scale;
-    
-    glm::mat4 model =  rotation * translation * scale;
+    // Fixed-size single-producer single-consumer queue; Push and Pop never lock or allocate
+    template <typename T, size_t Capacity>
+    class SpscRing
+    {
+    public:
+        // Producer only; returns false when the ring is full
+        bool Push(const T& value)
+        {
+            size_t write = writeIndex.load(std::memory_order_relaxed);
+            size_t next = (write + 1) % Capacity;
+            if (next == readIndex.load(std::memory_order_acquire))
+                return false;
+            items[write] = value;
+            writeIndex.store(next, std::memory_order_release);
+            return true;
+        }
 
-    // Transforms the camera: move the camera back (z axis)
-    glm::mat4 view = gCamera.GetViewMatrix();
+        // Consumer only; returns false when the ring is empty
+        bool Pop(T& value)
+        {
+            size_t read = readIndex.load(std::memory_order_relaxed);
+            if (read == writeIndex.load(std::memory_order_acquire))
+                return false;
+            value = items[read];
+            readIndex.store((read + 1) % Capacity, std::memory_order_release);
+            return true;
+        }
 
-    // Creates a orthographic projection
-    //glm::mat4 projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
+    private:
+        T items[Capacity];
+        std::atomic<size_t> writeIndex{ 0 };
+        std::atomic<size_t> readIndex{ 0 };
+    };
 
-    glm::mat4 projection = glm::perspective(45.0f, (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+    // Times URender's sections on the CPU and, through double-buffered GL_TIME_ELAPSED queries, on the GPU.
+    // The render thread records into a lock-free ring; a writer thread drains it into a Chrome trace
+    // (<prefix>.json, open in about:tracing) and a per-frame CSV (<prefix>.csv).
+    class FrameProfiler
+    {
+    public:
+        ~FrameProfiler()
+        {
+            Stop();
+        }
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gProgramId, "projection");
+        // Creates the queries and starts the writer; needs a current GL context
+        bool Start(const std::string& outputPrefix)
+        {
+            trace.open((outputPrefix + ".json").c_str());
+            csv.open((outputPrefix + ".csv").c_str());
+            if (!trace || !csv)
+            {
+                cout << "Failed to open profiler output " << outputPrefix << endl;
+                return false;
+            }
+
+            glGenQueries(2 * PROFILE_SECTION_COUNT, &queries[0][0]);
+            origin = std::chrono::steady_clock::now();
+            stopping = false;
+            enabled = true;
+            writer = std::thread([this] { WriterLoop(); });
+            return true;
+        }
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        // Collects the outstanding GPU results, then flushes and closes the output; needs the GL context
+        void Stop()
+        {
+            if (!enabled)
+                return;
+
+            CollectQueries(0);
+            CollectQueries(1);
+            enabled = false;
+            stopping = true;
+            writer.join();
+            glDeleteQueries(2 * PROFILE_SECTION_COUNT, &queries[0][0]);
+
+            if (droppedEvents > 0)
+                cout << "Profiler dropped " << droppedEvents << " events; the ring buffer was full" << endl;
+        }
 
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+        bool IsEnabled() const
+        {
+            return enabled;
+        }
 
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+        // Starts a new frame and picks up the GPU results of the frame before last, which used the same queries
+        void BeginFrame()
+        {
+            if (!enabled)
+                return;
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+            ++frame;
+            CollectQueries(frame & 1);
+        }
 
-    // bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+        void BeginSection(ProfileSection section)
+        {
+            sectionStartUs[section] = NowUs();
+            if (section != PROFILE_FRAME)
+                glBeginQuery(GL_TIME_ELAPSED, queries[frame & 1][section]);
+        }
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gMesh.nIndices, GL_UNSIGNED_SHORT, NULL); // Draws the triangle
+        void EndSection(ProfileSection section)
+        {
+            double endUs = NowUs();
+            if (section != PROFILE_FRAME)
+            {
+                glEndQuery(GL_TIME_ELAPSED);
+                isQueryPending[frame & 1][section] = true;
+                queryStartUs[frame & 1][section] = sectionStartUs[section];
+                queryFrame[frame & 1] = frame;
+            }
+            Record({ frame, static_cast<GLuint>(section), false, sectionStartUs[section], endUs - sectionStartUs[section] });
+        }
 
-    
+    private:
+        double NowUs() const
+        {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+        }
 
-//===========================================================================================================================================================
-    // Roof Render
-    glBindVertexArray(gMesh.vao1);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gRoofScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, roofTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nRoofIndices, GL_UNSIGNED_SHORT, NULL);
-
-//===========================================================================================================================================
-    // Grass Render
-    glBindVertexArray(gMesh.vao2);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gGrassScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, grassTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nGrassIndices, GL_UNSIGNED_SHORT, NULL);
-
-//==================================================================================================================================================================
-//     Driveway Render
-    
-    glBindVertexArray(gMesh.vao3);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gDrivewayScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, drivewayTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nDriveWayIndices, GL_UNSIGNED_SHORT, NULL);
-
-//==================================================================================================================================================================
-    // Second Base
-
-    glBindVertexArray(gMesh.vao4);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nSecondBaseIndices, GL_UNSIGNED_SHORT, NULL);
-
-//===========================================================================================================================================================
-    // Top House
-
-    glBindVertexArray(gMesh.vao5);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tophouseTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nTopHouseIndices, GL_UNSIGNED_SHORT, NULL);
-
-//============================================================================================================================================================
-    //Right House
-
-    glBindVertexArray(gMesh.vao6);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, rightleftHouseTextureID);
-    glDrawElements(GL_TRIANGLES, gMesh.nRightHouseIndices, GL_UNSIGNED_SHORT, NULL);
-
-//===========================================================================================================================================
-    //Left House
-
-    glBindVertexArray(gMesh.vao7);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, rightleftHouseTextureID);
-    glDrawElements(GL_TRIANGLES, gMesh.nLeftHouseIndices, GL_UNSIGNED_SHORT, NULL);
-
-//===========================================================================================================================================
-    // Top Roof
-
-    glBindVertexArray(gMesh.vao8);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gRoofScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, roofTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nTopRoofIndices, GL_UNSIGNED_SHORT, NULL);
-
-//=======================================================================================================================
-    // Top Windows
-
-    glBindVertexArray(gMesh.vao9);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, topWindowTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nWindowIndices, GL_UNSIGNED_SHORT, NULL);
-
-//==========================================================================================================================
-    // Front Step
-
-    glBindVertexArray(gMesh.vao10);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, drivewayTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nWalkUpIndices, GL_UNSIGNED_SHORT, NULL);
-
-//=========================================================================================================================================================
-    //Front Door
-
-    glBindVertexArray(gMesh.vao11);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, frontDoorTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nFrontDoorIndices, GL_UNSIGNED_SHORT, NULL);
-
-//=============================================================================================================================================================
-    // Garage
-
-    glBindVertexArray(gMesh.vao12);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, garageTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nGarageIndices, GL_UNSIGNED_SHORT, NULL);
-
-//=======================================================================================================================
-    // Office Windows
-
-    glBindVertexArray(gMesh.vao13);
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    //const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, frontWindowTextureId);
-    glDrawElements(GL_TRIANGLES, gMesh.nFrontWindowIndices, GL_UNSIGNED_SHORT, NULL);
-
-//===============================================================================================================
-    // Fence
+        void Record(const ProfileEvent& event)
+        {
+            if (!events.Push(event))
+                ++droppedEvents;
+        }
 
-    //glBindVertexArray(gMesh.vao14);
-    //// Retrieves and passes transform matrices to the Shader program
-    //modelLoc = glGetUniformLocation(gProgramId, "model");
-    //viewLoc = glGetUniformLocation(gProgramId, "view");
-    //projLoc = glGetUniformLocation(gProgramId, "projection");
+        // Reads back one buffer of queries; issued a frame earlier, they are normally ready without a stall
+        void CollectQueries(unsigned slot)
+        {
+            for (GLuint section = 0; section < PROFILE_SECTION_COUNT; ++section)
+            {
+                if (!isQueryPending[slot][section])
+                    continue;
+
+                GLuint64 elapsedNs = 0;
+                glGetQueryObjectui64v(queries[slot][section], GL_QUERY_RESULT, &elapsedNs);
+                isQueryPending[slot][section] = false;
+                Record({ queryFrame[slot], section, true, queryStartUs[slot][section], elapsedNs / 1000.0 });
+            }
+        }
 
-    //glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    //glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    //glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        void WriterLoop()
+        {
+            // Per-frame milliseconds for the CSV, kept until every result of the frame has arrived
+            struct FrameRow
+            {
+                double cpuMs[PROFILE_SECTION_COUNT];
+                double gpuMs[PROFILE_SECTION_COUNT];
+            };
+            std::map<unsigned long long, FrameRow> rows;
+            unsigned long long newestFrame = 0;
+
+            trace << "{\"traceEvents\":[\n"
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n"
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+            csv << "frame";
+            for (GLuint section = 0; section < PROFILE_SECTION_COUNT; ++section)
+            {
+                csv << "," << PROFILE_SECTION_NAMES[section] << "_cpu_ms";
+                if (section != PROFILE_FRAME)
+                    csv << "," << PROFILE_SECTION_NAMES[section] << "_gpu_ms";
+            }
+            csv << "\n";
+
+            for (;;)
+            {
+                // Read the flag before draining so events recorded before Stop are always written
+                bool isStopping = stopping.load(std::memory_order_acquire);
+
+                ProfileEvent event;
+                while (events.Pop(event))
+                {
+                    trace << ",\n{\"name\":\"" << PROFILE_SECTION_NAMES[event.section]
+                        << "\",\"cat\":\"" << (event.isGpu ? "gpu" : "cpu")
+                        << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.isGpu ? 2 : 1)
+                        << ",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+                        << ",\"args\":{\"frame\":" << event.frame << "}}";
+
+                    std::map<unsigned long long, FrameRow>::iterator row = rows.find(event.frame);
+                    if (row == rows.end())
+                        row = rows.insert(std::make_pair(event.frame, FrameRow())).first;
+                    (event.isGpu ? row->second.gpuMs : row->second.cpuMs)[event.section] = event.durationUs / 1000.0;
+                    newestFrame = std::max(newestFrame, event.frame);
+                }
+
+                // GPU results arrive two frames late, so older rows are complete
+                while (!rows.empty() && (isStopping || rows.begin()->first + 2 < newestFrame))
+                {
+                    const FrameRow& row = rows.begin()->second;
+                    csv << rows.begin()->first;
+                    for (GLuint section = 0; section < PROFILE_SECTION_COUNT; ++section)
+                    {
+                        csv << "," << row.cpuMs[section];
+                        if (section != PROFILE_FRAME)
+                            csv << "," << row.gpuMs[section];
+                    }
+                    csv << "\n";
+                    rows.erase(rows.begin());
+                }
+
+                if (isStopping)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+
+            trace << "\n]}\n";
+            trace.close();
+            csv.close();
+        }
 
-    //// Reference matrix uniforms from the Object Shader program for the cub color, light color, light position, and camera position
-    //objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    //lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    //lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    //viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+        SpscRing<ProfileEvent, 4096> events;
+        unsigned long long droppedEvents = 0;
+        std::thread writer;
+        std::atomic<bool> stopping{ false };
+        std::ofstream trace;
+        std::ofstream csv;
+        bool enabled = false;
+
+        std::chrono::steady_clock::time_point origin;
+        unsigned long long frame = 0;
+        double sectionStartUs[PROFILE_SECTION_COUNT] = {};
+
+        // Two sets of queries, alternating by frame, so reading one set never waits on the frame in flight
+        GLuint queries[2][PROFILE_SECTION_COUNT] = {};
+        bool isQueryPending[2][PROFILE_SECTION_COUNT] = {};
+        double queryStartUs[2][PROFILE_SECTION_COUNT] = {};
+        unsigned long long queryFrame[2] = {};
+    };
 
-    //// Pass color, light, and camera data to the Object Shader program's corresponding uniforms
-    //glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    //glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    //glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    ////const glm::vec3 cameraPosition = gCamera.Position;
-    //glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    // Times the enclosing block as one section; does nothing while the profiler is off
+    class ProfileScope
+    {
+    public:
+        ProfileScope(FrameProfiler& profiler, ProfileSection section)
+            : profiler(profiler), section(section), isActive(profiler.IsEnabled())
+        {
+            if (isActive)
+                profiler.BeginSection(section);
+        }
 
-    //UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    //glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+        ~ProfileScope()
+        {
+            if (isActive)
+                profiler.EndSection(section);
+        }
 
-    //glActiveTexture(GL_TEXTURE0);
-    //glBindTexture(GL_TEXTURE_2D, fenceTextureId);
-    //glDrawElements(GL_TRIANGLES, gMesh.nFenceIndices, GL_UNSIGNED_SHORT, NULL);
+    private:
+        FrameProfiler& profiler;
+        ProfileSection section;
+        bool isActive;
+    };
 
-    // LAMP: draw lamp
-    //----------------
-    glUseProgram(gLampProgramId);
+    // Render-thread profiler, enabled with --profile
+    FrameProfiler gProfiler;
+    std::string gProfileOutput;
+#endif
 
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+    Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
+    float gLastX = WINDOW_WIDTH / 2.0f;
+    float gLastY = WINDOW_HEIGHT / 2.0F;
+    bool gFirstMouse = true;
+    float gDeltaTime = 0.0f;
+    float gLastFrame = 0.0f;
 
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+    // Background the frame is cleared to
+    const glm::vec4 gClearColor(0.74902f, 0.847059f, 0.847059f, 1.0f);
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    // Object and light color
+    glm::vec3 gObjectColor(1.0f, 0.2f, 0.0f);
+    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
 
-    // Draws the triangles
-    glDrawElements(GL_TRIANGLES, gMesh.nIndices, GL_UNSIGNED_SHORT, NULL);
-    
-    // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
-    glUseProgram(0);
+    // Light position and scale
+    glm::vec3 gLightPosition(-8.0f, 6.0f, 6.0f);
+    glm::vec3 gLightScale(0.3f);
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
-}
+    // Read by the update thread, toggled by the main thread
+    std::atomic<bool> gIsLampOrbiting(true);
 
+    // Simulated time of the frame being drawn, interpolated like the camera; places the moving houses
+    double gSceneTime = 0.0;
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh)
-{
-    // Position and Color data
-    GLfloat verts[] = {
+    // Simulation rate, independent of the frame rate
+    const double SIMULATION_STEP = 1.0 / 120.0;
 
-        //Square for Base (Garage Section)
-        // Vertex Positions    // Normals
-        //----------------------------------------------------------------------------------------
-        //Front Face          //Positive Z Normal   // Texture Coords
-         0.5f,  0.5f, 0.0f,   0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Top Right (Front) - Vertex 0
-         0.5f, -0.2f, 0.0f,   0.0f, 0.0f, 1.0f,    1.0f, 0.0f, // Bottom Right (Front) - Vertex 1
-        -0.5f, -0.2f, 0.0f,   0.0f, 0.0f, 1.0f,    0.0f, 0.0f, // Bottom Left (Front) - Vertex 2
-        -0.5f,  0.5f, 0.0f,   0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Top Left (Front) - Vertex 3
+    // Lamp orbit speed, in radians per second
+    const float LAMP_ANGULAR_VELOCITY = glm::radians(45.0f);
 
-         //Back Face          // Negative Z Normal  // Texture Coords
-         0.5f, -0.2f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 0.0f, // Bottom Right (Back) - Vertex 4
-         0.5f,  0.5f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 1.0f, // Top Right (Back) - Vertex 5
-        -0.5f,  0.5f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 0.0f, // Top Left (Back) - Vertex 6
-        -0.5f, -0.2f, -0.6f,  0.0f, 0.0f, -1.0f,   0.0f, 0.0f // Bottom Left (Back) - Vertex 7
+    // Everything the simulation advances; the render thread only reads published copies
+    struct SceneState
+    {
+        double time;                // Seconds since the simulation started
+        glm::vec3 cameraPosition;
+        float cameraYaw;
+        float cameraPitch;
+        glm::vec3 lightPosition;
     };
 
-    // Index data to share position data
-    GLushort indices[] = {
-        0, 1, 3,  // Triangle 1
-        1, 2, 3,   // Triangle 2
-        0, 1, 4,  // Triangle 3
-        0, 4, 5,  // Triangle 4
-        0, 5, 6, // Triangle 5
-        0, 3, 6,  // Triangle 6
-        4, 5, 6, // Triangle 7
-        4, 6, 7, // Triangle 8
-        2, 3, 6, // Triangle 9
-        2, 6, 7, // Triangle 10
-        1, 4, 7, // Triangle 11
-        1, 2, 7 // Triangle 12
+    // What each simulation step publishes: its state and the one before, so the render thread can
+    // interpolate between the two even when it misses steps
+    struct SceneSnapshot
+    {
+        SceneState previous;
+        SceneState current;
     };
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    // Lock-free triple buffer for one producer and one consumer. The producer always has a buffer to
+    // write and the consumer always has the newest complete one; the third is swapped between them
+    // through one atomic, tagged when it holds something the consumer has not seen.
+    template <typename T>
+    class TripleBuffer
+    {
+    public:
+        // Producer only: the buffer to fill
+        T& WriteBuffer()
+        {
+            return buffers[writeIndex];
+        }
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+        // Producer only: hands the filled buffer over and takes the spare one to fill next
+        void Publish()
+        {
+            writeIndex = middle.exchange(writeIndex | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+        }
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+        // Consumer only: the newest published buffer, unchanged until the next call
+        const T& Read()
+        {
+            if (middle.load(std::memory_order_acquire) & FRESH_BIT)
+                readIndex = middle.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+            return buffers[readIndex];
+        }
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    private:
+        static const unsigned INDEX_MASK = 3;
+        static const unsigned FRESH_BIT = 4;
 
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+        T buffers[3];
+        std::atomic<unsigned> middle{ 1 };
+        unsigned writeIndex = 0;
+        unsigned readIndex = 2;
+    };
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    // Input GLFW reports on the main thread, held for the update thread to apply at its next step
+    struct SimulationInput
+    {
+        std::mutex mutex;
+        std::condition_variable wake;   // Signalled on new input, for an update thread idling in on-demand mode
+        GLuint movementKeys;    // Bit per Camera_Movement held down
+        float mouseOffsetX;     // Mouse movement and scrolling since the last step
+        float mouseOffsetY;
+        float scrollOffset;
+    };
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    // Fixed-timestep simulation of the camera and lamp. It runs on its own thread for interactive use;
+    // headless and benchmark runs step it on the main thread, a fixed number of steps per frame.
+    struct Simulation
+    {
+        Camera camera;          // Owned by whichever thread steps the simulation
+        SceneState state;
+        std::thread thread;
+        std::atomic<bool> isRunning;
+        bool isThreaded;
+        double pendingTime;     // Fixed frame time not yet simulated, when stepped on the main thread
+        std::chrono::steady_clock::time_point start;
+        TripleBuffer<SceneSnapshot> snapshots;
+    };
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    SimulationInput gSimulationInput = {};
+    Simulation gSimulation;
 
-    //=====================================================================================================================================================
+    // On-demand mode: frames are drawn only on input, window changes or while something moves
+    bool gIsOnDemand = false;
+    std::atomic<bool> gIsRedrawNeeded(true);    // Set by anything that changes the picture; cleared as a frame starts
 
-    GLfloat roof[] = {
-        //Pyramid for Base Roof (First Level Roof)
-         0.0f,  1.0f, -0.5f,   0.0f, 1.0f, 0.0f,    0.0f, 0.0f, // Top Center Point (Right) - Vertex 8 / 0
-        -1.49f,  1.0f, -0.5f,   0.0f, 1.0f, 0.0f,    1.0f, 0.0f, // Top Center Point (Left) - Vertex 9 / 1
-         0.6f, 0.5f, 0.1f,     0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Bottom Right (Front) - Vertex 10 / 2
-         0.6f, 0.5f, -0.7f,    0.0f, 0.0f, -1.0f,   1.0f, 1.0f, // Bottom Right (Back) - Vertex 11 / 3
-        -1.49f, 0.5f, 0.1f,     0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Bottom Left (Front) - Vertex 12 / 4
-        -1.49f, 0.5f, -0.7f,    0.0f, 0.0f, -1.0f,   0.0f, 0.0f // Bottom Left (Back) - Vertex 13 / 5
-    };
-
-    GLushort roofIndices[] = {
-        // Roof Triangles
-        //8, 10, 11, // Triangle 1   0, 2, 3
-        //11, 8, 10, // Triangle 2   3, 1, 2
-        //8, 12, 10, // Triangle 3   0, 4, 2
-        //12, 9, 13, // Triangle 4   4, 1, 5
-        //9, 13, 12, // Triangle 5   1, 5, 4
-        //9, 8, 12, // Trianlge 6    1, 0, 4
-        //9, 8, 13, // Triangle 7    1, 0, 5
-        //13, 11, 8, // Triangle 8   5, 3, 0
-        //11, 12, 13, // Triangle 9  3, 4, 5
-        //11, 10, 12,// Triangle 10  3, 2, 4
-        0, 2, 3,
-        3, 0, 2,
-        0, 4, 2,
-        4, 1, 5,
-        1, 5, 4,
-        1, 0, 4,
-        1, 0, 5,
-        5, 3, 0,
-        3, 4, 5,
-        3, 2, 4
-    };
+    double gMaxFps = 0.0;               // Frame cap for windowed runs; 0 leaves the rate to the swap interval
+    double gFrameStartTime = 0.0;       // glfwGetTime at the start of the current frame
 
+    bool gIsSwapIntervalSet = false;    // Otherwise the driver's default applies
+    int gSwapInterval = 1;
+}
 
-    // Roof VAO and VBO binding
+/* User-defined Function prototypes to:
+ * initialize the program, set the window size,
+ * redraw graphics on the window when resized,
+ * and render graphics on the screen
+ */
+bool UInitialize(int, char* [], GLFWwindow** window);
+void UResizeWindow(GLFWwindow* window, int width, int height);
+void UProcessInput(GLFWwindow* window);
+void UStartSimulation(Simulation& simulation, bool isThreaded);
+void UStopSimulation(Simulation& simulation);
+void USimulationLoop(Simulation& simulation);
+void USimulationStep(Simulation& simulation);
+bool UApplySimulation(Simulation& simulation);
+void UWakeSimulation();
+void UWaitForFrame(bool isAnimating);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UWindowRefreshCallback(GLFWwindow* window);
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void UCreateMesh(GLMesh& mesh);
+void UBuildMesh(GLMesh& mesh, std::vector<GLfloat>& arenaVertices, std::vector<GLushort>& arenaIndices);
+void UUploadMesh(GLMesh& mesh, const void* vertices, size_t vertexBytes, const void* indices, size_t indexBytes);
+bool UExportMesh(const char* path);
+bool ULoadMesh(const char* path, GLMesh& mesh);
+bool UMeshRangeIsValid(const GLushort* indices, uint64_t indexCount, uint64_t vertexCount,
+    int32_t baseVertex, uint64_t firstIndex, int64_t count);
+bool UMapFile(const char* path, MappedFile& file);
+void UUnmapFile(MappedFile& file);
+void UAddMeshPart(GLMesh& mesh, std::vector<GLfloat>& arenaVertices, std::vector<GLushort>& arenaIndices, const char* name,
+    const GLfloat* verts, size_t nFloats, const GLushort* indices, size_t nIndices, GLuint material);
+void UDestroyMesh(GLMesh& mesh);
+bool UCreateTexture(const char* filename, GLuint& textureId);
+bool UCreateTextureArray(const char* const filenames[], GLsizei layerCount, GLuint& textureId);
+unsigned char* ULoadImage(const char* filename, int& width, int& height, int& channels, int desiredChannels);
+void UResizeImage(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, int channels);
+int UMipLevelCount(int width, int height);
+std::vector<unsigned char> UBuildMipChain(const unsigned char* rgba, int width, int height, MipFilter filter);
+void UDownsampleRows(const int16_t* source, int width, int height, int16_t* destination, const MipKernel& kernel);
+void UDownsampleColumns(const int16_t* source, int width, int height, int16_t* destination, const MipKernel& kernel);
+std::vector<unsigned char> UDecodeTextureLayer(const char* filename, int layerSize);
+int UTextureLayerSize(const char* const filenames[], GLsizei layerCount);
+bool UHashTextureSource(const char* filename, int layerSize, uint64_t& hash);
+bool UBakeTextures(const char* const filenames[], GLsizei layerCount);
+bool ULoadCompressedTextureArray(const char* const filenames[], GLsizei layerCount, int layerSize, GLuint& textureId);
+CompressedImage UCompressImage(const std::vector<unsigned char>& mips, int size, GLenum format);
+void UCompressBc1Block(const unsigned char pixels[64], unsigned char* output);
+void UCompressBc3AlphaBlock(const unsigned char pixels[64], unsigned char* output);
+bool UWriteKtx2(const std::string& path, uint64_t sourceHash, const CompressedImage& image);
+bool UReadKtx2(const std::string& path, uint64_t sourceHash, CompressedImage& image);
+void UDestroyTexture(GLuint textureId);
+void URender();
+void URenderHouses(bool isOcclusionCulling, bool isDepthOnly);
+void UBeginDrawList(DrawList& list, GLuint boundVao);
+uint64_t UDrawKey(DrawList& list, GLuint pass, GLuint program, GLuint material, GLuint vao, float depth);
+GLuint UAddDrawModel(DrawList& list, const glm::mat4& model);
+void UQueueHouseParts(DrawList& list, GLuint pass, const std::vector<GLInstanceData>& instances, const GLuint lodBuckets[],
+    const glm::vec3& viewPosition, const glm::vec3& viewDirection);
+void UQueueLamp(DrawList& list, const glm::vec3& viewPosition, const glm::vec3& viewDirection);
+void USortDrawList(DrawList& list);
+void UExecuteDrawPass(DrawList& list, GLuint pass);
+void URenderPartsIndirect(const GLuint lodBuckets[], bool isDepthOnly);
+void UDrawIndirectBatches(const GLIndirectDraws& draws, bool isDepthOnly);
+void UCreateSampleCounter(GLSampleCounter& counter);
+void UDestroySampleCounter(GLSampleCounter& counter);
+void UBeginSampleCount(GLSampleCounter& counter);
+void UEndSampleCount(GLSampleCounter& counter);
+void UCollectSampleCount(GLSampleCounter& counter, unsigned slot);
+void UGenerateLods(GLMeshPart& part, const GLfloat* verts, size_t nFloats, std::vector<GLushort>& arenaIndices);
+std::vector<GLushort> USimplifyMesh(const GLfloat* verts, size_t vertexCount, const std::vector<GLushort>& indices, size_t targetTriangles);
+void UAddPlaneQuadric(Quadric& quadric, const glm::vec3& normal, float distance, float weight);
+double UQuadricError(const Quadric& quadric, const glm::vec3& position);
+void USelectLods(GLInstanceBuffer& instances, const InstanceBvh& bvh, const std::vector<GLuint>& visibleSlots,
+    const glm::vec3& viewPosition, float projectionScale, std::vector<GLInstanceData>& visible, GLuint lodBuckets[]);
+void UCreateInstanceBuffer(GLuint vao, GLInstanceBuffer& instances);
+void UDestroyInstanceBuffer(GLInstanceBuffer& instances);
+void UAddInstances(GLInstanceBuffer& instances, const GLInstanceData* data, size_t count, GLuint* handles);
+bool URemoveInstances(GLInstanceBuffer& instances, const GLuint* handles, size_t count);
+bool UUpdateInstances(GLInstanceBuffer& instances, const GLuint* handles, const GLInstanceData* data, size_t count);
+bool UIsInstanceHandleValid(const GLInstanceBuffer& instances, GLuint handle);
+void USyncInstanceBuffer(GLInstanceBuffer& instances);
+void UAddNeighborhood(GLInstanceBuffer& instances, int houseCount);
+void UAddNeighborhoodLights(ClusteredLights& clustered, const GLMesh& mesh, const GLInstanceBuffer& instances, int houseCount);
+void UCreateClusteredLights(ClusteredLights& clustered);
+void UDestroyClusteredLights(ClusteredLights& clustered);
+void UAssignLights(ClusteredLights& clustered, const glm::mat4& view, const glm::mat4& projection);
+float UClusterSlice(float depth);
+bool UCreateShadowMap(GLShadowMap& shadow);
+void UDestroyShadowMap(GLShadowMap& shadow);
+void UUpdateShadowMap(GLShadowMap& shadow, const glm::vec3& lightPosition, GLInstanceBuffer& casters,
+    const std::vector<GLInstanceData>& dynamicCasters);
+void URenderShadowCasters(const GLShadowMap& shadow, GLuint texture, bool isClearing, GLuint instanceCount);
+void UUpdateDynamicCasters(std::vector<GLInstanceData>& dynamicCasters, double time);
+void UAddDynamicInstances(std::vector<GLInstanceData>& visible, GLuint lodBuckets[], const std::vector<GLInstanceData>& dynamic);
+BoundingBox UTransformBounds(const BoundingBox& box, const glm::mat4& transform);
+void UUpdateInstanceBvh(InstanceBvh& bvh, GLInstanceBuffer& instances, const BoundingBox& meshBounds, const glm::mat4& meshModel);
+void UBuildBvhNode(InstanceBvh& bvh, GLuint nodeIndex, GLuint begin, GLuint end);
+void UExtractFrustum(const glm::mat4& viewProjection, Frustum& frustum);
+FrustumTest UTestFrustum(const Frustum& frustum, const BoundingBox& box);
+FrustumTest UTestFrustumScalar(const Frustum& frustum, const BoundingBox& box);
+void UCullInstances(const InstanceBvh& bvh, const GLInstanceBuffer& instances, const Frustum& frustum,
+    std::vector<GLuint>& visibleSlots, CullStats& stats);
+void USortFrontToBack(const InstanceBvh& bvh, const glm::vec3& viewPosition, const glm::vec3& viewDirection, std::vector<GLuint>& slots);
+void UUploadVisibleInstances(const std::vector<GLInstanceData>& visible);
+void UBeginComputeProgram(const char* source, ShaderProgramBuild& build);
+bool UCreateOcclusionCulling(GLOcclusionCulling& occlusion, const GLIndirectDraws& draws);
+void UDestroyOcclusionCulling(GLOcclusionCulling& occlusion);
+void UResizeHiZ(GLOcclusionCulling& occlusion, GLsizei width, GLsizei height);
+void UBuildHiZ(GLOcclusionCulling& occlusion, const glm::mat4& viewProjection);
+void UCullOcclusion(GLOcclusionCulling& occlusion, const GLuint lodBuckets[], const BoundingBox& meshBounds, const glm::mat4& meshModel);
+void URenderPartsOcclusionCulled(const GLOcclusionCulling& occlusion, bool isDepthOnly);
+glm::mat4 UHouseModelMatrix();
+bool UParseArguments(int argc, char* argv[]);
+void UPrintUsage(const char* program);
+bool UCreateHeadlessContext(HeadlessTarget& target);
+bool UCreateOffscreenTarget(HeadlessTarget& target, int width, int height);
+void UDestroyHeadlessTarget(HeadlessTarget& target);
+void UPresentFrame();
+bool UIsRunning();
+bool UStartBenchmark(Benchmark& benchmark);
+void UBenchmarkBeginFrame(Benchmark& benchmark);
+void UBenchmarkEndFrame(Benchmark& benchmark);
+bool UWriteBenchmarkReport(const Benchmark& benchmark);
+bool URunSelfChecks();
+bool UCheckFrustumTest();
+bool UCheckSimplifyMesh();
+bool UCheckMeshFile();
+bool UCheckMipChain();
+bool UCheckInstanceBuffer();
+void UBuiltInCameraPath(std::vector<CameraKeyframe>& path);
+bool ULoadCameraPath(const std::string& filename, std::vector<CameraKeyframe>& path);
+CameraKeyframe USampleCameraPath(const std::vector<CameraKeyframe>& path, float time);
+bool UWriteFrame(const std::string& path, const unsigned char* pixels, int width, int height, bool isRaw);
+void UCreateIndirectDraws(const GLMesh& mesh, const glm::mat4& model, GLIndirectDraws& draws);
+void UDestroyIndirectDraws(GLIndirectDraws& draws);
+std::string UShaderWithHeader(const char* source, const char* header);
+void UBeginShaderVariant(GLuint features, ShaderProgramBuild& build);
+void UBeginShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, ShaderProgramBuild& build);
+void UBeginProgram(const GLenum stages[], const char* const sources[], GLsizei stageCount, ShaderProgramBuild& build);
+bool UFinishShaderProgram(ShaderProgramBuild& build, GLuint& programId, GLProgramUniforms& uniforms);
+bool UFinishProgram(ShaderProgramBuild& build, GLuint& programId);
+GLint UGetUniformLocation(GLuint program, const GLchar* name);
+uint64_t UHashProgramSources(const GLenum stages[], const char* const sources[], GLsizei stageCount);
+std::string UProgramCachePath(uint64_t hash);
+bool ULoadProgramBinary(ShaderProgramBuild& build);
+void UStoreProgramBinary(const ShaderProgramBuild& build);
+bool UCreateStreamBuffer(GLStreamBuffer& stream, GLsizeiptr regionSize);
+void UDestroyStreamBuffer(GLStreamBuffer& stream);
+void UBeginStreamFrame(GLStreamBuffer& stream);
+void UEndStreamFrame(GLStreamBuffer& stream);
+StreamBlock UStreamAllocate(GLStreamBuffer& stream, GLsizeiptr size, GLint alignment);
+bool UGrowStreamBuffer(GLStreamBuffer& stream, GLsizeiptr minimumRegionSize);
+void UPrintRenderStats();
+void UInvalidateStateCache();
+bool UCacheState(GLuint& cached, GLuint value);
+GLuint UStateIndex(const GLenum* values, GLuint count, GLenum value);
+bool UUseProgram(GLuint program);
+bool UBindVertexArray(GLuint vertexArray);
+bool UBindTexture(GLuint unit, GLenum target, GLuint texture);
+bool UBindBuffer(GLenum target, GLuint buffer);
+bool UBindVertexBuffer(GLuint binding, GLuint buffer, GLintptr offset, GLsizei stride);
+bool UBindFramebuffer(GLuint framebuffer);
+bool UBindRenderbuffer(GLuint renderbuffer);
+bool UViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+void UBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+void UBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+bool UEnable(GLenum capability);
+bool UDisable(GLenum capability);
+bool UDepthFunc(GLenum func);
+bool UDepthMask(GLboolean flag);
+bool UColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha);
+bool UBlendFunc(GLenum source, GLenum destination);
+bool UClearColor(const glm::vec4& color);
+bool UPixelStorei(GLenum name, GLint value);
+void UDeleteProgram(GLuint program);
+void UDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays);
+void UDeleteTextures(GLsizei count, const GLuint* textures);
+void UDeleteBuffers(GLsizei count, const GLuint* buffers);
+void UDeleteFramebuffers(GLsizei count, const GLuint* framebuffers);
+void UDeleteRenderbuffers(GLsizei count, const GLuint* renderbuffers);
+void UDestroyShaderProgram(GLuint programId);
 
-    glGenVertexArrays(1, &mesh.vao1); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao1);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos1);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos1[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(roof), roof, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+/* Object Shader Source Code
+ * Raw strings rather than the GLSL macro, since the feature #ifdefs are preprocessor lines;
+ * UBeginShaderVariant puts the #version, extension and feature #defines in front.
+ */
+const GLchar* objectVertexShaderSource = R"(
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 2) in vec2 textureCoordinate;
+layout(location = 3) in mat4 instanceModel; // Per-house placement, locations 3-6
+layout(location = 7) in vec4 instanceVariation; // Per-house tint
 
-    mesh.nRoofIndices = sizeof(roofIndices) / sizeof(roofIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos1[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(roofIndices), roofIndices, GL_STATIC_DRAW);
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+out vec2 vertexTextureCoordinate; // Already multiplied by the uv scale
+flat out uint vertexTextureLayer; // Which texture the fragment shader samples
+flat out vec3 vertexTint;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// The depth prepass and the GL_EQUAL color pass must compute the same depths
+invariant gl_Position;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Per-frame camera and light data, written once per frame and shared with the lamp program
+layout(std140, binding = 0) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 viewPosition;
+    vec4 overdrawView;
+};
+
+#ifdef SHADER_FEATURE_DRAW_PARAMETERS
+// Per-draw model matrix, uv scale and texture, indexed by the draw's position in the indirect buffer
+struct DrawData
+{
+    mat4 model;
+    vec2 uvScale;
+    uint textureLayer;
+    uint padding;
+};
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+layout(std430, binding = 1) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
 
-    //=================================================================================================================================================================
-        // Grass 
-    GLfloat grass[] = {
-        //Plane for Ground
-        -2.0f, -0.2f, 2.0f,   0.0f, 1.0f, 0.0f,      0.0f, 0.0f, //Front (Left) - Vertex 14 / 0
-         1.5f, -0.2f, 2.0f,   0.0f, 1.0f, 0.0f,      1.0f, 0.0f, //Front (Right) - Vertex 15 / 1
-         1.5f, -0.2f, -2.0f,  0.0f, 1.0f, 0.0f,      1.0f, 1.0f, //Back (Right) - Vertex 16 / 2
-        -2.0f, -0.2f, -2.0f,  0.0f, 1.0f, 0.0f,      0.0f, 1.0f  //Back (Left) - Vertex 17 / 3
-    };
+uniform uint uDrawOffset; // gl_DrawIDARB restarts at 0 with each indirect call
+#else
+//Uniform / Global variables for the  transform matrices
+uniform mat4 model; // The house's own transform, shared by every instance
+uniform vec2 uvScale;
+uniform int uTextureLayer; // Layer of the part being drawn
+#endif
 
-    GLushort grassIndices[] = {
-        //Ground Plane
-        //14, 15, 16, // Triangle 1   1, 2, 3
-        //16, 14, 17, // Triangle 2   3, 1, 4
-        //17, 16, 14,  // Triangle 3   4, 3, 1
-        0, 1, 2,
-        2, 0, 3,
-        3, 2, 0
+void main()
+{
+#ifdef SHADER_FEATURE_DRAW_PARAMETERS
+    DrawData draw = draws[uDrawOffset + uint(gl_DrawIDARB)];
+    mat4 world = instanceModel * draw.model;
+    vertexTextureCoordinate = textureCoordinate * draw.uvScale;
+    vertexTextureLayer = draw.textureLayer;
+#else
+    mat4 world = instanceModel * model;
+    vertexTextureCoordinate = textureCoordinate * uvScale;
+    vertexTextureLayer = uint(uTextureLayer);
+#endif
 
+    gl_Position = projection * view * world * vec4(position, 1.0f); // Transforms vertices into clip coordinates
 
-    };
+    vertexFragmentPos = vec3(world * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
 
-    glGenVertexArrays(1, &mesh.vao2); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao2);
+    vertexNormal = mat3(transpose(inverse(world))) * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexTint = instanceVariation.rgb;
+}
+)";
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos2);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos2[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(grass), grass, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    mesh.nGrassIndices = sizeof(grassIndices) / sizeof(grassIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos2[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(grassIndices), grassIndices, GL_STATIC_DRAW);
+const GLchar* objectFragmentShaderSource = R"(
+in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexTextureCoordinate;
+flat in uint vertexTextureLayer;
+flat in vec3 vertexTint; // Per-house tint
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+out vec4 fragmentColor; // For outgoing cube color to the GPU
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Per-frame light and camera/view position
+layout(std140, binding = 0) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 viewPosition;
+    vec4 overdrawView;
+};
+
+// Point lights, and per cluster of the view frustum the ones that reach into it
+struct PointLight
+{
+    vec4 positionRadius;
+    vec4 color;
+};
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+layout(std430, binding = 6) readonly buffer PointLightBuffer
+{
+    PointLight pointLights[];
+};
 
-    //=============================================================================================================================================
-        //Driveway
+layout(std430, binding = 7) readonly buffer ClusterRangeBuffer
+{
+    uvec2 clusterRanges[]; // Offset and count in clusterLightIndices
+};
 
-    GLfloat driveway[] = {
-        0.3f, -0.19f, 0.0f,        0.0f, 1.0f, 0.0f,       1.0f, 1.0f, // Back Right - 0
-       -0.3f, -0.19f, 0.0f,        0.0f, 1.0f, 0.0f,       0.0f, 1.0f, // Back Left - 1
-        0.3f, -0.19f, 2.0f,        0.0f, 1.0f, 0.0f,       1.0f, 0.0f, // Front Right - 2
-       -0.3f, -0.19f, 2.0f,        0.0f, 1.0f, 0.0f,       0.0f, 0.0f // Front Left - 3
-    };
+layout(std430, binding = 8) readonly buffer ClusterIndexBuffer
+{
+    uint clusterLightIndices[];
+};
 
-    GLushort drivewayIndices[] = {
-        0, 1, 3,
-        2, 0, 3,
-        3, 2, 0
+layout(std140, binding = 1) uniform ClusterData
+{
+    uvec4 clusterGrid; // Tiles across and down, depth slices
+    vec4 clusterDepth; // Slice = log(view depth) * x + y
+    vec4 clusterScreen; // Tiles per pixel
+};
 
+// Lamp shadows: distances from shadowLight.xyz to the nearest caster, divided by shadowLight.w
+layout(std140, binding = 2) uniform ShadowData
+{
+    vec4 shadowLight; // w is 0 with shadows off
+};
 
-    };
+uniform samplerCube uShadowMap;
 
-    glGenVertexArrays(1, &mesh.vao3); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao3);
+#ifdef SHADER_FEATURE_TEXTURE
+uniform sampler2DArray uTexture; // Every scene texture, one per layer
+#else
+// Uniform / Global variables for object color
+uniform vec3 objectColor;
+#endif
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos3);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos3[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(driveway), driveway, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+void main()
+{
+    // Overdraw view: each shaded fragment adds the same amount, so additive blending sums them into a heatmap
+    if (overdrawView.x > 0.0f)
+    {
+        fragmentColor = vec4(0.25f, 0.1f, 0.04f, 1.0f);
+        return;
+    }
 
-    mesh.nDriveWayIndices = sizeof(drivewayIndices) / sizeof(drivewayIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos3[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(drivewayIndices), drivewayIndices, GL_STATIC_DRAW);
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    //Calculate Ambient lighting*/
+    float ambientStrength = 0.3f; // Set ambient or global lighting strength
+    vec3 ambient = ambientStrength * lightColor.rgb; // Generate ambient light color
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    //Calculate Diffuse lighting*/
+    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
+    vec3 lightDirection = normalize(lightPos.xyz - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+    vec3 diffuse = impact * lightColor.rgb; // Generate diffuse light color
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // The lamp lights the fragment unless a caster lies nearer to the light along the same direction
+    float shadow = 1.0f;
+    if (shadowLight.w > 0.0f)
+    {
+        vec3 fromLight = vertexFragmentPos - shadowLight.xyz;
+        float distance = length(fromLight);
+        float closest = texture(uShadowMap, fromLight).r * shadowLight.w;
+        shadow = distance - max(0.05f, 0.01f * distance) > closest ? 0.0f : 1.0f;
+    }
 
-    //================================================================================================================================================
-        //Second Base
+    vec3 lighting = ambient + shadow * diffuse;
 
-    GLfloat secondBase[] = {
-        // Front Face
+#ifdef SHADER_FEATURE_SPECULAR
+    //Calculate Specular lighting*/
+    float specularIntensity = 0.8f; // Set specular light strength
+    float highlightSize = 16.0f; // Set specular highlight size
+    vec3 viewDir = normalize(viewPosition.xyz - vertexFragmentPos); // Calculate view direction
+    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+    //Calculate specular component
+    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+    lighting += shadow * specularIntensity * specularComponent * lightColor.rgb;
+#endif
 
-        -1.49f, 0.5f, -0.2f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left 
-        -1.49f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.5f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.5f, 0.5f, -0.2f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+    // Point lights: only those binned into this fragment's cluster
+    float viewDepth = -(view * vec4(vertexFragmentPos, 1.0f)).z;
+    uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterScreen.xy), clusterGrid.xy - 1u);
+    uint slice = uint(clamp(log(viewDepth) * clusterDepth.x + clusterDepth.y, 0.0f, float(clusterGrid.z - 1u)));
+    uvec2 range = clusterRanges[(slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x];
+    for (uint i = range.x; i < range.x + range.y; ++i)
+    {
+        PointLight light = pointLights[clusterLightIndices[i]];
+        vec3 toLight = light.positionRadius.xyz - vertexFragmentPos;
+        float distance = length(toLight);
+        vec3 direction = toLight / max(distance, 0.0001f);
+
+        // Inverse-square falloff, windowed to reach zero at the light's radius
+        float window = clamp(1.0f - pow(distance / light.positionRadius.w, 4.0f), 0.0f, 1.0f);
+        float attenuation = window * window / (distance * distance + 1.0f);
+        lighting += max(dot(norm, direction), 0.0f) * attenuation * light.color.rgb;
+#ifdef SHADER_FEATURE_SPECULAR
+        lighting += specularIntensity * pow(max(dot(viewDir, reflect(-direction, norm)), 0.0f), highlightSize) * attenuation * light.color.rgb;
+#endif
+    }
 
-        // Back Face
+#ifdef SHADER_FEATURE_TEXTURE
+    // Texture holds the color to be used for all three components
+    vec3 baseColor = texture(uTexture, vec3(vertexTextureCoordinate, vertexTextureLayer)).rgb;
+#else
+    vec3 baseColor = objectColor;
+#endif
 
-        -1.49f, 0.5f, -0.6f,     0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Top Left
-        -1.49f, -0.2f, -0.6f,    0.0f, 0.0f, -1.0f,      0.0f, 0.0f, // Bottom Left
-        -0.5f, -0.2f, -0.6f,    0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
-        -0.5f, 0.5f, -0.6f,     0.0f, 0.0f, -1.0f,      1.0f, 1.0f  // Top Right
-    };
+    // Calculate phong result
+    vec3 phong = lighting * baseColor * vertexTint;
 
-    GLushort secondBaseIndices[] = {
-        0, 1, 3,  // Triangle 1
-        1, 2, 3,   // Triangle 2
-        0, 1, 4,  // Triangle 3
-        0, 4, 5,  // Triangle 4
-        0, 5, 6, // Triangle 5
-        0, 3, 6,  // Triangle 6
-        4, 5, 6, // Triangle 7
-        4, 6, 7, // Triangle 8
-        2, 3, 6, // Triangle 9
-        2, 6, 7, // Triangle 10
-        1, 4, 7, // Triangle 11
-        1, 2, 7, // Triangle 12
-        4, 5, 1
-    };
+    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
+}
+)";
 
-    glGenVertexArrays(1, &mesh.vao4); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao4);
+/* Depth-only fragment shader of the object shader variants; only the depth of the fragment is kept */
+const GLchar* depthOnlyFragmentShaderSource = R"(
+void main()
+{
+}
+)";
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos4);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos4[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(secondBase), secondBase, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
 
-    mesh.nSecondBaseIndices = sizeof(secondBaseIndices) / sizeof(secondBaseIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos4[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(secondBaseIndices), secondBaseIndices, GL_STATIC_DRAW);
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Per-frame camera data shared with the object program
+layout(std140, binding = 0) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 viewPosition;
+    vec4 overdrawView;
+};
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+//Uniform / Global variables for the  transform matrices
+uniform mat4 model;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+}
+);
 
-    //===============================================================================================================================================
-        // Top House
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
 
-    GLfloat topHouse[] = {
-        //Front Face
-        -1.5f, 1.3f, -0.21f,        0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-        -1.5f, -0.2f, -0.21f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        0.0f, -0.2f, -0.21f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        0.0f, 1.3f, -0.21f,         0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
 
-        //Back Face
-        -1.5f, 1.3f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Top Left
-        -1.5f, -0.2f, -1.0f,        0.0f, 0.0f, -1.0f,      0.0f, 0.0f, // Bottom Left
-        0.0f, -0.2f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
-        0.0f, 1.3f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 1.0f  // Top Right
-    };
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
 
-    GLushort tophouseIndices[] = {
-        0, 1, 2,
-        2, 0, 3,
-        3, 2, 6,
-        6, 3, 7,
-        7, 6, 5,
-        5, 7, 4,
-        4, 5, 1,
-        1, 0, 5,
-        5, 4, 0,
-        0, 7, 4,
-        3, 7, 0
+/* Shadow Caster Vertex Shader Source Code*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
 
-    };
+    layout(location = 0) in vec3 position;
+layout(location = 3) in mat4 instanceModel; // Per-house placement, locations 3-6
 
-    glGenVertexArrays(1, &mesh.vao5); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao5);
+out vec3 vertexFragmentPos;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos5);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos5[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(topHouse), topHouse, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+uniform mat4 model; // The house's own transform
+uniform mat4 uViewProjection; // Of the cube face being drawn
 
-    mesh.nTopHouseIndices = sizeof(tophouseIndices) / sizeof(tophouseIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos5[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(tophouseIndices), tophouseIndices, GL_STATIC_DRAW);
+void main()
+{
+    vec4 world = instanceModel * model * vec4(position, 1.0f);
+    vertexFragmentPos = world.xyz;
+    gl_Position = uViewProjection * world;
+}
+);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+/* Shadow Caster Fragment Shader Source Code*/
+const GLchar* shadowFragmentShaderSource = GLSL(440,
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    in vec3 vertexFragmentPos;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+uniform vec4 uShadowLight; // Light position, and the far distance the cube's depths are divided by
 
-    //===========================================================================================================================================
-        // Right House (Moms Room)
-    GLfloat rightHouse[] = {
-        -0.01f, 1.3f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -0.01f, 0.7f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.51f, 0.7f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.51f, 1.3f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-        -0.26f, 1.5f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Point
+void main()
+{
+    // Linear distance, so the object shader can compare it along any direction
+    gl_FragDepth = length(vertexFragmentPos - uShadowLight.xyz) / uShadowLight.w;
+}
+);
 
-        // Back
-        -0.01f, 1.3f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Top Right
-        -0.01f, 0.7f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.51f, 0.7f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.51f, 1.3f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Top Left
-        -0.26f, 1.5f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Point
-    };
+/* Hi-Z Depth Copy Compute Shader Source Code*/
+const GLchar* hiZDepthComputeShaderSource = GLSL(440,
 
-    GLushort righthouseIndices[] = {
-        0, 1, 2,
-        2, 0, 3,
-        3, 2, 7,
-        7, 3, 8,
-        8, 7, 6,
-        6, 8, 5,
-        5, 6, 1,
-        1, 5, 0,
-        0, 4, 3,
-        3, 4, 8,
-        8, 9, 4,
-        4, 5, 9,
-        5, 4, 0,
-        3, 0, 4,
-        8, 9, 5,
-        5, 8, 9
-    };
+    layout(local_size_x = 8, local_size_y = 8) in;
 
-    glGenVertexArrays(1, &mesh.vao6); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao6);
+layout(binding = 1, r32f) uniform writeonly image2D uDestination; // Pyramid level 0
+uniform sampler2D uDepth; // Copy of the frame's depth buffer
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos6);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos6[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rightHouse), rightHouse, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+void main()
+{
+    ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(coord, imageSize(uDestination))))
+        return;
 
-    mesh.nRightHouseIndices = sizeof(righthouseIndices) / sizeof(righthouseIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos6[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(righthouseIndices), righthouseIndices, GL_STATIC_DRAW);
+    imageStore(uDestination, coord, vec4(texelFetch(uDepth, coord, 0).r));
+}
+);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+/* Hi-Z Downsample Compute Shader Source Code*/
+const GLchar* hiZDownsampleComputeShaderSource = GLSL(440,
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    layout(local_size_x = 8, local_size_y = 8) in;
 
-    //=============================================================================================================================================
-        //Left House (Dads Room)
+layout(binding = 0, r32f) uniform readonly image2D uSource; // Pyramid level n - 1
+layout(binding = 1, r32f) uniform writeonly image2D uDestination; // Pyramid level n
 
-    GLfloat leftHouse[] = {
-        -1.49f, 1.3f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -1.49f, 0.7f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.99f, 0.7f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.99f, 1.3f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-        -1.24f, 1.5f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Point
+void main()
+{
+    ivec2 coord = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 destinationSize = imageSize(uDestination);
+    if (any(greaterThanEqual(coord, destinationSize)))
+        return;
+
+    ivec2 sourceSize = imageSize(uSource);
+    ivec2 first = coord * 2;
+    ivec2 last = min(first + ivec2(1), sourceSize - ivec2(1));
+
+    // The last texel of a row or column also covers the odd one left over by halving
+    if (coord.x == destinationSize.x - 1)
+        last.x = sourceSize.x - 1;
+    if (coord.y == destinationSize.y - 1)
+        last.y = sourceSize.y - 1;
+
+    // Keep the farthest depth, so a test against this texel is conservative for everything below it
+    float depth = 0.0;
+    for (int y = first.y; y <= last.y; ++y)
+        for (int x = first.x; x <= last.x; ++x)
+            depth = max(depth, imageLoad(uSource, ivec2(x, y)).r);
+
+    imageStore(uDestination, coord, vec4(depth));
+}
+);
 
-        // Back
-        -1.49f, 1.3f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Top Right
-        -1.49f, 0.7f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.99f, 0.7f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.99f, 1.3f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Top Left
-        -1.24f, 1.5f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Point
-    };
 
-    GLushort lefthouseIndices[] = {
-        0, 1, 2,
-        2, 0, 3,
-        3, 2, 7,
-        7, 3, 8,
-        8, 7, 6,
-        6, 8, 5,
-        5, 6, 1,
-        1, 5, 0,
-        0, 4, 3,
-        3, 4, 8,
-        8, 9, 4,
-        4, 5, 9,
-        5, 4, 0,
-        3, 0, 4,
-        8, 9, 5,
-        5, 8, 9
-    };
+/* Occlusion Cull Compute Shader Source Code
+ * Needs MAX_LOD_LEVELS, which UShaderWithHeader adds
+ */
+const GLchar* occlusionCullComputeShaderSource = GLSL(440,
 
-    glGenVertexArrays(1, &mesh.vao7); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao7);
+    layout(local_size_x = 64) in;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos7);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos7[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(leftHouse), leftHouse, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Same layout as GLInstanceData
+struct Instance
+{
+    mat4 model;
+    vec4 variation;
+};
 
-    mesh.nLeftHouseIndices = sizeof(lefthouseIndices) / sizeof(lefthouseIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos7[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(lefthouseIndices), lefthouseIndices, GL_STATIC_DRAW);
+layout(std430, binding = 2) readonly buffer CandidateBuffer
+{
+    Instance candidates[]; // Frustum-visible houses, grouped by detail level
+};
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+layout(std430, binding = 3) writeonly buffer VisibleBuffer
+{
+    Instance visible[]; // Houses that pass, each level compacted from its bucket start
+};
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+layout(std430, binding = 4) buffer CounterBuffer
+{
+    uint visibleCounts[]; // Per level
+};
+
+uniform mat4 uViewProjection; // Of the frame the pyramid was built from
+uniform mat4 uMeshModel; // The house's own transform
+uniform vec3 uBoundsMin; // House bounds in mesh space
+uniform vec3 uBoundsMax;
+uniform uint uCandidateCount;
+uniform uint uLodBuckets[MAX_LOD_LEVELS + 1];
+uniform sampler2D uHiZ;
+
+// Whether the box is behind the depth recorded in the pyramid over its whole screen rectangle
+bool IsOccluded(mat4 world)
+{
+    vec2 rectMin = vec2(1.0);
+    vec2 rectMax = vec2(0.0);
+    float nearest = 1.0;
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        vec3 local = mix(uBoundsMin, uBoundsMax, vec3(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1));
+        vec4 clip = uViewProjection * world * vec4(local, 1.0);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+        // A corner behind the camera leaves no usable rectangle; keep the house
+        if (clip.w <= 0.0)
+            return false;
 
-    //=========================================================================================================================================
-        // Top Roof
+        vec3 window = clip.xyz / clip.w * 0.5 + 0.5;
+        rectMin = min(rectMin, window.xy);
+        rectMax = max(rectMax, window.xy);
+        nearest = min(nearest, window.z);
+    }
 
-    GLfloat topRoof[] = {
+    // Off screen in the pyramid's frame, but inside this frame's frustum: nothing to test against
+    rectMin = clamp(rectMin, 0.0, 1.0);
+    rectMax = clamp(rectMax, 0.0, 1.0);
+    if (any(greaterThanEqual(rectMin, rectMax)))
+        return false;
 
-        // Right
-        0.01f, 1.31f, -0.13f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        0.01f, 1.31f, -1.01f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Back Right
-        -0.26f, 1.51f, -0.15f,       0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
-        -0.53f, 1.31f, -0.13f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-        -0.53f, 1.31f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top Left (Cut in Front)
-        -0.26f, 1.51f, -0.5f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
+    // Level 0 texels under the rectangle, widened by one texel for rounding in the projection and rasterizer
+    ivec2 baseLast = textureSize(uHiZ, 0) - ivec2(1);
+    ivec2 baseMin = clamp(ivec2(floor(rectMin * vec2(baseLast + ivec2(1)))) - ivec2(1), ivec2(0), baseLast);
+    ivec2 baseMax = clamp(ivec2(floor(rectMax * vec2(baseLast + ivec2(1)))) + ivec2(1), ivec2(0), baseLast);
+
+    // The level where those texels fall into at most 2x2. Sizes are truncated by halving and the downsample
+    // folds the odd row or column into the last texel, so level 0 texel x lies under min(x >> level, last).
+    ivec2 span = baseMax - baseMin + ivec2(1);
+    int level = clamp(int(ceil(log2(float(max(span.x, span.y))))), 0, textureQueryLevels(uHiZ) - 1);
+    ivec2 levelLast = textureSize(uHiZ, level) - ivec2(1);
+    ivec2 texelMin = min(baseMin >> level, levelLast);
+    ivec2 texelMax = min(baseMax >> level, levelLast);
+
+    float farthest = max(max(texelFetch(uHiZ, texelMin, level).r, texelFetch(uHiZ, ivec2(texelMax.x, texelMin.y), level).r),
+        max(texelFetch(uHiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(uHiZ, texelMax, level).r));
+    return nearest > farthest;
+}
 
-        // Left
-        -1.51f, 1.31f, -0.13f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Left
-        -1.51f, 1.31f, -1.01f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Back Left
-        -1.24f, 1.51f, -0.13f,       0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
-        -0.97f, 1.31f, -0.13f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Right
-        -0.97f, 1.31f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Right (Cut in Front)
-        -1.24f, 1.51f, -0.5f,        0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Point
-    };
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= uCandidateCount)
+        return;
 
-    GLushort topRoofIndices[] = {
-        0,1,2,
-        0,2,5,
-        2,5,1,
-        5,4,2,
-        4,3,2,
-        1,7,5,
-        7,11,5,
-        11,10,5,
-        10,4,5,
-        10,9,8,
-        8,10,11,
-        11,8,7,
-        7,6,8
-    };
+    uint level = 0u;
+    while (level + 1u < uint(MAX_LOD_LEVELS) && index >= uLodBuckets[level + 1u])
+        ++level;
 
-    glGenVertexArrays(1, &mesh.vao8); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao8);
+    Instance instance = candidates[index];
+    if (IsOccluded(instance.model * uMeshModel))
+        return;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos8);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos8[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(topRoof), topRoof, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    uint slot = atomicAdd(visibleCounts[level], 1u);
+    visible[uLodBuckets[level] + slot] = instance;
+}
+);
 
-    mesh.nTopRoofIndices = sizeof(topRoofIndices) / sizeof(topRoofIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos8[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(topRoofIndices), topRoofIndices, GL_STATIC_DRAW);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+/* Occlusion Command Compute Shader Source Code
+ * Needs MAX_LOD_LEVELS, which UShaderWithHeader adds
+ */
+const GLchar* occlusionCommandComputeShaderSource = GLSL(440,
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    layout(local_size_x = 64) in;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// Same layout as DrawElementsIndirectCommand
+struct Command
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+layout(std430, binding = 4) readonly buffer CounterBuffer
+{
+    uint visibleCounts[];
+};
 
-    //==========================================================================================================================================
-        // Top Windows
+layout(std430, binding = 5) buffer CommandBuffer
+{
+    Command commands[]; // One per part and level, as GLIndirectDraws lays them out
+};
 
-    GLfloat topWindows[] = {
-        // Right Window
-        -0.04f, 1.2f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -0.04f, 0.9f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.48f, 0.9f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.48f, 1.2f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+uniform uint uLodBuckets[MAX_LOD_LEVELS + 1];
+uniform uint uCommandCount;
 
-        //Left Window
-        -1.46f, 1.2f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -1.46f, 0.9f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -1.02f, 0.9f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -1.02f, 1.2f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-    };
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= uCommandCount)
+        return;
 
-    GLushort topWindowIndices[] = {
-        0,1,2,
-        2,0,3,
-        3,2,1,
+    uint level = index % uint(MAX_LOD_LEVELS);
+    commands[index].instanceCount = visibleCounts[level];
+    commands[index].baseInstance = uLodBuckets[level];
+}
+);
 
-        4,5,6,
-        6,4,7,
-        7,6,5
-    };
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    const size_t rowSize = static_cast<size_t>(width) * channels;
 
-    glGenVertexArrays(1, &mesh.vao9); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao9);
+    // Swap whole rows, 16 bytes at a time where SSE2 is available
+    for (int j = 0; j < height / 2; ++j)
+    {
+        unsigned char* top = image + j * rowSize;
+        unsigned char* bottom = image + (height - 1 - j) * rowSize;
+        size_t i = 0;
+#ifdef CS330_SSE
+        for (; i + 16 <= rowSize; i += 16)
+        {
+            __m128i topBytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + i));
+            __m128i bottomBytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(top + i), bottomBytes);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(bottom + i), topBytes);
+        }
+#endif
+        std::swap_ranges(top + i, top + rowSize, bottom + i);
+    }
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos9);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos9[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(topWindows), topWindows, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+int main(int argc, char* argv[])
+{
+    if (!UParseArguments(argc, argv))
+        return EXIT_FAILURE;
 
-    mesh.nWindowIndices = sizeof(topWindowIndices) / sizeof(topWindowIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos9[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(topWindowIndices), topWindowIndices, GL_STATIC_DRAW);
+    // Converter mode: write the built-in house to a mesh file; no window or GL context needed
+    if (!gMeshExportFile.empty())
+        return UExportMesh(gMeshExportFile.c_str()) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    // Before anything is loaded, so a failed check stops a headless or benchmark run early
+    if (gIsSelfChecking && !URunSelfChecks())
+        return EXIT_FAILURE;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // Create the mesh, from a mesh file if one was given
+    if (!gMeshFile.empty())
+    {
+        if (!ULoadMesh(gMeshFile.c_str(), gMesh))
+            return EXIT_FAILURE;
+    }
+    else
+        UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
 
-    //============================================================================================================================================
-        //Front Step
+    // Per-house transforms, fed to the mesh's VAO as instanced attributes
+    UCreateInstanceBuffer(gMesh.vao, gHouseInstances);
+    UAddNeighborhood(gHouseInstances, gHouseCount);
 
-    GLfloat frontStep[] = {
-        // Front Face
-        -0.5f, -0.2f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right - Front Step
-        -0.5f, -0.1f, 0.0f,      0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right - Front Step
-        -1.5f, -0.1f, 0.0f,      0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top Left - Front Step
-        -1.5f, -0.2f, 0.0f,      0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Bottom Left - Front Step
+    // Lights placed on and between the houses, binned into clusters every frame
+    if (gIsPointLightingEnabled)
+        UAddNeighborhoodLights(gClusteredLights, gMesh, gHouseInstances, gHouseCount);
+    UCreateClusteredLights(gClusteredLights);
 
-        // Back Face
-        -0.5f, -0.2f, -0.2f,     0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
-        -0.5f, -0.1f, -0.2f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -1.5f, -0.1f, -0.2f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top left
-        -1.5f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Bottom Left - Front Step
+    // Submit the shader programs now and check them once the textures are loaded, so compiles
+    // that miss the program cache overlap with texture loading
+    ShaderProgramBuild lampBuild;
+    UBeginShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, lampBuild);
 
-        // Side Walk
-        -0.9f, -0.19f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f,
-        -0.7f, -0.19f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f,
-        -0.9f, -0.19f, 0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,
-        -0.7f, -0.19f, 0.1f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,
-        -0.3f, -0.19f, 0.1f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,
-        -0.3f, -0.19f, 0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f
-    };
+    // The indirect paths need gl_DrawIDARB; without it only the direct path is available
+    bool hasDrawParameters = GLEW_ARB_shader_draw_parameters != 0;
 
-    GLushort frontStepIndices[] = {
-        0,1,2,
-        2,0,3,
-        3,2,7,
-        7,6,2,
-        2,3,7,
-        7,4,0,
-        1,5,6,
-        6,1,2,
-        2,6,5,
+    // Only the object shader variants some material needs, on each available path, and the depth prepass's
+    bool isVariantNeeded[SHADER_VARIANT_COUNT] = {};
+    for (const GLMaterial& material : gMaterials)
+    {
+        isVariantNeeded[material.features] = true;
+        if (hasDrawParameters)
+            isVariantNeeded[material.features | SHADER_FEATURE_DRAW_PARAMETERS] = true;
+    }
+    isVariantNeeded[SHADER_FEATURE_DEPTH_ONLY] = true;
+    if (hasDrawParameters)
+        isVariantNeeded[SHADER_FEATURE_DEPTH_ONLY | SHADER_FEATURE_DRAW_PARAMETERS] = true;
+    ShaderProgramBuild variantBuilds[SHADER_VARIANT_COUNT];
+    for (GLuint features = 0; features < SHADER_VARIANT_COUNT; ++features)
+    {
+        if (isVariantNeeded[features])
+            UBeginShaderVariant(features, variantBuilds[features]);
+    }
 
-        8,9,10,
-        10,11,9,
-        9,8,10,
-        10,13,11,
-        11,12,13
-    };
+    // Create the ring buffer per-frame data (FrameData, visible houses) streams through
+    if (!UCreateStreamBuffer(gStreamBuffer, STREAM_REGION_SIZE))
+        return EXIT_FAILURE;
 
-    glGenVertexArrays(1, &mesh.vao10); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao10);
+    // Decode images on every core while the GL thread uploads them
+    gThreadPool.Start(std::thread::hardware_concurrency());
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos10);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos10[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(frontStep), frontStep, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // Compress every scene texture into the on-disk cache the texture array loads from
+    if (gIsBakingTextures && !UBakeTextures(TEXTURE_FILES, LAYER_COUNT))
+        return EXIT_FAILURE;
 
-    mesh.nWalkUpIndices = sizeof(frontStepIndices) / sizeof(frontStepIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos10[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(frontStepIndices), frontStepIndices, GL_STATIC_DRAW);
+    // Load every scene texture into the layers of one texture array
+    if (!UCreateTextureArray(TEXTURE_FILES, LAYER_COUNT, gTextureArrayId))
+        return EXIT_FAILURE;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    // Shadows are optional; without the map the lamp lights everything
+    if (gIsShadowEnabled && !UCreateShadowMap(gShadowMap))
+        gIsShadowEnabled = false;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    UCreateSampleCounter(gSampleCounter);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    if (!UFinishShaderProgram(lampBuild, gLampProgramId, gLampProgramUniforms))
+        return EXIT_FAILURE;
+
+    // A broken direct variant is fatal; a broken indirect one only costs the indirect paths
+    gIsIndirectSupported = hasDrawParameters;
+    for (GLuint features = 0; features < SHADER_VARIANT_COUNT; ++features)
+    {
+        if (!isVariantNeeded[features])
+            continue;
+
+        GLShaderVariant& variant = gObjectVariants[features];
+        if (!UFinishShaderProgram(variantBuilds[features], variant.programId, variant.uniforms))
+        {
+            variant.programId = 0;
+            if (!(features & SHADER_FEATURE_DRAW_PARAMETERS))
+                return EXIT_FAILURE;
+            gIsIndirectSupported = false;
+            continue;
+        }
+
+        // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
+        // We set the texture as texture unit 0
+        glUniform1i(variant.uniforms.texture, 0);
+        // The object color never changes, so it is set once here rather than every frame
+        glUniform3f(variant.uniforms.objectColor, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+        glUniform1i(variant.uniforms.shadowMap, SHADOW_TEXTURE_UNIT);
+    }
+
+    if (gIsIndirectSupported)
+    {
+        UCreateIndirectDraws(gMesh, UHouseModelMatrix(), gIndirectDraws);
+
+        // Occlusion culling draws through the same program and commands
+        gIsOcclusionSupported = UCreateOcclusionCulling(gOcclusion, gIndirectDraws);
+    }
+    else if (gRenderPath == RENDER_PATH_INDIRECT)
+    {
+        cout << "GL_ARB_shader_draw_parameters is not supported, using the direct render path" << endl;
+        gRenderPath = RENDER_PATH_DIRECT;
+    }
+
+    // Sets the background color of the window (it will be implicitely used by glClear)
+    UClearColor(gClearColor);
+
+#ifdef CS330_PROFILE
+    if (!gProfileOutput.empty() && !gProfiler.Start(gProfileOutput))
+        return EXIT_FAILURE;
+#endif
+
+    if (gBenchmark.isEnabled && !UStartBenchmark(gBenchmark))
+        return EXIT_FAILURE;
+
+    if (!gCameraRecordFile.empty())
+    {
+        gCameraRecording.open(gCameraRecordFile.c_str());
+        if (!gCameraRecording)
+        {
+            cout << "Failed to open camera recording " << gCameraRecordFile << endl;
+            return EXIT_FAILURE;
+        }
+        gCameraRecording << "# time x y z yaw pitch" << endl;
+    }
+
+    // Camera and lamp advance at a fixed rate; interactive runs give them their own thread.
+    // Started after the last setup step that can fail, so no early return leaves the thread joinable.
+    UStartSimulation(gSimulation, !gIsHeadless && !gBenchmark.isEnabled);
+
+    // Setup goes through the same counted wrappers; the stats cover rendered frames only
+    gRenderStats = {};
+
+    // render loop
+    // -----------
+    while (UIsRunning())
+    {
+        // Whatever asks for a redraw from here on needs a frame after this one
+        gIsRedrawNeeded = false;
+        if (!gIsHeadless)
+            gFrameStartTime = glfwGetTime();
+
+        if (gIsHeadless || gBenchmark.isEnabled)
+        {
+            // Fixed steps keep batch and benchmark frames identical from run to run
+            gDeltaTime = FIXED_FRAME_TIME;
+        }
+        else
+        {
+            // per-frame timing
+            float currentFrame = glfwGetTime();
+            gDeltaTime = currentFrame - gLastFrame;
+            gLastFrame = currentFrame;
+        }
+
+        // input
+        // -----
+        if (!gIsHeadless && !gBenchmark.isEnabled)
+            UProcessInput(gWindow);
+
+        // Take the newest simulated camera and lamp, interpolated to this frame
+        bool isAnimating = UApplySimulation(gSimulation);
+
+        // The benchmark path owns the camera
+        if (gBenchmark.isEnabled)
+            UBenchmarkBeginFrame(gBenchmark);
+
+        if (gCameraRecording.is_open())
+        {
+            gCameraRecording << gCameraRecordTime << " " << gCamera.Position.x << " " << gCamera.Position.y << " "
+                << gCamera.Position.z << " " << gCamera.Yaw << " " << gCamera.Pitch << "\n";
+            gCameraRecordTime += gDeltaTime;
+        }
+
+        // Render this frame
+        URender();
+
+        if (gBenchmark.isEnabled)
+            UBenchmarkEndFrame(gBenchmark);
+
+        if (gIsHeadless)
+            continue;
+        if (gBenchmark.isEnabled)
+            glfwPollEvents();
+        else
+            UWaitForFrame(isAnimating);
+    }
+
+    UStopSimulation(gSimulation);
+
+    // A benchmark that could not finish or write its report fails the run, so CI notices
+    bool isBenchmarkOk = !gBenchmark.isEnabled || UWriteBenchmarkReport(gBenchmark);
+
+    // Reads back the last frames' sample counts before they are reported
+    UDestroySampleCounter(gSampleCounter);
+    UPrintRenderStats();
+
+#ifdef CS330_PROFILE
+    gProfiler.Stop();
+#endif
+
+    // Release mesh data
+    UDestroyInstanceBuffer(gHouseInstances);
+    UDestroyMesh(gMesh);
+    UDestroyStreamBuffer(gStreamBuffer);
+    UDestroyClusteredLights(gClusteredLights);
+    if (gIsShadowEnabled)
+        UDestroyShadowMap(gShadowMap);
+    if (gIsIndirectSupported)
+        UDestroyIndirectDraws(gIndirectDraws);
+    if (gIsOcclusionSupported)
+        UDestroyOcclusionCulling(gOcclusion);
+
+    // Release texture
+    UDestroyTexture(gTextureArrayId);
+
+    // Release shader program
+    for (const GLShaderVariant& variant : gObjectVariants)
+    {
+        if (variant.programId)
+            UDestroyShaderProgram(variant.programId);
+    }
+    UDestroyShaderProgram(gLampProgramId);
+
+    gThreadPool.Stop();
+
+    if (gIsHeadless)
+        UDestroyHeadlessTarget(gHeadlessTarget);
+
+    exit(isBenchmarkOk ? EXIT_SUCCESS : EXIT_FAILURE); // Terminates the program successfully
+}
+
+
+// Initialize GLFW, GLEW, and create a window
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    if (gIsHeadless)
+    {
+        // Headless: no GLFW, no display; the context renders into an offscreen framebuffer
+        if (!UCreateHeadlessContext(gHeadlessTarget))
+            return false;
+    }
+    else
+    {
+        // GLFW: initialize and configure
+        // ------------------------------
+        glfwInit();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+        // GLFW: window creation
+        // ---------------------
+        * window = glfwCreateWindow(gFramebufferWidth, gFramebufferHeight, WINDOW_TITLE, NULL, NULL);
+        if (*window == NULL)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return false;
+        }
+        glfwMakeContextCurrent(*window);
+
+        // Benchmarks measure render time, not the display's refresh rate
+        if (gBenchmark.isEnabled)
+            glfwSwapInterval(0);
+        else if (gIsSwapIntervalSet)
+            glfwSwapInterval(gSwapInterval);
+
+        glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+        glfwSetWindowRefreshCallback(*window, UWindowRefreshCallback);
+        glfwSetKeyCallback(*window, UKeyCallback);
+        glfwSetCursorPosCallback(*window, UMousePositionCallback);
+        glfwSetScrollCallback(*window, UMouseScrollCallback);
+        glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // A GLX build of GLEW reports this under EGL after it has already loaded the GL entry points
+    if (gIsHeadless && GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY)
+        GlewInitResult = GLEW_OK;
+#endif
+
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    // Nothing is known about the new context's state until the wrappers set it
+    UInvalidateStateCache();
+
+    // Displays GPU OpenGL version
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    // Let the driver compile shaders on as many threads as it likes
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
+    // Some drivers support program binaries without offering a single format
+    GLint binaryFormatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount);
+    if (binaryFormatCount == 0)
+        gIsProgramCacheEnabled = false;
+
+    if (gIsHeadless && !UCreateOffscreenTarget(gHeadlessTarget, gFramebufferWidth, gFramebufferHeight))
+        return false;
+
+    return true;
+}
+
+
+// Creates an OpenGL 4.4 core context with no window or display, e.g. on Mesa llvmpipe
+bool UCreateHeadlessContext(HeadlessTarget& target)
+{
+#ifdef __linux__
+    // Prefer the surfaceless platform, which needs neither X11 nor a GPU device node
+    target.display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT)
+        target.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (target.display == EGL_NO_DISPLAY)
+        target.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (target.display == EGL_NO_DISPLAY || !eglInitialize(target.display, &major, &minor))
+    {
+        cout << "Failed to initialize EGL" << endl;
+        return false;
+    }
+
+    const EGLint configAttributes[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(target.display, configAttributes, &config, 1, &configCount) || configCount == 0)
+    {
+        cout << "Failed to find an EGL config for desktop OpenGL" << endl;
+        eglTerminate(target.display);
+        return false;
+    }
+
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    target.context = eglCreateContext(target.display, config, EGL_NO_CONTEXT, contextAttributes);
+
+    // Surfaceless: the context is made current without any window or pbuffer surface
+    if (target.context == EGL_NO_CONTEXT || !eglMakeCurrent(target.display, EGL_NO_SURFACE, EGL_NO_SURFACE, target.context))
+    {
+        cout << "Failed to create a surfaceless OpenGL 4.4 context" << endl;
+        eglTerminate(target.display);
+        return false;
+    }
+
+    cout << "INFO: Headless EGL " << major << "." << minor << " context" << endl;
+    return true;
+#else
+    cout << "Headless mode is only supported on Linux" << endl;
+    return false;
+#endif
+}
+
+
+// Creates the framebuffer headless frames are rendered into and leaves it bound
+bool UCreateOffscreenTarget(HeadlessTarget& target, int width, int height)
+{
+    glGenRenderbuffers(2, target.renderbuffers);
+    UBindRenderbuffer(target.renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    UBindRenderbuffer(target.renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    UBindRenderbuffer(0);
+
+    glGenFramebuffers(1, &target.framebuffer);
+    UBindFramebuffer(target.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target.renderbuffers[1]);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Failed to create a " << width << "x" << height << " offscreen framebuffer" << endl;
+        return false;
+    }
+
+    UViewport(0, 0, width, height);
+    return true;
+}
+
+
+void UDestroyHeadlessTarget(HeadlessTarget& target)
+{
+    UBindFramebuffer(0);
+    UDeleteFramebuffers(1, &target.framebuffer);
+    UDeleteRenderbuffers(2, target.renderbuffers);
+
+#ifdef __linux__
+    eglMakeCurrent(target.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(target.display, target.context);
+    eglTerminate(target.display);
+#endif
+}
+
+
+// Seeds the simulation from the current camera and lamp, publishes that state and, if threaded, starts stepping it
+void UStartSimulation(Simulation& simulation, bool isThreaded)
+{
+    simulation.camera = gCamera;
+    simulation.state.time = 0.0;
+    simulation.state.cameraPosition = gCamera.Position;
+    simulation.state.cameraYaw = gCamera.Yaw;
+    simulation.state.cameraPitch = gCamera.Pitch;
+    simulation.state.lightPosition = gLightPosition;
+    simulation.pendingTime = 0.0;
+    simulation.isThreaded = isThreaded;
+    simulation.start = std::chrono::steady_clock::now();
+
+    SceneSnapshot& snapshot = simulation.snapshots.WriteBuffer();
+    snapshot.previous = simulation.state;
+    snapshot.current = simulation.state;
+    simulation.snapshots.Publish();
+
+    simulation.isRunning = isThreaded;
+    if (isThreaded)
+        simulation.thread = std::thread(USimulationLoop, std::ref(simulation));
+}
+
+
+void UStopSimulation(Simulation& simulation)
+{
+    simulation.isRunning = false;
+    UWakeSimulation();
+    if (simulation.thread.joinable())
+        simulation.thread.join();
+}
+
+
+// Update thread: one step per SIMULATION_STEP of wall time, sleeping in between
+void USimulationLoop(Simulation& simulation)
+{
+    // Nothing can move: no input waiting and the lamp paused
+    auto isIdle = [&simulation]() {
+        return simulation.isRunning && !gIsLampOrbiting && !gIsHouseMoving && gSimulationInput.movementKeys == 0
+            && gSimulationInput.mouseOffsetX == 0.0f && gSimulationInput.mouseOffsetY == 0.0f && gSimulationInput.scrollOffset == 0.0f;
+    };
+
+    unsigned long long step = 0;
+    while (simulation.isRunning)
+    {
+        // On demand, sleep until there is something to simulate, then resume the schedule from now instead of catching up
+        if (gIsOnDemand)
+        {
+            std::unique_lock<std::mutex> lock(gSimulationInput.mutex);
+            if (isIdle())
+            {
+                gSimulationInput.wake.wait(lock, [&isIdle]() { return !isIdle(); });
+                double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - simulation.start).count();
+                step = std::max(step, static_cast<unsigned long long>(elapsed / SIMULATION_STEP));
+                simulation.state.time = step * SIMULATION_STEP;
+            }
+        }
+
+        USimulationStep(simulation);
+        ++step;
+
+        // Scheduled from the start time, so sleep overshoot does not add up; a late thread catches up without sleeping
+        std::chrono::steady_clock::time_point next = simulation.start
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(step * SIMULATION_STEP));
+        std::this_thread::sleep_until(next);
+    }
+}
+
+
+// Advances the camera and lamp by one fixed step and publishes the result
+void USimulationStep(Simulation& simulation)
+{
+    const float step = static_cast<float>(SIMULATION_STEP);
+
+    GLuint movementKeys;
+    float mouseOffsetX, mouseOffsetY, scrollOffset;
+    {
+        std::lock_guard<std::mutex> lock(gSimulationInput.mutex);
+        movementKeys = gSimulationInput.movementKeys;
+        mouseOffsetX = gSimulationInput.mouseOffsetX;
+        mouseOffsetY = gSimulationInput.mouseOffsetY;
+        scrollOffset = gSimulationInput.scrollOffset;
+        gSimulationInput.mouseOffsetX = 0.0f;
+        gSimulationInput.mouseOffsetY = 0.0f;
+        gSimulationInput.scrollOffset = 0.0f;
+    }
+
+    const Camera_Movement movements[] = { FORWARD, BACKWARD, LEFT, RIGHT, UP, DOWN };
+    for (Camera_Movement movement : movements)
+    {
+        if (movementKeys & (1u << movement))
+            simulation.camera.ProcessKeyboard(movement, step);
+    }
+    if (mouseOffsetX != 0.0f || mouseOffsetY != 0.0f)
+        simulation.camera.ProcessMouseMovement(mouseOffsetX, mouseOffsetY);
+    if (scrollOffset != 0.0f)
+        simulation.camera.ProcessMouseScroll(scrollOffset);
+
+    SceneState previous = simulation.state;
+    if (gIsLampOrbiting)
+    {
+        glm::vec4 newPosition = glm::rotate(LAMP_ANGULAR_VELOCITY * step, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(simulation.state.lightPosition, 1.0f);
+        simulation.state.lightPosition = glm::vec3(newPosition);
+    }
+    simulation.state.time += SIMULATION_STEP;
+    simulation.state.cameraPosition = simulation.camera.Position;
+    simulation.state.cameraYaw = simulation.camera.Yaw;
+    simulation.state.cameraPitch = simulation.camera.Pitch;
+
+    SceneSnapshot& snapshot = simulation.snapshots.WriteBuffer();
+    snapshot.previous = previous;
+    snapshot.current = simulation.state;
+    simulation.snapshots.Publish();
+
+    // Wake an idle render loop to show the change
+    if (gIsOnDemand && simulation.isThreaded && (gIsHouseMoving || previous.cameraPosition != simulation.state.cameraPosition
+        || previous.cameraYaw != simulation.state.cameraYaw || previous.cameraPitch != simulation.state.cameraPitch
+        || previous.lightPosition != simulation.state.lightPosition))
+    {
+        gIsRedrawNeeded = true;
+        glfwPostEmptyEvent();
+    }
+}
+
+
+/* Sets the render camera and lamp from the newest snapshot
+ * Threaded, the frame is shown one step behind the wall clock, blended between the snapshot's two states;
+ * otherwise the frame's fixed time is simulated here and shown as is, so runs repeat exactly.
+ * Returns whether the shown pose is still partway between two different states.
+ */
+bool UApplySimulation(Simulation& simulation)
+{
+    float blend = 1.0f;
+    if (simulation.isThreaded)
+    {
+        const SceneSnapshot& snapshot = simulation.snapshots.Read();
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - simulation.start).count();
+        double span = snapshot.current.time - snapshot.previous.time;
+        if (span > 0.0)
+            blend = static_cast<float>(std::min(std::max((now - SIMULATION_STEP - snapshot.previous.time) / span, 0.0), 1.0));
+
+        const SceneState& a = snapshot.previous;
+        const SceneState& b = snapshot.current;
+        gCamera = Camera(glm::mix(a.cameraPosition, b.cameraPosition, blend), glm::vec3(0.0f, 1.0f, 0.0f),
+            glm::mix(a.cameraYaw, b.cameraYaw, blend), glm::mix(a.cameraPitch, b.cameraPitch, blend));
+        gLightPosition = glm::mix(a.lightPosition, b.lightPosition, blend);
+        gSceneTime = a.time + (b.time - a.time) * blend;
+        return blend < 1.0f && (gIsHouseMoving || a.cameraPosition != b.cameraPosition || a.cameraYaw != b.cameraYaw
+            || a.cameraPitch != b.cameraPitch || a.lightPosition != b.lightPosition);
+    }
+
+    simulation.pendingTime += FIXED_FRAME_TIME;
+    while (simulation.pendingTime >= SIMULATION_STEP)
+    {
+        USimulationStep(simulation);
+        simulation.pendingTime -= SIMULATION_STEP;
+    }
+
+    const SceneState& state = simulation.snapshots.Read().current;
+    gCamera = Camera(state.cameraPosition, glm::vec3(0.0f, 1.0f, 0.0f), state.cameraYaw, state.cameraPitch);
+    gLightPosition = state.lightPosition;
+    gSceneTime = state.time;
+    return false;
+}
+
+
+// Wakes the update thread if it is idling; taking the lock first means it cannot miss a change made just before
+void UWakeSimulation()
+{
+    {
+        std::lock_guard<std::mutex> lock(gSimulationInput.mutex);
+    }
+    gSimulationInput.wake.notify_one();
+}
+
+
+/* Ends a windowed frame: holds to the frame cap, then polls events, or in on-demand mode sleeps until a redraw is needed
+ * Waiting in glfwWaitEventsTimeout rather than sleeping keeps input handled at once; the update thread
+ * wakes the wait with glfwPostEmptyEvent when the scene moves.
+ */
+void UWaitForFrame(bool isAnimating)
+{
+    if (gMaxFps > 0.0)
+    {
+        double frameEnd = gFrameStartTime + 1.0 / gMaxFps;
+        for (double now = glfwGetTime(); now < frameEnd; now = glfwGetTime())
+            glfwWaitEventsTimeout(frameEnd - now);
+    }
+
+    glfwPollEvents();
+    if (!gIsOnDemand || isAnimating)
+        return;
+
+    while (!gIsRedrawNeeded && !glfwWindowShouldClose(gWindow))
+        glfwWaitEvents();
+}
+
+
+// Key presses and releases wake an on-demand loop, which reads the keys in UProcessInput
+void UKeyCallback(GLFWwindow* /*window*/, int /*key*/, int /*scancode*/, int /*action*/, int /*mods*/)
+{
+    gIsRedrawNeeded = true;
+}
+
+
+// The window needs repainting, e.g. after being uncovered
+void UWindowRefreshCallback(GLFWwindow* /*window*/)
+{
+    gIsRedrawNeeded = true;
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    // Held movement keys; the update thread moves the camera by them each step
+    const int movementKeys[] = { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_Q, GLFW_KEY_E };
+    const Camera_Movement movements[] = { FORWARD, BACKWARD, LEFT, RIGHT, UP, DOWN };
+    GLuint heldKeys = 0;
+    for (size_t i = 0; i < sizeof(movementKeys) / sizeof(movementKeys[0]); ++i)
+    {
+        if (glfwGetKey(window, movementKeys[i]) == GLFW_PRESS)
+            heldKeys |= 1u << movements[i];
+    }
+    {
+        std::lock_guard<std::mutex> lock(gSimulationInput.mutex);
+        gSimulationInput.movementKeys = heldKeys;
+    }
+    gSimulationInput.wake.notify_one();
+    
+    // Pause and resume lamp orbiting
+    static bool isLKeyDown = false;
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
+    {
+        gIsLampOrbiting = true;
+        UWakeSimulation();
+    }
+    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
+        gIsLampOrbiting = false;
+
+    // Switch between the direct and indirect render paths on each I key press
+    static bool isIKeyDown = false;
+    bool isIKeyPressed = glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS;
+    if (isIKeyPressed && !isIKeyDown && gIsIndirectSupported)
+    {
+        gRenderPath = gRenderPath == RENDER_PATH_DIRECT ? RENDER_PATH_INDIRECT : RENDER_PATH_DIRECT;
+        cout << "Render path: " << (gRenderPath == RENDER_PATH_DIRECT ? "direct" : "indirect") << endl;
+    }
+    isIKeyDown = isIKeyPressed;
+
+    // Switch frustum culling on and off on each C key press
+    static bool isCKeyDown = false;
+    bool isCKeyPressed = glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS;
+    if (isCKeyPressed && !isCKeyDown)
+    {
+        gIsCullingEnabled = !gIsCullingEnabled;
+        cout << "Frustum culling: " << (gIsCullingEnabled ? "on" : "off") << endl;
+    }
+    isCKeyDown = isCKeyPressed;
+
+    // Switch distance-based detail levels on and off on each O key press
+    static bool isOKeyDown = false;
+    bool isOKeyPressed = glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS;
+    if (isOKeyPressed && !isOKeyDown)
+    {
+        gIsLodEnabled = !gIsLodEnabled;
+        cout << "Detail levels: " << (gIsLodEnabled ? "on" : "off") << endl;
+    }
+    isOKeyDown = isOKeyPressed;
+
+    // Switch Hi-Z occlusion culling on and off on each H key press
+    static bool isHKeyDown = false;
+    bool isHKeyPressed = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+    if (isHKeyPressed && !isHKeyDown && gIsOcclusionSupported)
+    {
+        gIsOcclusionEnabled = !gIsOcclusionEnabled;
+        gOcclusion.hasPyramid = false;
+        gCullStats.occludedInstances = 0;
+        cout << "Occlusion culling: " << (gIsOcclusionEnabled ? "on" : "off") << endl;
+    }
+    isHKeyDown = isHKeyPressed;
+
+    // Switch the depth prepass on and off on each Z key press
+    static bool isZKeyDown = false;
+    bool isZKeyPressed = glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS;
+    if (isZKeyPressed && !isZKeyDown)
+    {
+        gIsDepthPrepassEnabled = !gIsDepthPrepassEnabled;
+        cout << "Depth prepass: " << (gIsDepthPrepassEnabled ? "on" : "off") << endl;
+    }
+    isZKeyDown = isZKeyPressed;
+
+    // Switch between the lit scene and the overdraw heatmap on each V key press
+    static bool isVKeyDown = false;
+    bool isVKeyPressed = glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS;
+    if (isVKeyPressed && !isVKeyDown)
+    {
+        gIsOverdrawView = !gIsOverdrawView;
+        cout << "Overdraw view: " << (gIsOverdrawView ? "on" : "off") << endl;
+    }
+    isVKeyDown = isVKeyPressed;
+}
+
+
+// Parses the command line options
+bool UParseArguments(int argc, char* argv[])
+{
+    // Options that only mean something to --benchmark, which may come after them
+    const char* benchmarkOption = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        // Options taking a value read it from the next argument
+        bool hasValue = i + 1 < argc;
+
+        if (strcmp(argv[i], "--indirect") == 0)
+            gRenderPath = RENDER_PATH_INDIRECT;
+        else if (strcmp(argv[i], "--direct") == 0)
+            gRenderPath = RENDER_PATH_DIRECT;
+        else if (strcmp(argv[i], "--headless") == 0)
+            gIsHeadless = true;
+        else if (strcmp(argv[i], "--on-demand") == 0)
+            gIsOnDemand = true;
+        else if (strcmp(argv[i], "--max-fps") == 0 && hasValue)
+            gMaxFps = atof(argv[++i]);
+        else if (strcmp(argv[i], "--swap-interval") == 0 && hasValue)
+        {
+            gIsSwapIntervalSet = true;
+            gSwapInterval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--width") == 0 && hasValue)
+            gFramebufferWidth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && hasValue)
+            gFramebufferHeight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+            gHeadlessFrameCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && hasValue)
+            gHeadlessOutput = argv[++i];
+        else if (strcmp(argv[i], "--raw") == 0)
+            gIsHeadlessRawOutput = true;
+        else if (strcmp(argv[i], "--houses") == 0 && hasValue)
+            gHouseCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-cull") == 0)
+            gIsCullingEnabled = false;
+        else if (strcmp(argv[i], "--no-lod") == 0)
+            gIsLodEnabled = false;
+        else if (strcmp(argv[i], "--occlusion") == 0)
+            gIsOcclusionEnabled = true;
+        else if (strcmp(argv[i], "--no-point-lights") == 0)
+            gIsPointLightingEnabled = false;
+        else if (strcmp(argv[i], "--no-shadows") == 0)
+            gIsShadowEnabled = false;
+        else if (strcmp(argv[i], "--moving-house") == 0)
+            gIsHouseMoving = true;
+        else if (strcmp(argv[i], "--self-check") == 0)
+            gIsSelfChecking = true;
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+            gIsDepthPrepassEnabled = true;
+        else if (strcmp(argv[i], "--overdraw") == 0)
+            gIsOverdrawView = true;
+        else if (strcmp(argv[i], "--bake-textures") == 0)
+            gIsBakingTextures = true;
+        else if (strcmp(argv[i], "--no-shader-cache") == 0)
+            gIsProgramCacheEnabled = false;
+        else if (strcmp(argv[i], "--mip-filter") == 0 && hasValue)
+        {
+            ++i;
+            if (strcmp(argv[i], "box") == 0)
+                gMipFilter = MIP_FILTER_BOX;
+            else if (strcmp(argv[i], "kaiser") == 0)
+                gMipFilter = MIP_FILTER_KAISER;
+            else
+            {
+                cout << "Unknown mip filter " << argv[i] << endl;
+                UPrintUsage(argv[0]);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--mesh") == 0 && hasValue)
+            gMeshFile = argv[++i];
+        else if (strcmp(argv[i], "--export-mesh") == 0 && hasValue)
+            gMeshExportFile = argv[++i];
+        else if (strcmp(argv[i], "--benchmark") == 0 && hasValue)
+        {
+            gBenchmark.isEnabled = true;
+            gBenchmark.output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && hasValue)
+        {
+            benchmarkOption = argv[i];
+            gBenchmark.warmupFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--measure") == 0 && hasValue)
+        {
+            benchmarkOption = argv[i];
+            gBenchmark.measuredFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--camera-path") == 0 && hasValue)
+        {
+            benchmarkOption = argv[i];
+            gBenchmark.cameraPathFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--record-path") == 0 && hasValue)
+            gCameraRecordFile = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && hasValue)
+        {
+#ifdef CS330_PROFILE
+            gProfileOutput = argv[++i];
+#else
+            ++i;
+            cout << "The profiler is not built into this release build; define CS330_PROFILE to enable it" << endl;
+#endif
+        }
+        else
+        {
+            cout << "Unknown option " << argv[i] << endl;
+            UPrintUsage(argv[0]);
+            return false;
+        }
+    }
+
+    if (gFramebufferWidth <= 0 || gFramebufferHeight <= 0 || gHeadlessFrameCount < 0
+        || gBenchmark.warmupFrames < 0 || gBenchmark.measuredFrames <= 0 || gHouseCount <= 0 || gMaxFps < 0.0)
+    {
+        cout << "Invalid frame size or count" << endl;
+        UPrintUsage(argv[0]);
+        return false;
+    }
+
+    if (benchmarkOption && !gBenchmark.isEnabled)
+    {
+        cout << benchmarkOption << " needs --benchmark" << endl;
+        UPrintUsage(argv[0]);
+        return false;
+    }
+
+    return true;
+}
+
+
+void UPrintUsage(const char* program)
+{
+    cout << "Usage: " << program << " [options]" << endl
+        << "  --direct | --indirect   Render path (toggle at runtime with I)" << endl
+        << "  --headless              Render offscreen without a window and write frames to disk" << endl
+        << "  --on-demand             Redraw only on input, window changes or while the scene moves" << endl
+        << "  --max-fps N             Cap the windowed frame rate (default uncapped)" << endl
+        << "  --swap-interval N       Screen refreshes per swap: 0 off, 1 vsync, -1 adaptive (default driver setting)" << endl
+        << "  --width N --height N    Window or headless frame size (default " << WINDOW_WIDTH << "x" << WINDOW_HEIGHT << ")" << endl
+        << "  --frames N              Headless frames to render (default 1)" << endl
+        << "  --output PREFIX         Headless frame path prefix (default frame)" << endl
+        << "  --raw                   Write raw RGBA frames instead of PNG" << endl
+        << "  --houses N              Draw a grid of N houses with hardware instancing (default 1)" << endl
+        << "  --no-cull               Draw every house instead of frustum culling (toggle at runtime with C)" << endl
+        << "  --no-lod                Draw every visible house at full detail (toggle at runtime with O)" << endl
+        << "  --occlusion             Skip houses hidden behind the previous frame's depth (toggle at runtime with H)" << endl
+        << "  --no-point-lights       Light the houses with the lamp only, without porch lights, window glows and street lamps" << endl
+        << "  --no-shadows            Do not cast shadows from the lamp" << endl
+        << "  --moving-house          Drive a small house around the middle lot, casting a moving shadow" << endl
+        << "  --depth-prepass         Draw the houses depth only first, then shade only the visible fragments (toggle at runtime with Z)" << endl
+        << "  --overdraw              Show how often each pixel is shaded as a heatmap (toggle at runtime with V)" << endl
+        << "  --bake-textures         Compress the scene textures into the KTX2 cache (IMAGE.ktx2) before loading" << endl
+        << "  --no-shader-cache       Compile every shader instead of loading linked programs from program-HASH.bin" << endl
+        << "  --mip-filter box|kaiser Texture mip chain filter, applied in linear light (default kaiser)" << endl
+        << "  --mesh FILE             Load the house from a binary mesh file instead of the built-in geometry" << endl
+        << "  --export-mesh FILE      Write the built-in house to a binary mesh file and exit" << endl
+        << "  --benchmark FILE        Fly a scripted camera path and write frame time statistics to FILE (JSON)" << endl
+        << "  --warmup N --measure N  Benchmark warm-up and measured frames (default 120 and 600)" << endl
+        << "  --self-check            Check the SIMD paths, mesh tools and instance bookkeeping first; exit on a failure" << endl
+        << "  --camera-path FILE      Benchmark along a path written by --record-path instead of the built-in spline" << endl
+        << "  --record-path FILE      Record the live camera to FILE" << endl
+        << "  --profile PREFIX        Write a Chrome trace (PREFIX.json) and per-frame timings (PREFIX.csv)" << endl;
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    UViewport(0, 0, width, height);
+    gFramebufferWidth = width;
+    gFramebufferHeight = height;
+    gIsRedrawNeeded = true;
+}
+
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos) {
+    // The benchmark path owns the camera
+    if (gBenchmark.isEnabled)
+        return;
+
+    if (gFirstMouse) {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos;
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    {
+        std::lock_guard<std::mutex> lock(gSimulationInput.mutex);
+        gSimulationInput.mouseOffsetX += xoffset;
+        gSimulationInput.mouseOffsetY += yoffset;
+    }
+    gSimulationInput.wake.notify_one();
+}
+
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    if (gBenchmark.isEnabled)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(gSimulationInput.mutex);
+        gSimulationInput.scrollOffset += static_cast<float>(yoffset);
+    }
+    gSimulationInput.wake.notify_one();
+}
+
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Left mouse button pressed" << endl;
+        else
+            cout << "Left mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Middle mouse button pressed" << endl;
+        else
+            cout << "Middle mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Right mouse button pressed" << endl;
+        else
+            cout << "Right mouse button released" << endl;
+    }
+    break;
+
+    default:
+        cout << "Unhandled mouse button event" << endl;
+        break;
+    }
+}
+
+
+// Functioned called to render a frame
+void URender()
+{
+    UPROFILE_FRAME();
+    UPROFILE_SCOPE(PROFILE_FRAME);
+
+    // Transforms the camera: move the camera back (z axis)
+    glm::mat4 view = gCamera.GetViewMatrix();
+
+    // Creates a orthographic projection
+    //glm::mat4 projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
+
+    glm::mat4 projection = glm::perspective(45.0f, (GLfloat)gFramebufferWidth / (GLfloat)gFramebufferHeight, CAMERA_NEAR, CAMERA_FAR);
+
+    {
+        UPROFILE_SCOPE(PROFILE_SETUP);
+
+        // Move to the next stream region; this only waits if the GPU is still two frames behind
+        UBeginStreamFrame(gStreamBuffer);
+
+        // Enable z-depth
+        UEnable(GL_DEPTH_TEST);
+
+        // Clear the frame and z buffers with the background color set in main; the overdraw heatmap adds up from black
+        if (gIsOverdrawView)
+            UClearColor(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        else
+            UClearColor(gClearColor);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Activate the shared VBOs contained within the mesh's VAO; every part is drawn from it
+        if (UBindVertexArray(gMesh.vao))
+            ++gRenderStats.vaoBinds;
+
+        // Write the camera and light data once; both programs read it from the FrameData block
+        StreamBlock frameBlock = UStreamAllocate(gStreamBuffer, sizeof(GLFrameData), gStreamBuffer.uniformAlignment);
+        GLFrameData& frameData = *static_cast<GLFrameData*>(frameBlock.data);
+        frameData.view = view;
+        frameData.projection = projection;
+        frameData.lightPosition = glm::vec4(gLightPosition, 1.0f);
+        frameData.lightColor = glm::vec4(gLightColor, 1.0f);
+        frameData.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+        frameData.overdrawView = glm::vec4(gIsOverdrawView ? 1.0f : 0.0f, 0.0f, 0.0f, 0.0f);
+        UBindBufferRange(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, frameBlock.buffer, frameBlock.offset, frameBlock.size);
+
+        // Both paths sample the scene texture array; it stays bound from frame to frame
+        if (UBindTexture(0, GL_TEXTURE_2D_ARRAY, gTextureArrayId))
+            ++gRenderStats.textureBinds;
+    }
+
+    {
+        UPROFILE_SCOPE(PROFILE_SHADOW);
+
+        // Redraws the cached map only if it went stale and adds the moving houses; either binds other
+        // instances, which culling rebinds below
+        UUpdateDynamicCasters(gDynamicCasters, gSceneTime);
+        glm::vec4 shadowLight(0.0f);
+        if (gIsShadowEnabled)
+        {
+            UUpdateShadowMap(gShadowMap, gLightPosition, gHouseInstances, gDynamicCasters);
+            shadowLight = glm::vec4(gShadowMap.lightPosition, SHADOW_FAR);
+
+            if (UBindTexture(SHADOW_TEXTURE_UNIT, GL_TEXTURE_CUBE_MAP, gShadowMap.sampledTexture))
+                ++gRenderStats.textureBinds;
+        }
+
+        StreamBlock shadowBlock = UStreamAllocate(gStreamBuffer, sizeof(glm::vec4), gStreamBuffer.uniformAlignment);
+        memcpy(shadowBlock.data, &shadowLight, sizeof(shadowLight));
+        UBindBufferRange(GL_UNIFORM_BUFFER, SHADOW_DATA_BINDING, shadowBlock.buffer, shadowBlock.offset, shadowBlock.size);
+    }
+
+    {
+        UPROFILE_SCOPE(PROFILE_CULL);
+
+        if (gIsCullingEnabled)
+        {
+            // Only houses whose bounds touch the view frustum are drawn, grouped by detail level
+            UUpdateInstanceBvh(gHouseBvh, gHouseInstances, gMesh.bounds, UHouseModelMatrix());
+            Frustum frustum;
+            UExtractFrustum(projection * view, frustum);
+            UCullInstances(gHouseBvh, gHouseInstances, frustum, gVisibleSlots, gCullStats);
+            USortFrontToBack(gHouseBvh, gCamera.Position, gCamera.Front, gVisibleSlots);
+            USelectLods(gHouseInstances, gHouseBvh, gVisibleSlots, gCamera.Position, projection[1][1], gVisibleInstances, gLodBuckets);
+            UAddDynamicInstances(gVisibleInstances, gLodBuckets, gDynamicCasters);
+            UUploadVisibleInstances(gVisibleInstances);
+            UBindVertexBuffer(INSTANCE_BINDING, gVisibleInstanceBlock.buffer, gVisibleInstanceBlock.offset, sizeof(GLInstanceData));
+        }
+        else
+        {
+            // Upload the instances changed since the last frame and draw them all at full detail
+            USyncInstanceBuffer(gHouseInstances);
+            UBindVertexBuffer(INSTANCE_BINDING, gHouseInstances.buffer, 0, sizeof(GLInstanceData));
+            gLodBuckets[0] = 0;
+            for (GLuint level = 1; level <= MAX_LOD_LEVELS; ++level)
+                gLodBuckets[level] = static_cast<GLuint>(gHouseInstances.instances.size());
+
+            // Moving houses are not in the instance buffer, so this frame's houses are streamed instead
+            if (!gDynamicCasters.empty())
+            {
+                gVisibleInstances = gHouseInstances.instances;
+                UAddDynamicInstances(gVisibleInstances, gLodBuckets, gDynamicCasters);
+                UUploadVisibleInstances(gVisibleInstances);
+                UBindVertexBuffer(INSTANCE_BINDING, gVisibleInstanceBlock.buffer, gVisibleInstanceBlock.offset, sizeof(GLInstanceData));
+            }
+        }
+    }
+
+    {
+        UPROFILE_SCOPE(PROFILE_LIGHTS);
+
+        // Bin the point lights into this view's clusters; every object shader variant reads the lists
+        UAssignLights(gClusteredLights, view, projection);
+        gRenderStats.lightAssignments += gClusteredLights.indices.size();
+
+        StreamBlock clusterBlock = UStreamAllocate(gStreamBuffer, sizeof(GLClusterData), gStreamBuffer.uniformAlignment);
+        GLClusterData& clusterData = *static_cast<GLClusterData*>(clusterBlock.data);
+        float sliceScale = CLUSTER_SLICES / std::log(CAMERA_FAR / CAMERA_NEAR);
+        clusterData.grid = glm::uvec4(CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, 0);
+        clusterData.depth = glm::vec4(sliceScale, -std::log(CAMERA_NEAR) * sliceScale, 0.0f, 0.0f);
+        clusterData.screen = glm::vec4(static_cast<float>(CLUSTER_TILES_X) / gFramebufferWidth,
+            static_cast<float>(CLUSTER_TILES_Y) / gFramebufferHeight, 0.0f, 0.0f);
+        UBindBufferRange(GL_UNIFORM_BUFFER, CLUSTER_DATA_BINDING, clusterBlock.buffer, clusterBlock.offset, clusterBlock.size);
+
+        StreamBlock rangeBlock = UStreamAllocate(gStreamBuffer, CLUSTER_COUNT * sizeof(GLClusterRange), gStreamBuffer.storageAlignment);
+        memcpy(rangeBlock.data, gClusteredLights.ranges.data(), CLUSTER_COUNT * sizeof(GLClusterRange));
+        UBindBufferRange(GL_SHADER_STORAGE_BUFFER, CLUSTER_RANGE_BINDING, rangeBlock.buffer, rangeBlock.offset, rangeBlock.size);
+
+        // Never empty, since a zero-sized range cannot be bound
+        StreamBlock indexBlock = UStreamAllocate(gStreamBuffer, std::max<size_t>(gClusteredLights.indices.size(), 1) * sizeof(GLuint),
+            gStreamBuffer.storageAlignment);
+        if (!gClusteredLights.indices.empty())
+            memcpy(indexBlock.data, gClusteredLights.indices.data(), gClusteredLights.indices.size() * sizeof(GLuint));
+        UBindBufferRange(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDEX_BINDING, indexBlock.buffer, indexBlock.offset, indexBlock.size);
+
+        UBindBufferBase(GL_SHADER_STORAGE_BUFFER, POINT_LIGHT_BINDING, gClusteredLights.lightBuffer);
+    }
+
+    // The Hi-Z test needs the frustum-visible list and a pyramid from an earlier frame
+    bool isOcclusionCulling = gIsOcclusionEnabled && gIsOcclusionSupported && gIsCullingEnabled && gOcclusion.hasPyramid;
+    if (isOcclusionCulling && gLodBuckets[MAX_LOD_LEVELS] > 0)
+    {
+        UPROFILE_SCOPE(PROFILE_OCCLUSION);
+        UCullOcclusion(gOcclusion, gLodBuckets, gMesh.bounds, UHouseModelMatrix());
+    }
+
+    // Nothing in view: no draws at all
+    bool isDrawingHouses = gLodBuckets[MAX_LOD_LEVELS] > 0;
+    bool isDepthPrepass = gIsDepthPrepassEnabled && isDrawingHouses;
+
+    // The direct path and the lamp go through the sorted draw list; the indirect paths submit their own batches
+    bool isDirect = !isOcclusionCulling && gRenderPath == RENDER_PATH_DIRECT;
+    UBeginDrawList(gDrawList, gMesh.vao);
+    if (isDrawingHouses && isDirect)
+    {
+        const std::vector<GLInstanceData>& drawnInstances = gIsCullingEnabled || !gDynamicCasters.empty() ? gVisibleInstances : gHouseInstances.instances;
+        if (isDepthPrepass)
+            UQueueHouseParts(gDrawList, DRAW_PASS_DEPTH, drawnInstances, gLodBuckets, gCamera.Position, gCamera.Front);
+        UQueueHouseParts(gDrawList, DRAW_PASS_OPAQUE, drawnInstances, gLodBuckets, gCamera.Position, gCamera.Front);
+    }
+    UQueueLamp(gDrawList, gCamera.Position, gCamera.Front);
+    USortDrawList(gDrawList);
+
+    if (isDepthPrepass)
+    {
+        UPROFILE_SCOPE(PROFILE_PREPASS);
+
+        // Lay down the nearest depth of every pixel without writing color
+        UColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        if (isDirect)
+            UExecuteDrawPass(gDrawList, DRAW_PASS_DEPTH);
+        else
+            URenderHouses(isOcclusionCulling, true);
+        UColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    {
+        UPROFILE_SCOPE(PROFILE_HOUSE);
+
+        if (isDrawingHouses)
+        {
+            // After the prepass only the nearest fragment of each pixel passes, so each is shaded once
+            if (isDepthPrepass)
+            {
+                UDepthFunc(GL_EQUAL);
+                UDepthMask(GL_FALSE);
+            }
+            if (gIsOverdrawView)
+            {
+                UEnable(GL_BLEND);
+                UBlendFunc(GL_ONE, GL_ONE);
+            }
+
+            UBeginSampleCount(gSampleCounter);
+            if (isDirect)
+                UExecuteDrawPass(gDrawList, DRAW_PASS_OPAQUE);
+            else
+                URenderHouses(isOcclusionCulling, false);
+            UEndSampleCount(gSampleCounter);
+
+            UDepthFunc(GL_LESS);
+            UDepthMask(GL_TRUE);
+            UDisable(GL_BLEND);
+        }
+    }
+
+    {
+        UPROFILE_SCOPE(PROFILE_LAMP);
+
+        // LAMP: draw lamp
+        //----------------
+        UExecuteDrawPass(gDrawList, DRAW_PASS_LAMP);
+        ++gRenderStats.frames;
+
+        // The program and VAO stay bound, so next frame's binds of the same ones are filtered
+    }
+
+    // This frame's depth becomes the next frame's occluders
+    if (gIsOcclusionEnabled && gIsOcclusionSupported)
+    {
+        UPROFILE_SCOPE(PROFILE_HIZ);
+        UBuildHiZ(gOcclusion, projection * view);
+    }
+
+    // Everything reading this frame's stream region has been submitted
+    UEndStreamFrame(gStreamBuffer);
+
+    {
+        UPROFILE_SCOPE(PROFILE_PRESENT);
+
+        // Show the frame, or write it to disk in headless mode
+        UPresentFrame();
+    }
+}
+
+
+// Finishes a frame: swaps the window's buffers, or reads back the offscreen frame and writes it to disk
+void UPresentFrame()
+{
+    if (!gIsHeadless)
+    {
+        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+        glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+        return;
+    }
+
+    // Headless benchmarks time the rendering, not the PNG encoding; wait for the GPU instead of reading back
+    if (gBenchmark.isEnabled)
+    {
+        glFinish();
+        return;
+    }
+
+    std::vector<unsigned char> pixels(static_cast<size_t>(gFramebufferWidth) * gFramebufferHeight * 4);
+    UPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, gFramebufferWidth, gFramebufferHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+    // OpenGL rows run bottom-up; image files run top-down
+    flipImageVertically(pixels.data(), gFramebufferWidth, gFramebufferHeight, 4);
+
+    char frameNumber[16];
+    snprintf(frameNumber, sizeof(frameNumber), "_%05d", gHeadlessFrameIndex);
+    std::string path = gHeadlessOutput + frameNumber + (gIsHeadlessRawOutput ? ".rgba" : ".png");
+    if (!UWriteFrame(path, pixels.data(), gFramebufferWidth, gFramebufferHeight, gIsHeadlessRawOutput))
+        cout << "Failed to write frame " << path << endl;
+
+    ++gHeadlessFrameIndex;
+}
+
+
+// Writes an RGBA frame as raw bytes or as a PNG with stored (uncompressed) deflate blocks
+bool UWriteFrame(const std::string& path, const unsigned char* pixels, int width, int height, bool isRaw)
+{
+    std::ofstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+
+    const size_t rowSize = static_cast<size_t>(width) * 4;
+    if (isRaw)
+    {
+        file.write(reinterpret_cast<const char*>(pixels), rowSize * height);
+        return static_cast<bool>(file);
+    }
+
+    // PNG checksums
+    static unsigned int crcTable[256];
+    if (crcTable[1] == 0)
+    {
+        for (unsigned int n = 0; n < 256; ++n)
+        {
+            unsigned int c = n;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            crcTable[n] = c;
+        }
+    }
+
+    auto putBigEndian = [](std::vector<unsigned char>& out, unsigned int value) {
+        out.push_back(static_cast<unsigned char>(value >> 24));
+        out.push_back(static_cast<unsigned char>(value >> 16));
+        out.push_back(static_cast<unsigned char>(value >> 8));
+        out.push_back(static_cast<unsigned char>(value));
+    };
+    auto writeChunk = [&](const char* type, const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> chunk;
+        putBigEndian(chunk, static_cast<unsigned int>(data.size()));
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+
+        unsigned int crc = 0xFFFFFFFFu;
+        for (size_t i = 4; i < chunk.size(); ++i)
+            crc = crcTable[(crc ^ chunk[i]) & 0xFF] ^ (crc >> 8);
+        putBigEndian(chunk, crc ^ 0xFFFFFFFFu);
+
+        file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    };
+
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+    std::vector<unsigned char> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    header.push_back(8);    // Bit depth
+    header.push_back(6);    // Color type: RGBA
+    header.push_back(0);    // Compression
+    header.push_back(0);    // Filter
+    header.push_back(0);    // Interlace
+    writeChunk("IHDR", header);
+
+    // Scanlines, each prefixed with filter type 0
+    std::vector<unsigned char> scanlines;
+    scanlines.reserve((rowSize + 1) * height);
+    for (int y = 0; y < height; ++y)
+    {
+        scanlines.push_back(0);
+        scanlines.insert(scanlines.end(), pixels + y * rowSize, pixels + (y + 1) * rowSize);
+    }
+
+    // zlib stream of stored blocks, at most 65535 bytes each
+    std::vector<unsigned char> compressed;
+    compressed.push_back(0x78);
+    compressed.push_back(0x01);
+    for (size_t offset = 0; offset < scanlines.size() || offset == 0; )
+    {
+        size_t blockSize = std::min<size_t>(65535, scanlines.size() - offset);
+        bool isFinal = offset + blockSize == scanlines.size();
+        compressed.push_back(isFinal ? 1 : 0);
+        compressed.push_back(static_cast<unsigned char>(blockSize));
+        compressed.push_back(static_cast<unsigned char>(blockSize >> 8));
+        compressed.push_back(static_cast<unsigned char>(~blockSize));
+        compressed.push_back(static_cast<unsigned char>(~blockSize >> 8));
+        compressed.insert(compressed.end(), scanlines.begin() + offset, scanlines.begin() + offset + blockSize);
+        offset += blockSize;
+        if (isFinal)
+            break;
+    }
+
+    unsigned int adlerA = 1, adlerB = 0;
+    for (unsigned char byte : scanlines)
+    {
+        adlerA = (adlerA + byte) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+    }
+    putBigEndian(compressed, (adlerB << 16) | adlerA);
+    writeChunk("IDAT", compressed);
+
+    writeChunk("IEND", std::vector<unsigned char>());
+
+    return static_cast<bool>(file);
+}
+
+
+// Model matrix placing the house in the world
+glm::mat4 UHouseModelMatrix()
+{
+    // 1. Scales the object by 2
+    glm::mat4 scale = glm::scale(glm::vec3(2.0f, 2.0f, 2.0f));
+    // 2. Rotates shape by 15 degrees in the x axis
+    glm::mat4 rotation = glm::rotate(50.0f, glm::vec3(0.0, 1.0f, 0.0f));
+    // 3. Place object at the origin
+    glm::mat4 translation = glm::translate(glm::vec3(0.0f, 0.0f, 0.0f));
+    // Model matrix: transformations are applied right-to-left order
+    //glm::mat4 model = translation * rotation * scale;
+    
+    return rotation * translation * scale;
+}
+
+
+// Whether the render loop should run another frame
+bool UIsRunning()
+{
+    if (!gIsHeadless && glfwWindowShouldClose(gWindow))
+        return false;
+    if (gBenchmark.isEnabled)
+        return gBenchmark.frameIndex < gBenchmark.warmupFrames + gBenchmark.measuredFrames;
+    if (gIsHeadless)
+        return gHeadlessFrameIndex < gHeadlessFrameCount;
+    return true;
+}
+
+
+// Loads or builds the camera path and prepares the frame time buffer
+bool UStartBenchmark(Benchmark& benchmark)
+{
+    if (benchmark.cameraPathFile.empty())
+        UBuiltInCameraPath(benchmark.path);
+    else if (!ULoadCameraPath(benchmark.cameraPathFile, benchmark.path))
+        return false;
+
+    benchmark.frameIndex = 0;
+    benchmark.frameTimesMs.clear();
+    benchmark.frameTimesMs.reserve(benchmark.measuredFrames);
+
+    cout << "Benchmark: " << benchmark.warmupFrames << " warm-up and " << benchmark.measuredFrames << " measured frames" << endl;
+    return true;
+}
+
+
+// Places the camera on the path and starts the frame timer
+void UBenchmarkBeginFrame(Benchmark& benchmark)
+{
+    if (benchmark.frameIndex == benchmark.warmupFrames)
+    {
+        benchmark.firstDrawCall = gRenderStats.drawCalls;
+        benchmark.firstUniformUpload = gRenderStats.uniformUploads;
+        benchmark.firstUniformLookup = gRenderStats.uniformLookups;
+        benchmark.firstStateCall = gRenderStats.stateCalls;
+        benchmark.firstFilteredStateCall = gRenderStats.filteredStateCalls;
+    }
+
+    CameraKeyframe pose = USampleCameraPath(benchmark.path, benchmark.frameIndex * FIXED_FRAME_TIME);
+    gCamera = Camera(pose.position, glm::vec3(0.0f, 1.0f, 0.0f), pose.yaw, pose.pitch);
+
+    benchmark.frameStart = std::chrono::steady_clock::now();
+}
+
+
+// Stops the frame timer; frames after the warm-up are kept
+void UBenchmarkEndFrame(Benchmark& benchmark)
+{
+    double frameTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - benchmark.frameStart).count();
+    if (benchmark.frameIndex >= benchmark.warmupFrames)
+        benchmark.frameTimesMs.push_back(frameTimeMs);
+    ++benchmark.frameIndex;
+}
+
+
+// Prints the frame time statistics and writes them to the JSON report
+bool UWriteBenchmarkReport(const Benchmark& benchmark)
+{
+    if (benchmark.frameTimesMs.empty())
+    {
+        cout << "Benchmark stopped before any measured frame" << endl;
+        return false;
+    }
+
+    std::vector<double> sorted = benchmark.frameTimesMs;
+    std::sort(sorted.begin(), sorted.end());
+
+    // Nearest-rank percentile
+    auto percentile = [&sorted](double fraction) {
+        size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+        return sorted[std::max<size_t>(rank, 1) - 1];
+    };
+
+    double totalMs = 0.0;
+    for (double frameTimeMs : sorted)
+        totalMs += frameTimeMs;
+    unsigned long long drawCalls = gRenderStats.drawCalls - benchmark.firstDrawCall;
+    double drawsPerSecond = drawCalls / (totalMs / 1000.0);
+    unsigned long long uniformUploads = gRenderStats.uniformUploads - benchmark.firstUniformUpload;
+    unsigned long long uniformLookups = gRenderStats.uniformLookups - benchmark.firstUniformLookup;
+    unsigned long long stateCalls = gRenderStats.stateCalls - benchmark.firstStateCall;
+    unsigned long long filteredStateCalls = gRenderStats.filteredStateCalls - benchmark.firstFilteredStateCall;
+    bool isComplete = static_cast<int>(sorted.size()) == benchmark.measuredFrames;
+
+    cout << "Benchmark frame time (ms): min " << sorted.front() << ", p50 " << percentile(0.50)
+        << ", p95 " << percentile(0.95) << ", p99 " << percentile(0.99) << ", max " << sorted.back() << endl;
+    cout << "Benchmark: " << drawsPerSecond << " draws per second over " << sorted.size() << " frames" << endl;
+
+    std::ofstream report(benchmark.output.c_str());
+    report << "{\n"
+        << "  \"complete\": " << (isComplete ? "true" : "false") << ",\n"
+        << "  \"renderPath\": \"" << (gRenderPath == RENDER_PATH_DIRECT ? "direct" : "indirect") << "\",\n"
+        << "  \"headless\": " << (gIsHeadless ? "true" : "false") << ",\n"
+        << "  \"width\": " << gFramebufferWidth << ",\n"
+        << "  \"height\": " << gFramebufferHeight << ",\n"
+        << "  \"cameraPath\": \"" << (benchmark.cameraPathFile.empty() ? "built-in" : benchmark.cameraPathFile) << "\",\n"
+        << "  \"warmupFrames\": " << benchmark.warmupFrames << ",\n"
+        << "  \"measuredFrames\": " << sorted.size() << ",\n"
+        << "  \"frameTimeMs\": {\n"
+        << "    \"min\": " << sorted.front() << ",\n"
+        << "    \"p50\": " << percentile(0.50) << ",\n"
+        << "    \"p95\": " << percentile(0.95) << ",\n"
+        << "    \"p99\": " << percentile(0.99) << ",\n"
+        << "    \"max\": " << sorted.back() << ",\n"
+        << "    \"mean\": " << totalMs / sorted.size() << "\n"
+        << "  },\n"
+        << "  \"drawCalls\": " << drawCalls << ",\n"
+        << "  \"drawsPerSecond\": " << drawsPerSecond << ",\n"
+        << "  \"uniformUploads\": " << uniformUploads << ",\n"
+        << "  \"uniformLookups\": " << uniformLookups << ",\n"
+        << "  \"stateCalls\": " << stateCalls << ",\n"
+        << "  \"filteredStateCalls\": " << filteredStateCalls << ",\n"
+        << "  \"perFrame\": {\n"
+        << "    \"drawCalls\": " << static_cast<double>(drawCalls) / sorted.size() << ",\n"
+        << "    \"uniformUploads\": " << static_cast<double>(uniformUploads) / sorted.size() << ",\n"
+        << "    \"uniformLookups\": " << static_cast<double>(uniformLookups) / sorted.size() << ",\n"
+        << "    \"stateCalls\": " << static_cast<double>(stateCalls) / sorted.size() << ",\n"
+        << "    \"filteredStateCalls\": " << static_cast<double>(filteredStateCalls) / sorted.size() << "\n"
+        << "  }\n"
+        << "}\n";
+
+    if (!report)
+    {
+        cout << "Failed to write benchmark report " << benchmark.output << endl;
+        return false;
+    }
+    return isComplete;
+}
+
+
+/* Runs every --self-check check and reports the overall result
+ * Each check compares an optimized path with its reference, or runs a mesh tool on an input whose outcome
+ * is known, and prints one line; all of them run even after a failure.
+ */
+bool URunSelfChecks()
+{
+    cout << "Self-check:" << endl;
+    bool isPassing = UCheckFrustumTest();
+    isPassing = UCheckSimplifyMesh() && isPassing;
+    isPassing = UCheckMeshFile() && isPassing;
+    isPassing = UCheckMipChain() && isPassing;
+    isPassing = UCheckInstanceBuffer() && isPassing;
+    cout << "Self-check " << (isPassing ? "passed" : "failed") << endl;
+    return isPassing;
+}
+
+
+// The SSE frustum test classifies boxes in and around a view exactly as the scalar one does
+bool UCheckFrustumTest()
+{
+#ifdef CS330_SSE
+    Frustum frustum;
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), static_cast<float>(WINDOW_WIDTH) / WINDOW_HEIGHT, CAMERA_NEAR, CAMERA_FAR);
+    UExtractFrustum(projection * glm::lookAt(glm::vec3(4.0f, 3.0f, 12.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)), frustum);
+
+    // Fixed pseudo-random boxes, so every run tests the same ones
+    unsigned int state = 1;
+    auto random = [&state](float low, float high) {
+        state = state * 1664525u + 1013904223u;
+        return low + (high - low) * (state >> 8) / 16777216.0f;
+    };
+
+    const int BOX_COUNT = 10000;
+    int counts[3] = {};
+    int mismatches = 0;
+    for (int i = 0; i < BOX_COUNT; ++i)
+    {
+        glm::vec3 center(random(-60.0f, 60.0f), random(-60.0f, 60.0f), random(-110.0f, 20.0f));
+        glm::vec3 extent(random(0.0f, 6.0f), random(0.0f, 6.0f), random(0.0f, 6.0f));
+        BoundingBox box;
+        box.min = center - extent;
+        box.max = center + extent;
+
+        FrustumTest result = UTestFrustum(frustum, box);
+        if (result != UTestFrustumScalar(frustum, box))
+            ++mismatches;
+        ++counts[result];
+    }
+
+    if (mismatches > 0 || counts[FRUSTUM_OUTSIDE] == 0 || counts[FRUSTUM_INTERSECTS] == 0 || counts[FRUSTUM_INSIDE] == 0)
+    {
+        cout << "  FAILED frustum test: SSE and scalar disagree on " << mismatches << " of " << BOX_COUNT << " boxes ("
+            << counts[FRUSTUM_INSIDE] << " inside, " << counts[FRUSTUM_INTERSECTS] << " crossing, " << counts[FRUSTUM_OUTSIDE] << " outside)" << endl;
+        return false;
+    }
+    cout << "  ok frustum test: SSE and scalar agree on " << BOX_COUNT << " boxes (" << counts[FRUSTUM_INSIDE] << " inside, "
+        << counts[FRUSTUM_INTERSECTS] << " crossing, " << counts[FRUSTUM_OUTSIDE] << " outside)" << endl;
+#else
+    cout << "  skipped frustum test: built without SSE, so only the scalar test exists" << endl;
+#endif
+    return true;
+}
+
+
+/* USimplifyMesh reduces a dense seamed grid level after level, as UGenerateLods would
+ * The grid's right half has its own texture coordinates, so a column of twin vertices runs down the middle;
+ * the seam has to thin out with the rest of the grid, and every index has to stay in range.
+ */
+bool UCheckSimplifyMesh()
+{
+    const int SIDE = 32;    // Quads per row and column
+    std::vector<GLfloat> verts;
+    auto addVertex = [&verts](float x, float y, float u) {
+        const GLfloat vertex[FLOATS_PER_VERTEX] = { x, y, 0.0f, 0.0f, 0.0f, 1.0f, u, y / SIDE };
+        verts.insert(verts.end(), vertex, vertex + FLOATS_PER_VERTEX);
+        return static_cast<GLushort>(verts.size() / FLOATS_PER_VERTEX - 1);
+    };
+
+    // Vertex of grid point (x, y) for each half; the two differ only on the seam column
+    std::vector<GLushort> left((SIDE + 1) * (SIDE + 1));
+    std::vector<GLushort> right(left.size());
+    for (int y = 0; y <= SIDE; ++y)
+    {
+        for (int x = 0; x <= SIDE; ++x)
+        {
+            int point = y * (SIDE + 1) + x;
+            left[point] = addVertex(static_cast<float>(x), static_cast<float>(y), static_cast<float>(x) / SIDE);
+            right[point] = x == SIDE / 2 ? addVertex(static_cast<float>(x), static_cast<float>(y), 1.0f) : left[point];
+        }
+    }
+
+    std::vector<GLushort> level;
+    for (int y = 0; y < SIDE; ++y)
+    {
+        for (int x = 0; x < SIDE; ++x)
+        {
+            const std::vector<GLushort>& half = x < SIDE / 2 ? left : right;
+            int point = y * (SIDE + 1) + x;
+            GLushort quad[6] = { half[point], half[point + 1], half[point + SIDE + 2], half[point], half[point + SIDE + 2], half[point + SIDE + 1] };
+            level.insert(level.end(), quad, quad + 6);
+        }
+    }
+
+    // Seam vertices a level still uses, both sides counted
+    const size_t vertexCount = verts.size() / FLOATS_PER_VERTEX;
+    auto countSeamVertices = [&verts, vertexCount](const std::vector<GLushort>& indices) {
+        std::vector<char> isUsed(vertexCount, 0);
+        for (GLushort index : indices)
+            isUsed[index] = 1;
+        size_t count = 0;
+        for (size_t vertex = 0; vertex < vertexCount; ++vertex)
+            count += isUsed[vertex] && verts[vertex * FLOATS_PER_VERTEX] == SIDE / 2;
+        return count;
+    };
+
+    const size_t firstTriangles = level.size() / 3;
+    const size_t firstSeamVertices = countSeamVertices(level);
+    bool isValid = true;
+    GLuint levels = 1;
+    for (; levels < MAX_LOD_LEVELS; ++levels)
+    {
+        size_t triangles = level.size() / 3;
+        std::vector<GLushort> reduced = USimplifyMesh(verts.data(), vertexCount, level, static_cast<size_t>(std::ceil(triangles * LOD_REDUCTION)));
+        if (reduced.empty() || reduced.size() / 3 > triangles * (1.0f - LOD_MIN_GAIN))
+        {
+            isValid = false;
+            break;
+        }
+        for (GLushort index : reduced)
+            isValid = isValid && index < vertexCount;
+        level.swap(reduced);
+    }
+
+    size_t seamVertices = countSeamVertices(level);
+    isValid = isValid && seamVertices < firstSeamVertices;
+    cout << "  " << (isValid ? "ok" : "FAILED") << " mesh simplification: " << levels << " levels, " << firstTriangles << " to "
+        << level.size() / 3 << " triangles, seam vertices " << firstSeamVertices << " to " << seamVertices << endl;
+    return isValid;
+}
+
+
+// ULoadMesh takes an exported house and rejects copies with a bad magic, a cut-off part table or an index past the vertices
+bool UCheckMeshFile()
+{
+    const char* path = "self-check.mesh";
+    if (!UExportMesh(path))
+    {
+        cout << "  FAILED mesh file: could not export the house" << endl;
+        return false;
+    }
+
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    std::vector<char> original(static_cast<size_t>(input.tellg()));
+    input.seekg(0);
+    if (original.size() < sizeof(MeshFileHeader) || !input.read(original.data(), original.size()))
+    {
+        cout << "  FAILED mesh file: could not read back " << path << endl;
+        return false;
+    }
+    input.close();
+
+    MeshFileHeader header;
+    memcpy(&header, original.data(), sizeof(header));
+
+    // Writes the file, with damage applied to a copy of the export, and tries to load it
+    auto load = [path, &original](const std::function<void(std::vector<char>&)>& damage) {
+        std::vector<char> bytes = original;
+        damage(bytes);
+        {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        }
+        GLMesh mesh;
+        bool isLoaded = ULoadMesh(path, mesh);
+        if (isLoaded)
+            UDestroyMesh(mesh);
+        return isLoaded;
+    };
+
+    bool isIntactLoaded = load([](std::vector<char>&) {});
+    bool isMagicRejected = !load([](std::vector<char>& bytes) { bytes[0] ^= 0xFF; });
+    bool isTruncationRejected = !load([&header](std::vector<char>& bytes) {
+        bytes.resize(static_cast<size_t>(header.partOffset) + sizeof(MeshFilePart) / 2);
+    });
+    bool isIndexRejected = !load([&header](std::vector<char>& bytes) {
+        const GLushort outOfRange = 0xFFFF;
+        memcpy(&bytes[static_cast<size_t>(header.indexOffset)], &outOfRange, sizeof(outOfRange));
+    });
+    std::remove(path);
+
+    bool isValid = isIntactLoaded && isMagicRejected && isTruncationRejected && isIndexRejected;
+    cout << "  " << (isValid ? "ok" : "FAILED") << " mesh file: intact " << (isIntactLoaded ? "loaded" : "REJECTED")
+        << ", bad magic " << (isMagicRejected ? "rejected" : "LOADED") << ", truncated " << (isTruncationRejected ? "rejected" : "LOADED")
+        << ", bad index " << (isIndexRejected ? "rejected" : "LOADED") << endl;
+    return isValid;
+}
+
+
+// Every SIMD path of the mip filter builds the same bytes as the scalar one, for both filters and an odd-sized image
+bool UCheckMipChain()
+{
+    const int width = 67;
+    const int height = 45;
+    std::vector<unsigned char> image(static_cast<size_t>(width) * height * 4);
+    unsigned int state = 1;
+    for (unsigned char& byte : image)
+    {
+        state = state * 1664525u + 1013904223u;
+        byte = static_cast<unsigned char>(state >> 24);
+    }
+
+    // Paths the build has, beyond the scalar one
+    std::vector<MipSimd> paths;
+#ifdef CS330_SSE
+    paths.push_back(MIP_SIMD_SSE2);
+#endif
+#ifdef CS330_AVX2
+    paths.push_back(MIP_SIMD_AVX2);
+#endif
+    const char* const pathNames[] = { "scalar", "SSE2", "AVX2" };
+
+    const MipSimd widest = gMipSimd;
+    bool isValid = true;
+    std::string compared;
+    for (MipFilter filter : { MIP_FILTER_BOX, MIP_FILTER_KAISER })
+    {
+        gMipSimd = MIP_SIMD_SCALAR;
+        std::vector<unsigned char> reference = UBuildMipChain(image.data(), width, height, filter);
+        for (MipSimd path : paths)
+        {
+            gMipSimd = path;
+            if (UBuildMipChain(image.data(), width, height, filter) != reference)
+            {
+                cout << "  FAILED mip chain: " << pathNames[path] << " differs from scalar with the "
+                    << (filter == MIP_FILTER_BOX ? "box" : "kaiser") << " filter" << endl;
+                isValid = false;
+            }
+        }
+    }
+    gMipSimd = widest;
+
+    for (MipSimd path : paths)
+        compared += std::string(compared.empty() ? "" : " and ") + pathNames[path];
+    if (paths.empty())
+        cout << "  skipped mip chain: built without SSE2 or AVX2, so only the scalar filter exists" << endl;
+    else if (isValid)
+        cout << "  ok mip chain: " << compared << " match scalar with both filters" << endl;
+    return isValid;
+}
+
+
+/* Bulk add, remove and update keep handles and instances paired, and UUpdateInstanceBvh keeps every node
+ * bounding its subtree, through a rebuild after the adds and removes and a refit after the updates
+ * Works on the CPU copy only; nothing is uploaded.
+ */
+bool UCheckInstanceBuffer()
+{
+    const size_t HOUSE_COUNT = 20;
+    GLInstanceBuffer instances = {};
+    InstanceBvh bvh;
+    BoundingBox meshBounds;
+    meshBounds.min = glm::vec3(-1.0f);
+    meshBounds.max = glm::vec3(1.0f);
+    const glm::mat4 meshModel(1.0f);
+
+    // Each house remembers its lot in the tint, so a handle can be checked against the data it should reach
+    auto house = [](float x, float z, float lot) {
+        GLInstanceData data;
+        data.model = glm::translate(glm::vec3(x, 0.0f, z));
+        data.variation = glm::vec4(1.0f, 1.0f, 1.0f, lot);
+        return data;
+    };
+    auto isAt = [&instances](GLuint handle, float lot) {
+        return UIsInstanceHandleValid(instances, handle) && instances.instances[instances.handleSlots[handle]].variation.a == lot;
+    };
+
+    std::vector<GLInstanceData> houses;
+    for (size_t i = 0; i < HOUSE_COUNT; ++i)
+        houses.push_back(house((i % 5) * HOUSE_SPACING, (i / 5) * HOUSE_SPACING, static_cast<float>(i)));
+    std::vector<GLuint> handles(HOUSE_COUNT);
+    UAddInstances(instances, houses.data(), houses.size(), handles.data());
+    UUpdateInstanceBvh(bvh, instances, meshBounds, meshModel);
+
+    bool isPaired = instances.instances.size() == HOUSE_COUNT;
+    for (size_t i = 0; i < HOUSE_COUNT; ++i)
+        isPaired = isPaired && isAt(handles[i], static_cast<float>(i));
+
+    // A repeat and a handle never given out are skipped and reported; the rest of the call still happens
+    const GLuint removed[] = { handles[3], handles[7], handles[3], 1000 };
+    bool isRemoveReported = !URemoveInstances(instances, removed, 4);
+    isPaired = isPaired && instances.instances.size() == HOUSE_COUNT - 2
+        && !UIsInstanceHandleValid(instances, handles[3]) && !UIsInstanceHandleValid(instances, handles[7]);
+    for (size_t i = 0; i < HOUSE_COUNT; ++i)
+        isPaired = isPaired && (i == 3 || i == 7 || isAt(handles[i], static_cast<float>(i)));
+
+    // The freed handles are given out again
+    GLInstanceData added[2] = { house(-HOUSE_SPACING, 0.0f, 20.0f), house(-HOUSE_SPACING, HOUSE_SPACING, 21.0f) };
+    GLuint addedHandles[2];
+    UAddInstances(instances, added, 2, addedHandles);
+    isPaired = isPaired && instances.instances.size() == HOUSE_COUNT && isAt(addedHandles[0], 20.0f) && isAt(addedHandles[1], 21.0f)
+        && std::min(addedHandles[0], addedHandles[1]) == handles[3] && std::max(addedHandles[0], addedHandles[1]) == handles[7];
+    UUpdateInstanceBvh(bvh, instances, meshBounds, meshModel);
+
+    // Moves only, so the BVH is refit rather than rebuilt; the unknown handle is skipped and reported
+    const GLuint moved[] = { handles[0], handles[12], addedHandles[1], 1000 };
+    GLInstanceData movedData[4] = { house(40.0f, 3.0f, 0.0f), house(-25.0f, 30.0f, 12.0f), house(5.0f, -50.0f, 21.0f), house(0.0f, 0.0f, 0.0f) };
+    bool isUpdateReported = !UUpdateInstances(instances, moved, movedData, 4);
+    bool isRefit = !instances.isLayoutChanged && instances.movedSlots.size() == 3;
+    UUpdateInstanceBvh(bvh, instances, meshBounds, meshModel);
+    isPaired = isPaired && isAt(handles[0], 0.0f) && isAt(handles[12], 12.0f) && isAt(addedHandles[1], 21.0f)
+        && instances.instances[instances.handleSlots[handles[0]]].model == movedData[0].model;
+
+    // Every instance bound is current, and every node is exactly the union of its children or items
+    auto isSame = [](const BoundingBox& a, const BoundingBox& b) { return a.min == b.min && a.max == b.max; };
+    bool isBvhValid = bvh.bounds.size() == instances.instances.size();
+    for (size_t slot = 0; isBvhValid && slot < instances.instances.size(); ++slot)
+        isBvhValid = isSame(bvh.bounds[slot], UTransformBounds(meshBounds, instances.instances[slot].model * meshModel));
+    for (const BvhNode& node : bvh.nodes)
+    {
+        BoundingBox bounds;
+        if (node.left != 0)
+        {
+            bounds.min = glm::min(bvh.nodes[node.left].bounds.min, bvh.nodes[node.left + 1].bounds.min);
+            bounds.max = glm::max(bvh.nodes[node.left].bounds.max, bvh.nodes[node.left + 1].bounds.max);
+        }
+        else
+        {
+            bounds = bvh.bounds[bvh.items[node.firstItem]];
+            for (GLuint item = node.firstItem + 1; item < node.firstItem + node.itemCount; ++item)
+            {
+                bounds.min = glm::min(bounds.min, bvh.bounds[bvh.items[item]].min);
+                bounds.max = glm::max(bounds.max, bvh.bounds[bvh.items[item]].max);
+            }
+        }
+        isBvhValid = isBvhValid && isSame(node.bounds, bounds);
+    }
+
+    bool isValid = isPaired && isRemoveReported && isUpdateReported && isRefit && isBvhValid;
+    cout << "  " << (isValid ? "ok" : "FAILED") << " instance buffer: add, remove and update " << (isPaired ? "keep" : "DO NOT KEEP")
+        << " handles paired, bad handles " << (isRemoveReported && isUpdateReported ? "reported" : "NOT REPORTED") << ", BVH "
+        << (isRefit ? "refit" : "REBUILT") << " " << (isBvhValid ? "consistent" : "INCONSISTENT") << endl;
+    return isValid;
+}
+
+
+// Two laps around the house at changing distance and height, looking at its center
+void UBuiltInCameraPath(std::vector<CameraKeyframe>& path)
+{
+    const int keyframeCount = 17;
+    const float lapTime = 8.0f;
+
+    path.clear();
+    for (int i = 0; i < keyframeCount; ++i)
+    {
+        float angle = glm::radians(360.0f * 2.0f * i / (keyframeCount - 1));
+        float radius = 7.0f + 2.0f * std::sin(angle * 0.5f);
+        float height = 1.5f + 1.0f * std::cos(angle);
+        glm::vec3 position(radius * std::cos(angle), height, radius * std::sin(angle));
+
+        // Yaw keeps growing past 360 so the spline never turns the long way round
+        CameraKeyframe keyframe;
+        keyframe.time = lapTime * 2.0f * i / (keyframeCount - 1);
+        keyframe.position = position;
+        keyframe.yaw = glm::degrees(angle) + 180.0f;
+        keyframe.pitch = -glm::degrees(std::atan2(height, radius));
+        path.push_back(keyframe);
+    }
+}
+
+
+// Reads a path written by --record-path: one "time x y z yaw pitch" line per frame, # starts a comment
+bool ULoadCameraPath(const std::string& filename, std::vector<CameraKeyframe>& path)
+{
+    std::ifstream file(filename.c_str());
+    if (!file)
+    {
+        cout << "Failed to open camera path " << filename << endl;
+        return false;
+    }
+
+    path.clear();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        CameraKeyframe keyframe;
+        std::istringstream fields(line);
+        if (!(fields >> keyframe.time >> keyframe.position.x >> keyframe.position.y >> keyframe.position.z >> keyframe.yaw >> keyframe.pitch)
+            || (!path.empty() && keyframe.time <= path.back().time))
+        {
+            cout << "Invalid camera path line in " << filename << ": " << line << endl;
+            return false;
+        }
+        path.push_back(keyframe);
+    }
+
+    if (path.empty())
+    {
+        cout << "Camera path " << filename << " has no keyframes" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Catmull-Rom interpolation between p1 and p2
+template <typename T>
+T UCatmullRom(const T& p0, const T& p1, const T& p2, const T& p3, float t)
+{
+    float t2 = t * t;
+    float t3 = t2 * t;
+    return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+
+// Camera pose on the path at a time, looping once the path ends
+CameraKeyframe USampleCameraPath(const std::vector<CameraKeyframe>& path, float time)
+{
+    if (path.size() == 1)
+        return path[0];
+
+    time = std::fmod(time, path.back().time - path.front().time) + path.front().time;
+
+    size_t segment = 0;
+    while (segment + 2 < path.size() && path[segment + 1].time <= time)
+        ++segment;
+
+    const CameraKeyframe& k0 = path[segment > 0 ? segment - 1 : 0];
+    const CameraKeyframe& k1 = path[segment];
+    const CameraKeyframe& k2 = path[segment + 1];
+    const CameraKeyframe& k3 = path[std::min(segment + 2, path.size() - 1)];
+    float t = (time - k1.time) / (k2.time - k1.time);
+
+    CameraKeyframe pose;
+    pose.time = time;
+    pose.position = UCatmullRom(k0.position, k1.position, k2.position, k3.position, t);
+    pose.yaw = UCatmullRom(k0.yaw, k1.yaw, k2.yaw, k3.yaw, t);
+    pose.pitch = UCatmullRom(k0.pitch, k1.pitch, k2.pitch, k3.pitch, t);
+    return pose;
+}
+
+
+// Draws the houses through the indirect or occlusion-culled path, shaded or depth only
+void URenderHouses(bool isOcclusionCulling, bool isDepthOnly)
+{
+    if (isOcclusionCulling)
+        URenderPartsOcclusionCulled(gOcclusion, isDepthOnly);
+    else
+        URenderPartsIndirect(gLodBuckets, isDepthOnly);
+
+    // Those paths bind their own programs
+    gDrawList.program = DRAW_STATE_UNKNOWN;
+}
+
+
+// Starts the frame's draw list; boundVao is the vertex array already bound, if any
+void UBeginDrawList(DrawList& list, GLuint boundVao)
+{
+    list.items.clear();
+    list.models.clear();
+    list.program = DRAW_STATE_UNKNOWN;
+    list.material = DRAW_STATE_UNKNOWN;
+    list.model = DRAW_STATE_UNKNOWN;
+    list.vao = boundVao;
+}
+
+
+// Packs a draw's state and view depth into its sort key; vertex arrays get a key slot the first time they are seen
+uint64_t UDrawKey(DrawList& list, GLuint pass, GLuint program, GLuint material, GLuint vao, float depth)
+{
+    GLuint vaoSlot = static_cast<GLuint>(std::find(list.vaos.begin(), list.vaos.end(), vao) - list.vaos.begin());
+    if (vaoSlot == list.vaos.size())
+        list.vaos.push_back(vao);
+
+    // Depth as a fraction of the camera range; behind the camera and beyond the far plane clamp to the ends
+    double range = glm::clamp(static_cast<double>(depth) / CAMERA_FAR, 0.0, 1.0);
+    uint64_t depthBits = static_cast<uint64_t>(range * 0xFFFFFFFFu);
+
+    return static_cast<uint64_t>(pass) << DRAW_KEY_PASS_SHIFT
+        | static_cast<uint64_t>(program & 0xFF) << DRAW_KEY_PROGRAM_SHIFT
+        | static_cast<uint64_t>(material & 0xFF) << DRAW_KEY_MATERIAL_SHIFT
+        | static_cast<uint64_t>(vaoSlot & 0xFF) << DRAW_KEY_VAO_SHIFT
+        | depthBits;
+}
+
+
+GLuint UAddDrawModel(DrawList& list, const glm::mat4& model)
+{
+    list.models.push_back(model);
+    return static_cast<GLuint>(list.models.size() - 1);
+}
+
+
+/* Queues one draw per part and detail level, over that level's instance range, as the direct path draws them
+ * Each draw's depth is that of its nearest house. The depth pass needs no material, so its draws share one
+ * program and sort by depth alone.
+ */
+void UQueueHouseParts(DrawList& list, GLuint pass, const std::vector<GLInstanceData>& instances, const GLuint lodBuckets[],
+    const glm::vec3& viewPosition, const glm::vec3& viewDirection)
+{
+    // Nearest house of each level's bucket
+    float levelDepths[MAX_LOD_LEVELS];
+    for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+    {
+        levelDepths[level] = CAMERA_FAR;
+        for (GLuint i = lodBuckets[level]; i < lodBuckets[level + 1]; ++i)
+            levelDepths[level] = std::min(levelDepths[level], glm::dot(glm::vec3(instances[i].model[3]) - viewPosition, viewDirection));
+    }
+
+    GLuint model = UAddDrawModel(list, UHouseModelMatrix());
+    for (const GLMeshPart& part : gMesh.parts)
+    {
+        GLuint program = pass == DRAW_PASS_DEPTH ? static_cast<GLuint>(SHADER_FEATURE_DEPTH_ONLY) : gMaterials[part.material].features;
+        GLuint material = pass == DRAW_PASS_DEPTH ? 0 : part.material + 1;
+        for (GLuint level = 0; level < part.lodCount; ++level)
+        {
+            // The part's coarsest level also serves every coarser bucket, which follow it in the instance buffer
+            GLuint firstInstance = lodBuckets[level];
+            GLuint endInstance = level + 1 == part.lodCount ? lodBuckets[MAX_LOD_LEVELS] : lodBuckets[level + 1];
+            if (firstInstance == endInstance)
+                continue;
+
+            float depth = CAMERA_FAR;
+            for (GLuint bucket = level; bucket < (level + 1 == part.lodCount ? MAX_LOD_LEVELS : level + 1); ++bucket)
+                depth = std::min(depth, levelDepths[bucket]);
+
+            DrawItem item;
+            item.key = UDrawKey(list, pass, program, material, gMesh.vao, depth);
+            item.model = model;
+            item.indexCount = part.lodIndexCount[level];
+            item.firstIndex = part.lodFirstIndex[level];
+            item.baseVertex = part.baseVertex;
+            item.firstInstance = firstInstance;
+            item.instanceCount = endInstance - firstInstance;
+            list.items.push_back(item);
+        }
+    }
+}
+
+
+// Queues the small cube that marks the light source
+void UQueueLamp(DrawList& list, const glm::vec3& viewPosition, const glm::vec3& viewDirection)
+{
+    //Transform the smaller cube used as a visual que for the light source
+    glm::mat4 model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+
+    const GLMeshPart& lamp = gMesh.parts[gMesh.lampPart];
+    DrawItem item;
+    item.key = UDrawKey(list, DRAW_PASS_LAMP, DRAW_PROGRAM_LAMP, 0, gMesh.vao, glm::dot(gLightPosition - viewPosition, viewDirection));
+    item.model = UAddDrawModel(list, model);
+    item.indexCount = lamp.indexCount;
+    item.firstIndex = lamp.firstIndex;
+    item.baseVertex = lamp.baseVertex;
+    item.firstInstance = 0;
+    item.instanceCount = 1;
+    list.items.push_back(item);
+}
+
+
+// Least significant digit radix sort of the items by key, a byte per pass; bytes every key shares are skipped
+void USortDrawList(DrawList& list)
+{
+    list.sortScratch.resize(list.items.size());
+    for (unsigned shift = 0; shift < 64; shift += 8)
+    {
+        size_t counts[256] = {};
+        for (const DrawItem& item : list.items)
+            ++counts[(item.key >> shift) & 0xFF];
+        if (counts[(list.items.empty() ? 0 : list.items[0].key >> shift) & 0xFF] == list.items.size())
+            continue;
+
+        size_t offset = 0;
+        for (size_t& count : counts)
+        {
+            size_t bucketSize = count;
+            count = offset;
+            offset += bucketSize;
+        }
+        for (const DrawItem& item : list.items)
+            list.sortScratch[counts[(item.key >> shift) & 0xFF]++] = item;
+        list.items.swap(list.sortScratch);
+    }
+}
+
+
+/* Submits the sorted draws of one pass
+ * State is only set where a key differs from the one before it: a program switch also re-sends the material
+ * and model, since uniforms belong to the program.
+ */
+void UExecuteDrawPass(DrawList& list, GLuint pass)
+{
+    const uint64_t passKey = static_cast<uint64_t>(pass) << DRAW_KEY_PASS_SHIFT;
+    auto begin = std::lower_bound(list.items.begin(), list.items.end(), passKey,
+        [](const DrawItem& item, uint64_t key) { return item.key < key; });
+
+    for (auto it = begin; it != list.items.end() && (it->key >> DRAW_KEY_PASS_SHIFT) == pass; ++it)
+    {
+        const DrawItem& item = *it;
+        GLuint program = (item.key >> DRAW_KEY_PROGRAM_SHIFT) & 0xFF;
+        GLuint material = (item.key >> DRAW_KEY_MATERIAL_SHIFT) & 0xFF;
+        GLuint vao = list.vaos[(item.key >> DRAW_KEY_VAO_SHIFT) & 0xFF];
+        const GLProgramUniforms& uniforms = program == DRAW_PROGRAM_LAMP ? gLampProgramUniforms : gObjectVariants[program].uniforms;
+
+        if (program != list.program)
+        {
+            if (UUseProgram(program == DRAW_PROGRAM_LAMP ? gLampProgramId : gObjectVariants[program].programId))
+                ++gRenderStats.programSwitches;
+            list.program = program;
+            list.material = DRAW_STATE_UNKNOWN;
+            list.model = DRAW_STATE_UNKNOWN;
+        }
+
+        if (material != list.material)
+        {
+            if (material > 0)
+            {
+                const GLMaterial& properties = gMaterials[material - 1];
+                glUniform2fv(uniforms.uvScale, 1, glm::value_ptr(*properties.uvScale));
+                glUniform1i(uniforms.textureLayer, properties.textureLayer);
+                gRenderStats.uniformUploads += 2;
+            }
+            list.material = material;
+        }
+
+        if (item.model != list.model)
+        {
+            glUniformMatrix4fv(uniforms.model, 1, GL_FALSE, glm::value_ptr(list.models[item.model]));
+            ++gRenderStats.uniformUploads;
+            list.model = item.model;
+        }
+
+        if (vao != list.vao)
+        {
+            if (UBindVertexArray(vao))
+                ++gRenderStats.vaoBinds;
+            list.vao = vao;
+        }
+
+        // Draws the triangles; the base vertex maps the part's local indices into the shared vertex buffer,
+        // the base instance selects the houses drawn at this level
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, item.indexCount, GL_UNSIGNED_SHORT,
+            (void*)(item.firstIndex * sizeof(GLushort)), item.instanceCount, item.baseVertex, item.firstInstance);
+        ++gRenderStats.drawCalls;
+        gRenderStats.indices += static_cast<unsigned long long>(item.indexCount) * item.instanceCount;
+    }
+}
+
+
+// Draws the whole part table, every instance and detail level, with one glMultiDrawElementsIndirect call per shader variant
+void URenderPartsIndirect(const GLuint lodBuckets[], bool isDepthOnly)
+{
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, gIndirectDraws.drawDataBuffer);
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectDraws.commandBuffer);
+
+    // One command per part and level; each covers its level's instance range, as in UQueueHouseParts
+    bool isChanged = false;
+    for (size_t i = 0; i < gIndirectDraws.commands.size(); ++i)
+    {
+        const GLMeshPart& part = gMesh.parts[gIndirectDraws.partOrder[i / MAX_LOD_LEVELS]];
+        GLuint level = i % MAX_LOD_LEVELS;
+        GLuint firstInstance = 0;
+        GLuint endInstance = 0;
+        if (level < part.lodCount)
+        {
+            firstInstance = lodBuckets[level];
+            endInstance = level + 1 == part.lodCount ? lodBuckets[MAX_LOD_LEVELS] : lodBuckets[level + 1];
+        }
+
+        DrawElementsIndirectCommand& command = gIndirectDraws.commands[i];
+        if (command.instanceCount != endInstance - firstInstance || command.baseInstance != firstInstance)
+        {
+            command.instanceCount = endInstance - firstInstance;
+            command.baseInstance = firstInstance;
+            isChanged = true;
+        }
+        gRenderStats.indices += static_cast<unsigned long long>(command.count) * command.instanceCount;
+    }
+
+    // The commands only change when houses change level, enter or leave the view
+    if (isChanged)
+    {
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, gIndirectDraws.commands.size() * sizeof(DrawElementsIndirectCommand), gIndirectDraws.commands.data());
+        ++gRenderStats.bufferUploads;
+    }
+    UDrawIndirectBatches(gIndirectDraws, isDepthOnly);
+
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+// Submits the bound indirect commands, one call and program per shader variant
+void UDrawIndirectBatches(const GLIndirectDraws& draws, bool isDepthOnly)
+{
+    // Depth needs no material, so every command goes through one call
+    if (isDepthOnly)
+    {
+        const GLShaderVariant& variant = gObjectVariants[SHADER_FEATURE_DEPTH_ONLY | SHADER_FEATURE_DRAW_PARAMETERS];
+        if (UUseProgram(variant.programId))
+            ++gRenderStats.programSwitches;
+        glUniform1ui(variant.uniforms.drawOffset, 0);
+        ++gRenderStats.uniformUploads;
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, nullptr, static_cast<GLsizei>(draws.commands.size()), 0);
+        ++gRenderStats.drawCalls;
+        return;
+    }
+
+    for (const GLIndirectBatch& batch : draws.batches)
+    {
+        const GLShaderVariant& variant = gObjectVariants[batch.features];
+        if (UUseProgram(variant.programId))
+            ++gRenderStats.programSwitches;
+        glUniform1ui(variant.uniforms.drawOffset, batch.firstCommand);
+        ++gRenderStats.uniformUploads;
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT,
+            (void*)(batch.firstCommand * sizeof(DrawElementsIndirectCommand)), batch.commandCount, 0);
+        ++gRenderStats.drawCalls;
+    }
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(GLMesh& mesh)
+{
+    // Every part is packed into these before a single upload at the end
+    std::vector<GLfloat> arenaVertices;
+    std::vector<GLushort> arenaIndices;
+    UBuildMesh(mesh, arenaVertices, arenaIndices);
+    UUploadMesh(mesh, arenaVertices.data(), arenaVertices.size() * sizeof(GLfloat), arenaIndices.data(), arenaIndices.size() * sizeof(GLushort));
+}
+
+
+// Builds the built-in house's part table and geometry arena; no GL calls, so the exporter can run it without a context
+void UBuildMesh(GLMesh& mesh, std::vector<GLfloat>& arenaVertices, std::vector<GLushort>& arenaIndices)
+{
+    // Each UAddMeshPart call below suballocates the part it follows from the shared vertex and index buffers
+
+    // Position and Color data
+    GLfloat verts[] = {
+
+        //Square for Base (Garage Section)
+        // Vertex Positions    // Normals
+        //----------------------------------------------------------------------------------------
+        //Front Face          //Positive Z Normal   // Texture Coords
+         0.5f,  0.5f, 0.0f,   0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Top Right (Front) - Vertex 0
+         0.5f, -0.2f, 0.0f,   0.0f, 0.0f, 1.0f,    1.0f, 0.0f, // Bottom Right (Front) - Vertex 1
+        -0.5f, -0.2f, 0.0f,   0.0f, 0.0f, 1.0f,    0.0f, 0.0f, // Bottom Left (Front) - Vertex 2
+        -0.5f,  0.5f, 0.0f,   0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Top Left (Front) - Vertex 3
+
+         //Back Face          // Negative Z Normal  // Texture Coords
+         0.5f, -0.2f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 0.0f, // Bottom Right (Back) - Vertex 4
+         0.5f,  0.5f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 1.0f, // Top Right (Back) - Vertex 5
+        -0.5f,  0.5f, -0.6f,  0.0f, 0.0f, -1.0f,   1.0f, 0.0f, // Top Left (Back) - Vertex 6
+        -0.5f, -0.2f, -0.6f,  0.0f, 0.0f, -1.0f,   0.0f, 0.0f // Bottom Left (Back) - Vertex 7
+    };
+
+    // Index data to share position data
+    GLushort indices[] = {
+        0, 1, 3,  // Triangle 1
+        1, 2, 3,   // Triangle 2
+        0, 1, 4,  // Triangle 3
+        0, 4, 5,  // Triangle 4
+        0, 5, 6, // Triangle 5
+        0, 3, 6,  // Triangle 6
+        4, 5, 6, // Triangle 7
+        4, 6, 7, // Triangle 8
+        2, 3, 6, // Triangle 9
+        2, 6, 7, // Triangle 10
+        1, 4, 7, // Triangle 11
+        1, 2, 7 // Triangle 12
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Base", verts, sizeof(verts) / sizeof(verts[0]), indices, sizeof(indices) / sizeof(indices[0]), MATERIAL_HOUSE);
+
+    //=====================================================================================================================================================
+
+    GLfloat roof[] = {
+        //Pyramid for Base Roof (First Level Roof)
+         0.0f,  1.0f, -0.5f,   0.0f, 1.0f, 0.0f,    0.0f, 0.0f, // Top Center Point (Right) - Vertex 8 / 0
+        -1.49f,  1.0f, -0.5f,   0.0f, 1.0f, 0.0f,    1.0f, 0.0f, // Top Center Point (Left) - Vertex 9 / 1
+         0.6f, 0.5f, 0.1f,     0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Bottom Right (Front) - Vertex 10 / 2
+         0.6f, 0.5f, -0.7f,    0.0f, 0.0f, -1.0f,   1.0f, 1.0f, // Bottom Right (Back) - Vertex 11 / 3
+        -1.49f, 0.5f, 0.1f,     0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Bottom Left (Front) - Vertex 12 / 4
+        -1.49f, 0.5f, -0.7f,    0.0f, 0.0f, -1.0f,   0.0f, 0.0f // Bottom Left (Back) - Vertex 13 / 5
+    };
+
+    GLushort roofIndices[] = {
+        // Roof Triangles
+        //8, 10, 11, // Triangle 1   0, 2, 3
+        //11, 8, 10, // Triangle 2   3, 1, 2
+        //8, 12, 10, // Triangle 3   0, 4, 2
+        //12, 9, 13, // Triangle 4   4, 1, 5
+        //9, 13, 12, // Triangle 5   1, 5, 4
+        //9, 8, 12, // Trianlge 6    1, 0, 4
+        //9, 8, 13, // Triangle 7    1, 0, 5
+        //13, 11, 8, // Triangle 8   5, 3, 0
+        //11, 12, 13, // Triangle 9  3, 4, 5
+        //11, 10, 12,// Triangle 10  3, 2, 4
+        0, 2, 3,
+        3, 0, 2,
+        0, 4, 2,
+        4, 1, 5,
+        1, 5, 4,
+        1, 0, 4,
+        1, 0, 5,
+        5, 3, 0,
+        3, 4, 5,
+        3, 2, 4
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Roof", roof, sizeof(roof) / sizeof(roof[0]), roofIndices, sizeof(roofIndices) / sizeof(roofIndices[0]), MATERIAL_ROOF);
+
+    //=================================================================================================================================================================
+        // Grass 
+    GLfloat grass[] = {
+        //Plane for Ground
+        -2.0f, -0.2f, 2.0f,   0.0f, 1.0f, 0.0f,      0.0f, 0.0f, //Front (Left) - Vertex 14 / 0
+         1.5f, -0.2f, 2.0f,   0.0f, 1.0f, 0.0f,      1.0f, 0.0f, //Front (Right) - Vertex 15 / 1
+         1.5f, -0.2f, -2.0f,  0.0f, 1.0f, 0.0f,      1.0f, 1.0f, //Back (Right) - Vertex 16 / 2
+        -2.0f, -0.2f, -2.0f,  0.0f, 1.0f, 0.0f,      0.0f, 1.0f  //Back (Left) - Vertex 17 / 3
+    };
+
+    GLushort grassIndices[] = {
+        //Ground Plane
+        //14, 15, 16, // Triangle 1   1, 2, 3
+        //16, 14, 17, // Triangle 2   3, 1, 4
+        //17, 16, 14,  // Triangle 3   4, 3, 1
+        0, 1, 2,
+        2, 0, 3,
+        3, 2, 0
+
+
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Grass", grass, sizeof(grass) / sizeof(grass[0]), grassIndices, sizeof(grassIndices) / sizeof(grassIndices[0]), MATERIAL_GRASS);
+
+    //=============================================================================================================================================
+        //Driveway
+
+    GLfloat driveway[] = {
+        0.3f, -0.19f, 0.0f,        0.0f, 1.0f, 0.0f,       1.0f, 1.0f, // Back Right - 0
+       -0.3f, -0.19f, 0.0f,        0.0f, 1.0f, 0.0f,       0.0f, 1.0f, // Back Left - 1
+        0.3f, -0.19f, 2.0f,        0.0f, 1.0f, 0.0f,       1.0f, 0.0f, // Front Right - 2
+       -0.3f, -0.19f, 2.0f,        0.0f, 1.0f, 0.0f,       0.0f, 0.0f // Front Left - 3
+    };
+
+    GLushort drivewayIndices[] = {
+        0, 1, 3,
+        2, 0, 3,
+        3, 2, 0
+
+
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Driveway", driveway, sizeof(driveway) / sizeof(driveway[0]), drivewayIndices, sizeof(drivewayIndices) / sizeof(drivewayIndices[0]), MATERIAL_DRIVEWAY);
+
+    //================================================================================================================================================
+        //Second Base
+
+    GLfloat secondBase[] = {
+        // Front Face
+
+        -1.49f, 0.5f, -0.2f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left 
+        -1.49f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.5f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.5f, 0.5f, -0.2f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+
+        // Back Face
+
+        -1.49f, 0.5f, -0.6f,     0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Top Left
+        -1.49f, -0.2f, -0.6f,    0.0f, 0.0f, -1.0f,      0.0f, 0.0f, // Bottom Left
+        -0.5f, -0.2f, -0.6f,    0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
+        -0.5f, 0.5f, -0.6f,     0.0f, 0.0f, -1.0f,      1.0f, 1.0f  // Top Right
+    };
+
+    GLushort secondBaseIndices[] = {
+        0, 1, 3,  // Triangle 1
+        1, 2, 3,   // Triangle 2
+        0, 1, 4,  // Triangle 3
+        0, 4, 5,  // Triangle 4
+        0, 5, 6, // Triangle 5
+        0, 3, 6,  // Triangle 6
+        4, 5, 6, // Triangle 7
+        4, 6, 7, // Triangle 8
+        2, 3, 6, // Triangle 9
+        2, 6, 7, // Triangle 10
+        1, 4, 7, // Triangle 11
+        1, 2, 7, // Triangle 12
+        4, 5, 1
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Second Base", secondBase, sizeof(secondBase) / sizeof(secondBase[0]), secondBaseIndices, sizeof(secondBaseIndices) / sizeof(secondBaseIndices[0]), MATERIAL_HOUSE);
+
+    //===============================================================================================================================================
+        // Top House
+
+    GLfloat topHouse[] = {
+        //Front Face
+        -1.5f, 1.3f, -0.21f,        0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+        -1.5f, -0.2f, -0.21f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        0.0f, -0.2f, -0.21f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        0.0f, 1.3f, -0.21f,         0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+
+        //Back Face
+        -1.5f, 1.3f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Top Left
+        -1.5f, -0.2f, -1.0f,        0.0f, 0.0f, -1.0f,      0.0f, 0.0f, // Bottom Left
+        0.0f, -0.2f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
+        0.0f, 1.3f, -1.0f,         0.0f, 0.0f, -1.0f,      1.0f, 1.0f  // Top Right
+    };
+
+    GLushort tophouseIndices[] = {
+        0, 1, 2,
+        2, 0, 3,
+        3, 2, 6,
+        6, 3, 7,
+        7, 6, 5,
+        5, 7, 4,
+        4, 5, 1,
+        1, 0, 5,
+        5, 4, 0,
+        0, 7, 4,
+        3, 7, 0
+
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Top House", topHouse, sizeof(topHouse) / sizeof(topHouse[0]), tophouseIndices, sizeof(tophouseIndices) / sizeof(tophouseIndices[0]), MATERIAL_TOP_HOUSE);
+
+    //===========================================================================================================================================
+        // Right House (Moms Room)
+    GLfloat rightHouse[] = {
+        -0.01f, 1.3f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -0.01f, 0.7f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.51f, 0.7f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.51f, 1.3f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+        -0.26f, 1.5f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Point
+
+        // Back
+        -0.01f, 1.3f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Top Right
+        -0.01f, 0.7f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.51f, 0.7f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.51f, 1.3f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Top Left
+        -0.26f, 1.5f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Point
+    };
+
+    GLushort righthouseIndices[] = {
+        0, 1, 2,
+        2, 0, 3,
+        3, 2, 7,
+        7, 3, 8,
+        8, 7, 6,
+        6, 8, 5,
+        5, 6, 1,
+        1, 5, 0,
+        0, 4, 3,
+        3, 4, 8,
+        8, 9, 4,
+        4, 5, 9,
+        5, 4, 0,
+        3, 0, 4,
+        8, 9, 5,
+        5, 8, 9
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Right House", rightHouse, sizeof(rightHouse) / sizeof(rightHouse[0]), righthouseIndices, sizeof(righthouseIndices) / sizeof(righthouseIndices[0]), MATERIAL_RIGHT_LEFT_HOUSE);
+
+    //=============================================================================================================================================
+        //Left House (Dads Room)
+
+    GLfloat leftHouse[] = {
+        -1.49f, 1.3f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -1.49f, 0.7f, -0.15f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.99f, 0.7f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.99f, 1.3f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+        -1.24f, 1.5f, -0.15f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Point
+
+        // Back
+        -1.49f, 1.3f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Top Right
+        -1.49f, 0.7f, -0.5f,         0.0f, 0.0f, -1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.99f, 0.7f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.99f, 1.3f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Top Left
+        -1.24f, 1.5f, -0.5f,        0.0f, 0.0f, -1.0f,       0.0f, 1.0f, // Point
+    };
+
+    GLushort lefthouseIndices[] = {
+        0, 1, 2,
+        2, 0, 3,
+        3, 2, 7,
+        7, 3, 8,
+        8, 7, 6,
+        6, 8, 5,
+        5, 6, 1,
+        1, 5, 0,
+        0, 4, 3,
+        3, 4, 8,
+        8, 9, 4,
+        4, 5, 9,
+        5, 4, 0,
+        3, 0, 4,
+        8, 9, 5,
+        5, 8, 9
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Left House", leftHouse, sizeof(leftHouse) / sizeof(leftHouse[0]), lefthouseIndices, sizeof(lefthouseIndices) / sizeof(lefthouseIndices[0]), MATERIAL_RIGHT_LEFT_HOUSE);
+
+    //=========================================================================================================================================
+        // Top Roof
+
+    GLfloat topRoof[] = {
+
+        // Right
+        0.01f, 1.31f, -0.13f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        0.01f, 1.31f, -1.01f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Back Right
+        -0.26f, 1.51f, -0.15f,       0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
+        -0.53f, 1.31f, -0.13f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+        -0.53f, 1.31f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top Left (Cut in Front)
+        -0.26f, 1.51f, -0.5f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
+
+        // Left
+        -1.51f, 1.31f, -0.13f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Left
+        -1.51f, 1.31f, -1.01f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Back Left
+        -1.24f, 1.51f, -0.13f,       0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Point
+        -0.97f, 1.31f, -0.13f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Right
+        -0.97f, 1.31f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Right (Cut in Front)
+        -1.24f, 1.51f, -0.5f,        0.0f, 0.0f, -1.0f,       1.0f, 1.0f, // Point
+    };
+
+    GLushort topRoofIndices[] = {
+        0,1,2,
+        0,2,5,
+        2,5,1,
+        5,4,2,
+        4,3,2,
+        1,7,5,
+        7,11,5,
+        11,10,5,
+        10,4,5,
+        10,9,8,
+        8,10,11,
+        11,8,7,
+        7,6,8
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Top Roof", topRoof, sizeof(topRoof) / sizeof(topRoof[0]), topRoofIndices, sizeof(topRoofIndices) / sizeof(topRoofIndices[0]), MATERIAL_ROOF);
+
+    //==========================================================================================================================================
+        // Top Windows
+
+    GLfloat topWindows[] = {
+        // Right Window
+        -0.04f, 1.2f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -0.04f, 0.9f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.48f, 0.9f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.48f, 1.2f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+
+        //Left Window
+        -1.46f, 1.2f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -1.46f, 0.9f, -0.14f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -1.02f, 0.9f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -1.02f, 1.2f, -0.14f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+    };
+
+    GLushort topWindowIndices[] = {
+        0,1,2,
+        2,0,3,
+        3,2,1,
+
+        4,5,6,
+        6,4,7,
+        7,6,5
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Top Windows", topWindows, sizeof(topWindows) / sizeof(topWindows[0]), topWindowIndices, sizeof(topWindowIndices) / sizeof(topWindowIndices[0]), MATERIAL_TOP_WINDOW);
+
+    //============================================================================================================================================
+        //Front Step
+
+    GLfloat frontStep[] = {
+        // Front Face
+        -0.5f, -0.2f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right - Front Step
+        -0.5f, -0.1f, 0.0f,      0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right - Front Step
+        -1.5f, -0.1f, 0.0f,      0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top Left - Front Step
+        -1.5f, -0.2f, 0.0f,      0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Bottom Left - Front Step
+
+        // Back Face
+        -0.5f, -0.2f, -0.2f,     0.0f, 0.0f, -1.0f,      1.0f, 0.0f, // Bottom Right
+        -0.5f, -0.1f, -0.2f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -1.5f, -0.1f, -0.2f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Top left
+        -1.5f, -0.2f, -0.2f,    0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Bottom Left - Front Step
+
+        // Side Walk
+        -0.9f, -0.19f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f,
+        -0.7f, -0.19f, 0.0f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f,
+        -0.9f, -0.19f, 0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,
+        -0.7f, -0.19f, 0.1f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,
+        -0.3f, -0.19f, 0.1f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,
+        -0.3f, -0.19f, 0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f
+    };
+
+    GLushort frontStepIndices[] = {
+        0,1,2,
+        2,0,3,
+        3,2,7,
+        7,6,2,
+        2,3,7,
+        7,4,0,
+        1,5,6,
+        6,1,2,
+        2,6,5,
+
+        8,9,10,
+        10,11,9,
+        9,8,10,
+        10,13,11,
+        11,12,13
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Front Step", frontStep, sizeof(frontStep) / sizeof(frontStep[0]), frontStepIndices, sizeof(frontStepIndices) / sizeof(frontStepIndices[0]), MATERIAL_WALKWAY);
+
+    //====================================================================================================================================================
+        //Front Door
+
+    GLfloat frontDoor[] = {
+        -0.9f, -0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -0.9f, 0.35f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -0.7f, 0.35f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -0.7f, -0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+    };
+
+    GLushort frontDoorIndices[] = {
+        0,1,2,
+        2,0,3,
+        3,2,1
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Front Door", frontDoor, sizeof(frontDoor) / sizeof(frontDoor[0]), frontDoorIndices, sizeof(frontDoorIndices) / sizeof(frontDoorIndices[0]), MATERIAL_FRONT_DOOR);
+
+    //=====================================================================================================================================
+        //Garage
+
+    GLfloat garage[] = {
+        0.3f,  0.4f, 0.01f,   0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Top Right (Front) - Vertex 0
+         0.3f, -0.2f, 0.01f,   0.0f, 0.0f, 1.0f,    1.0f, 0.0f, // Bottom Right (Front) - Vertex 1
+        -0.3f, -0.2f, 0.01f,   0.0f, 0.0f, 1.0f,    0.0f, 0.0f, // Bottom Left (Front) - Vertex 2
+        -0.3f,  0.4f, 0.01f,   0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Top Left (Front) - Vertex 3
+    };
+
+    GLushort garageIndices[] = {
+        0,1,2,
+        2,0,3,
+        3,2,1
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Garage", garage, sizeof(garage) / sizeof(garage[0]), garageIndices, sizeof(garageIndices) / sizeof(garageIndices[0]), MATERIAL_GARAGE);
+
+//=========================================================================================================================================
+    // Office Window
+
+    GLfloat frontWindow[] = {
+        // Right Window
+        -1.05f, 0.4f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -1.05f, 0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -1.2f, 0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -1.2f, 0.4f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+
+        //Left Window
+        -1.3f, 0.4f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
+        -1.3f, 0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
+        -1.45f, 0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
+        -1.45f, 0.4f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+    };
+
+    GLushort frontWindowIndices[] = {
+        0,1,2,
+        2,0,3,
+        3,2,1,
+
+        4,5,6,
+        6,4,7,
+        7,6,5
+    };
+
+    UAddMeshPart(mesh, arenaVertices, arenaIndices, "Office Windows", frontWindow, sizeof(frontWindow) / sizeof(frontWindow[0]), frontWindowIndices, sizeof(frontWindowIndices) / sizeof(frontWindowIndices[0]), MATERIAL_FRONT_WINDOW);
+
+//==========================================================================================================================================
+    // Fence
+
+    //GLfloat fence[] = {
+    //    0.5f, -0.2f, -0.3f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, //0
+    //    0.5f, 0.3f, -0.3f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f, //1
+    //    1.5f, 0.3f, -0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f, //2
+    //    1.5f, -0.2f, -0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,//3
+    //    1.5f, -0.2f, -2.0f,     0.0f, 0.0f, -1.0f,       1.0f, 1.0f,//4
+    //    1.5f, 0.3f, -2.0f,     0.0f, 0.0f, -1.0f,       1.0f, 0.0f,//5
+    //    -2.0f, -0.2f, -2.0f,     0.0f, 0.0f, -1.0f,       0.0f, 0.0f,//6
+    //    -2.0f, 0.3f, -0.3f,     0.0f, 0.0f, -1.0f,       0.0f, 1.0f,//7
+    //    -2.0f, -0.2f, -0.5f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f,//8
+    //    -2.0f, 0.3f, -0.5f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f,//9
+    //    -1.5f, -0.2f, -0.5f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,//10
+    //    -1.5f, 0.3f, -0.5f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,//11
+    //};
+
+    //GLushort fenceIndices[] = {
+    //    0,1,3,
+    //    0,3,2,
+    //    1,2,3,
+    //    3,4,2,
+    //    2,5,4,
+    //    4,6,5,
+    //    6,7,5,
+    //    6,8,7,
+    //    8,9,7,
+    //    8,10,11,
+    //    11,8,9,
+    //    9,11,10
+    //};
+
+    //UAddMeshPart(mesh, arenaVertices, arenaIndices, "Fence", fence, sizeof(fence) / sizeof(fence[0]), fenceIndices, sizeof(fenceIndices) / sizeof(fenceIndices[0]), MATERIAL_FENCE);
+
+    // The lamp reuses the base cube geometry
+    mesh.lampPart = 0;
+}
+
+
+// Creates the mesh's VAO and uploads the shared vertex and index buffers from any memory, a mapped file included
+void UUploadMesh(GLMesh& mesh, const void* vertices, size_t vertexBytes, const void* indices, size_t indexBytes)
+{
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
+
+    // Strides between vertex coordinates is 8 (x, y, z, nx, ny, nz, u, v). A tightly packed stride is 0.
+    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+
+    glGenVertexArrays(1, &mesh.vao); // One VAO serves every part of the house
+    UBindVertexArray(mesh.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(2, mesh.vbos);
+    UBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+
+    UBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, indices, GL_STATIC_DRAW);
+
+    // Create Vertex Attribute Pointers
+    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
     glEnableVertexAttribArray(2);
 
-    //====================================================================================================================================================
-        //Front Door
+    UBindVertexArray(0);
+}
+
+
+// Writes the built-in house, detail levels included, to a binary mesh file
+bool UExportMesh(const char* path)
+{
+    GLMesh mesh;
+    std::vector<GLfloat> arenaVertices;
+    std::vector<GLushort> arenaIndices;
+    UBuildMesh(mesh, arenaVertices, arenaIndices);
+
+    auto align = [](uint64_t offset) { return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT; };
+
+    MeshFileHeader header = {};
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    header.headerSize = sizeof(MeshFileHeader);
+    header.vertexStride = FLOATS_PER_VERTEX * sizeof(GLfloat);
+    header.indexSize = sizeof(GLushort);
+    header.partCount = static_cast<uint32_t>(mesh.parts.size());
+    header.lampPart = mesh.lampPart;
+    header.vertexOffset = align(sizeof(MeshFileHeader));
+    header.vertexBytes = arenaVertices.size() * sizeof(GLfloat);
+    header.indexOffset = align(header.vertexOffset + header.vertexBytes);
+    header.indexBytes = arenaIndices.size() * sizeof(GLushort);
+    header.partOffset = align(header.indexOffset + header.indexBytes);
+    memcpy(header.boundsMin, glm::value_ptr(mesh.bounds.min), sizeof(header.boundsMin));
+    memcpy(header.boundsMax, glm::value_ptr(mesh.bounds.max), sizeof(header.boundsMax));
+
+    std::vector<MeshFilePart> parts(mesh.parts.size());
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        const GLMeshPart& part = mesh.parts[i];
+        MeshFilePart& row = parts[i];
+        memset(&row, 0, sizeof(row));
+        memcpy(row.name, part.name.c_str(), std::min(part.name.size(), MESH_PART_NAME_LENGTH - 1));
+        row.baseVertex = part.baseVertex;
+        row.firstIndex = part.firstIndex;
+        row.indexCount = part.indexCount;
+        row.material = part.material;
+        memcpy(row.boundsMin, glm::value_ptr(part.bounds.min), sizeof(row.boundsMin));
+        memcpy(row.boundsMax, glm::value_ptr(part.bounds.max), sizeof(row.boundsMax));
+        row.lodCount = part.lodCount;
+        for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+        {
+            row.lodFirstIndex[level] = part.lodFirstIndex[level];
+            row.lodIndexCount[level] = part.lodIndexCount[level];
+        }
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    auto writeAt = [&file](uint64_t offset, const void* data, size_t bytes) {
+        // Zero padding up to the aligned offset
+        static const char padding[MESH_FILE_ALIGNMENT] = {};
+        file.write(padding, static_cast<std::streamsize>(offset - static_cast<uint64_t>(file.tellp())));
+        file.write(static_cast<const char*>(data), bytes);
+    };
+    writeAt(0, &header, sizeof(header));
+    writeAt(header.vertexOffset, arenaVertices.data(), static_cast<size_t>(header.vertexBytes));
+    writeAt(header.indexOffset, arenaIndices.data(), static_cast<size_t>(header.indexBytes));
+    writeAt(header.partOffset, parts.data(), parts.size() * sizeof(MeshFilePart));
+
+    if (!file)
+    {
+        cout << "Failed to write mesh file " << path << endl;
+        return false;
+    }
+
+    cout << "Wrote " << header.partCount << " parts, " << arenaVertices.size() / FLOATS_PER_VERTEX << " vertices and "
+        << arenaIndices.size() << " indices to " << path << endl;
+    return true;
+}
+
+
+// Maps a mesh file, checks its header and part table against the streams, and uploads the streams
+// straight from the mapping
+bool ULoadMesh(const char* path, GLMesh& mesh)
+{
+    MappedFile file;
+    if (!UMapFile(path, file))
+    {
+        cout << "Failed to open mesh file " << path << endl;
+        return false;
+    }
+
+    MeshFileHeader header;
+    bool isValid = file.size >= sizeof(header);
+    if (isValid)
+    {
+        memcpy(&header, file.data, sizeof(header));
+        uint64_t partBytes = static_cast<uint64_t>(header.partCount) * sizeof(MeshFilePart);
+        isValid = memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) == 0
+            && header.version == MESH_FILE_VERSION && header.headerSize == sizeof(MeshFileHeader)
+            && header.vertexStride == FLOATS_PER_VERTEX * sizeof(GLfloat) && header.indexSize == sizeof(GLushort)
+            && header.partCount > 0 && header.lampPart < header.partCount
+            && header.vertexOffset % MESH_FILE_ALIGNMENT == 0 && header.indexOffset % MESH_FILE_ALIGNMENT == 0
+            && header.partOffset % MESH_FILE_ALIGNMENT == 0
+            && header.vertexOffset <= file.size && header.vertexBytes <= file.size - header.vertexOffset
+            && header.indexOffset <= file.size && header.indexBytes <= file.size - header.indexOffset
+            && header.partOffset <= file.size && partBytes <= file.size - header.partOffset;
+    }
+
+    const uint64_t vertexCount = isValid ? header.vertexBytes / header.vertexStride : 0;
+    const uint64_t indexCount = isValid ? header.indexBytes / header.indexSize : 0;
+    const MeshFilePart* rows = isValid ? reinterpret_cast<const MeshFilePart*>(file.data + header.partOffset) : nullptr;
+    const GLushort* indices = isValid ? reinterpret_cast<const GLushort*>(file.data + header.indexOffset) : nullptr;
+
+    mesh.parts.clear();
+    for (uint32_t i = 0; isValid && i < header.partCount; ++i)
+    {
+        const MeshFilePart& row = rows[i];
+        isValid = row.baseVertex >= 0 && static_cast<uint64_t>(row.baseVertex) < vertexCount
+            && row.material < MATERIAL_COUNT && row.lodCount >= 1 && row.lodCount <= MAX_LOD_LEVELS
+            && UMeshRangeIsValid(indices, indexCount, vertexCount, row.baseVertex, row.firstIndex, row.indexCount);
+        for (uint32_t level = 0; isValid && level < row.lodCount; ++level)
+            isValid = UMeshRangeIsValid(indices, indexCount, vertexCount, row.baseVertex,
+                row.lodFirstIndex[level], row.lodIndexCount[level]);
+        if (!isValid)
+            break;
+
+        GLMeshPart part;
+        part.name.assign(row.name, strnlen(row.name, MESH_PART_NAME_LENGTH));
+        part.baseVertex = row.baseVertex;
+        part.firstIndex = row.firstIndex;
+        part.indexCount = row.indexCount;
+        part.material = row.material;
+        part.bounds.min = glm::make_vec3(row.boundsMin);
+        part.bounds.max = glm::make_vec3(row.boundsMax);
+        part.lodCount = row.lodCount;
+        for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+        {
+            part.lodFirstIndex[level] = row.lodFirstIndex[level];
+            part.lodIndexCount[level] = row.lodIndexCount[level];
+        }
+        mesh.parts.push_back(part);
+    }
+
+    if (!isValid)
+    {
+        cout << "Mesh file " << path << " is not a version " << MESH_FILE_VERSION << " mesh or is damaged" << endl;
+        mesh.parts.clear();
+        UUnmapFile(file);
+        return false;
+    }
+
+    mesh.lampPart = header.lampPart;
+    mesh.bounds.min = glm::make_vec3(header.boundsMin);
+    mesh.bounds.max = glm::make_vec3(header.boundsMax);
+    UUploadMesh(mesh, file.data + header.vertexOffset, static_cast<size_t>(header.vertexBytes),
+        file.data + header.indexOffset, static_cast<size_t>(header.indexBytes));
+
+    // glBufferData has copied the streams, so the mapping can go
+    UUnmapFile(file);
+    return true;
+}
+
+
+// Checks that an index range lies inside the index stream and that every index it holds, offset by
+// the part's base vertex, names a vertex in the vertex stream
+bool UMeshRangeIsValid(const GLushort* indices, uint64_t indexCount, uint64_t vertexCount,
+    int32_t baseVertex, uint64_t firstIndex, int64_t count)
+{
+    if (count < 0 || firstIndex > indexCount || static_cast<uint64_t>(count) > indexCount - firstIndex)
+        return false;
+
+    for (uint64_t i = firstIndex; i < firstIndex + static_cast<uint64_t>(count); ++i)
+    {
+        if (static_cast<uint64_t>(baseVertex) + indices[i] >= vertexCount)
+            return false;
+    }
+    return true;
+}
+
+
+// Maps a whole file read-only
+bool UMapFile(const char* path, MappedFile& file)
+{
+    file.data = nullptr;
+    file.size = 0;
+
+#ifdef _WIN32
+    file.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file.file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file.file);
+        return false;
+    }
+    file.size = static_cast<size_t>(size.QuadPart);
+
+    file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file.mapping)
+        file.data = static_cast<const unsigned char*>(MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!file.data)
+    {
+        if (file.mapping)
+            CloseHandle(file.mapping);
+        CloseHandle(file.file);
+        return false;
+    }
+#else
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || status.st_size == 0)
+    {
+        close(descriptor);
+        return false;
+    }
+    file.size = static_cast<size_t>(status.st_size);
+
+    void* mapping = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor); // The mapping keeps the file open
+    if (mapping == MAP_FAILED)
+        return false;
+
+    // The upload reads the file front to back once
+    madvise(mapping, file.size, MADV_SEQUENTIAL);
+    madvise(mapping, file.size, MADV_WILLNEED);
+    file.data = static_cast<const unsigned char*>(mapping);
+#endif
+
+    return true;
+}
+
+
+void UUnmapFile(MappedFile& file)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+    CloseHandle(file.mapping);
+    CloseHandle(file.file);
+#else
+    munmap(const_cast<unsigned char*>(file.data), file.size);
+#endif
+    file.data = nullptr;
+    file.size = 0;
+}
+
+
+// Appends one part to the shared geometry arena and records its row in the mesh's part table
+void UAddMeshPart(GLMesh& mesh, std::vector<GLfloat>& arenaVertices, std::vector<GLushort>& arenaIndices, const char* name,
+    const GLfloat* verts, size_t nFloats, const GLushort* indices, size_t nIndices, GLuint material)
+{
+    GLMeshPart part;
+    part.name = name;
+    part.baseVertex = static_cast<GLint>(arenaVertices.size() / FLOATS_PER_VERTEX); // Part indices stay local, the draw adds this offset
+    part.firstIndex = static_cast<GLuint>(arenaIndices.size());
+    part.indexCount = static_cast<GLsizei>(nIndices);
+    part.material = material;
+
+    part.bounds.min = glm::vec3(verts[0], verts[1], verts[2]);
+    part.bounds.max = part.bounds.min;
+    for (size_t i = FLOATS_PER_VERTEX; i < nFloats; i += FLOATS_PER_VERTEX)
+    {
+        glm::vec3 position(verts[i], verts[i + 1], verts[i + 2]);
+        part.bounds.min = glm::min(part.bounds.min, position);
+        part.bounds.max = glm::max(part.bounds.max, position);
+    }
+
+    if (mesh.parts.empty())
+        mesh.bounds = part.bounds;
+    mesh.bounds.min = glm::min(mesh.bounds.min, part.bounds.min);
+    mesh.bounds.max = glm::max(mesh.bounds.max, part.bounds.max);
+
+    arenaVertices.insert(arenaVertices.end(), verts, verts + nFloats);
+    arenaIndices.insert(arenaIndices.end(), indices, indices + nIndices);
+
+    // Reduced levels follow the full index list in the arena
+    UGenerateLods(part, verts, nFloats, arenaIndices);
+    mesh.parts.push_back(part);
+}
+
+
+// Appends up to MAX_LOD_LEVELS - 1 simplified index lists for the part last added to the arena.
+// Each level halves the one before it and stops once simplification no longer pays off or would leave nothing.
+void UGenerateLods(GLMeshPart& part, const GLfloat* verts, size_t nFloats, std::vector<GLushort>& arenaIndices)
+{
+    part.lodCount = 1;
+    part.lodFirstIndex[0] = part.firstIndex;
+    part.lodIndexCount[0] = part.indexCount;
+
+    std::vector<GLushort> level(arenaIndices.begin() + part.firstIndex, arenaIndices.begin() + part.firstIndex + part.indexCount);
+    while (part.lodCount < MAX_LOD_LEVELS)
+    {
+        size_t triangles = level.size() / 3;
+        std::vector<GLushort> reduced = USimplifyMesh(verts, nFloats / FLOATS_PER_VERTEX, level,
+            static_cast<size_t>(std::ceil(triangles * LOD_REDUCTION)));
+        if (reduced.empty() || reduced.size() / 3 > triangles * (1.0f - LOD_MIN_GAIN))
+            break;
+
+        part.lodFirstIndex[part.lodCount] = static_cast<GLuint>(arenaIndices.size());
+        part.lodIndexCount[part.lodCount] = static_cast<GLsizei>(reduced.size());
+        ++part.lodCount;
+        arenaIndices.insert(arenaIndices.end(), reduced.begin(), reduced.end());
+        level.swap(reduced);
+    }
+}
+
+
+// Reduces a triangle list to at most targetTriangles by quadric-error half-edge collapses (Garland-Heckbert).
+// A collapse folds one vertex into a neighbor, so vertices are never moved or created and the result keeps
+// indexing the original vertex buffer, normals and UVs included. A UV or normal seam splits a position into
+// wedges, one vertex per side; a seam vertex only slides along the seam, and all of its wedges fold together
+// onto the wedges of the neighbor, so the sides never come apart. Seam and open boundary edges add a plane
+// quadric standing on the edge, so bending the outline costs as much as bending the surface. Collapses across
+// a crease or that would flip a triangle are rejected.
+std::vector<GLushort> USimplifyMesh(const GLfloat* verts, size_t vertexCount, const std::vector<GLushort>& indices, size_t targetTriangles)
+{
+    auto position = [verts](size_t vertex) {
+        const GLfloat* v = verts + vertex * FLOATS_PER_VERTEX;
+        return glm::vec3(v[0], v[1], v[2]);
+    };
+    auto normal = [verts](size_t vertex) {
+        const GLfloat* v = verts + vertex * FLOATS_PER_VERTEX + 3;
+        return glm::vec3(v[0], v[1], v[2]);
+    };
+
+    // Collapsing across more than this angle between vertex normals would smear a crease
+    const float creaseCosine = 0.7071f;
+    // Weight of a seam or boundary edge's quadric relative to the area-weighted surface quadrics
+    const float borderWeight = 10.0f;
+    const GLuint noVertex = ~0u;
+
+    std::vector<GLushort> triangles(indices);
+    size_t triangleCount = triangles.size() / 3;
+    size_t liveTriangles = triangleCount;
+    std::vector<char> isTriangleRemoved(triangleCount, 0);
+    std::vector<std::vector<GLuint>> vertexTriangles(vertexCount);
+    for (GLuint triangle = 0; triangle < triangleCount; ++triangle)
+        for (int corner = 0; corner < 3; ++corner)
+            vertexTriangles[triangles[triangle * 3 + corner]].push_back(triangle);
+
+    // Live triangles around a that also use b; one means a-b is on a seam or an open boundary
+    auto sharedTriangles = [&](GLuint a, GLuint b) {
+        int shared = 0;
+        for (GLuint triangle : vertexTriangles[a])
+        {
+            const GLushort* corners = &triangles[triangle * 3];
+            if (!isTriangleRemoved[triangle] && (corners[0] == b || corners[1] == b || corners[2] == b))
+                ++shared;
+        }
+        return shared;
+    };
+    auto isBorderVertex = [&](GLuint vertex) {
+        for (GLuint triangle : vertexTriangles[vertex])
+        {
+            if (isTriangleRemoved[triangle])
+                continue;
+            for (int corner = 0; corner < 3; ++corner)
+            {
+                GLuint other = triangles[triangle * 3 + corner];
+                if (other != vertex && sharedTriangles(vertex, other) == 1)
+                    return true;
+            }
+        }
+        return false;
+    };
+
+    // Wedges: the vertices a seam splits one position into, linked in a ring per position
+    std::vector<GLuint> nextWedge(vertexCount);
+    std::vector<GLuint> byPosition;
+    for (GLuint vertex = 0; vertex < vertexCount; ++vertex)
+    {
+        nextWedge[vertex] = vertex;
+        if (!vertexTriangles[vertex].empty())
+            byPosition.push_back(vertex);
+    }
+    auto positionLess = [&position](GLuint a, GLuint b) {
+        glm::vec3 pa = position(a), pb = position(b);
+        return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+    };
+    std::sort(byPosition.begin(), byPosition.end(), positionLess);
+    for (size_t i = 1; i < byPosition.size(); ++i)
+    {
+        if (position(byPosition[i]) == position(byPosition[i - 1]))
+        {
+            nextWedge[byPosition[i]] = nextWedge[byPosition[i - 1]];
+            nextWedge[byPosition[i - 1]] = byPosition[i];
+        }
+    }
+
+    // Area-weighted plane quadrics of the triangles around each vertex, plus a plane standing on each seam
+    // or boundary edge that keeps its ends on the outline
+    std::vector<Quadric> quadrics(vertexCount, Quadric());
+    for (size_t i = 0; i < triangles.size(); i += 3)
+    {
+        glm::vec3 p0 = position(triangles[i]), p1 = position(triangles[i + 1]), p2 = position(triangles[i + 2]);
+        glm::vec3 planeNormal = glm::cross(p1 - p0, p2 - p0);
+        float doubleArea = glm::length(planeNormal);
+        if (doubleArea <= 0.0f)
+            continue;
+        planeNormal = planeNormal / doubleArea;
+        for (int corner = 0; corner < 3; ++corner)
+            UAddPlaneQuadric(quadrics[triangles[i + corner]], planeNormal, -glm::dot(planeNormal, p0), doubleArea * 0.5f);
+
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            GLuint a = triangles[i + corner];
+            GLuint b = triangles[i + (corner + 1) % 3];
+            if (sharedTriangles(a, b) != 1)
+                continue;
+            glm::vec3 edge = position(b) - position(a);
+            glm::vec3 edgeNormal = glm::cross(edge, planeNormal);
+            float edgeLength = glm::length(edgeNormal);
+            if (edgeLength <= 0.0f)
+                continue;
+            edgeNormal = edgeNormal / edgeLength;
+            float distance = -glm::dot(edgeNormal, position(a));
+            UAddPlaneQuadric(quadrics[a], edgeNormal, distance, borderWeight * edgeLength * edgeLength);
+            UAddPlaneQuadric(quadrics[b], edgeNormal, distance, borderWeight * edgeLength * edgeLength);
+        }
+    }
+
+    // The vertex folding from into to moves with it: from's other wedges go to the wedges of to across a
+    // seam edge from them. False if the collapse would tear a seam or leave the outline.
+    std::vector<std::pair<GLuint, GLuint>> moves;
+    auto pairWedges = [&](GLuint from, GLuint to) {
+        moves.assign(1, std::make_pair(from, to));
+        if (!isBorderVertex(from))
+            return nextWedge[from] == from;
+        if (sharedTriangles(from, to) != 1)
+            return false;
+        for (GLuint wedge = nextWedge[from]; wedge != from; wedge = nextWedge[wedge])
+        {
+            // A wedge whose triangles have all collapsed away has nothing left to tear
+            if (std::all_of(vertexTriangles[wedge].begin(), vertexTriangles[wedge].end(),
+                    [&isTriangleRemoved](GLuint triangle) { return isTriangleRemoved[triangle] != 0; }))
+                continue;
+            GLuint partner = noVertex;
+            GLuint candidate = to;
+            do
+            {
+                if (sharedTriangles(wedge, candidate) == 1)
+                    partner = candidate;
+                candidate = nextWedge[candidate];
+            } while (candidate != to && partner == noVertex);
+            if (partner == noVertex)
+                return false;
+            moves.push_back(std::make_pair(wedge, partner));
+        }
+        return true;
+    };
+
+    // Candidate collapses, cheapest first; a candidate is stale once either end has changed since it was queued
+    struct Collapse
+    {
+        double cost;
+        GLuint from;
+        GLuint to;
+        GLuint fromVersion;
+        GLuint toVersion;
+        bool operator<(const Collapse& other) const { return cost > other.cost; }
+    };
+    std::priority_queue<Collapse> candidates;
+    std::vector<GLuint> versions(vertexCount, 0);
+    std::vector<char> isVertexRemoved(vertexCount, 0);
+
+    auto queueCollapse = [&](GLuint from, GLuint to) {
+        if (!pairWedges(from, to))
+            return;
+        double cost = 0.0;
+        for (const auto& move : moves)
+        {
+            if (glm::dot(normal(move.first), normal(move.second)) < creaseCosine)
+                return;
+            Quadric combined = quadrics[move.first];
+            for (int i = 0; i < 10; ++i)
+                combined.m[i] += quadrics[move.second].m[i];
+            cost += UQuadricError(combined, position(move.second));
+        }
+        candidates.push({ cost, from, to, versions[from], versions[to] });
+    };
+
+    for (size_t i = 0; i < triangles.size(); i += 3)
+    {
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            GLuint a = triangles[i + corner];
+            GLuint b = triangles[i + (corner + 1) % 3];
+            queueCollapse(a, b);
+            queueCollapse(b, a);
+        }
+    }
+
+    while (liveTriangles > targetTriangles && !candidates.empty())
+    {
+        Collapse collapse = candidates.top();
+        candidates.pop();
+        if (isVertexRemoved[collapse.from] || isVertexRemoved[collapse.to]
+            || versions[collapse.from] != collapse.fromVersion || versions[collapse.to] != collapse.toVersion
+            || !pairWedges(collapse.from, collapse.to))
+            continue;
+
+        // The surviving triangles around each moving wedge must keep facing the same way once it lands
+        bool isValid = true;
+        for (size_t m = 0; m < moves.size() && isValid; ++m)
+        {
+            GLuint from = moves[m].first;
+            GLuint to = moves[m].second;
+            bool isAdjacent = false;
+            glm::vec3 target = position(to);
+            for (GLuint triangle : vertexTriangles[from])
+            {
+                if (isTriangleRemoved[triangle])
+                    continue;
+                GLushort* corners = &triangles[triangle * 3];
+                if (corners[0] == to || corners[1] == to || corners[2] == to)
+                {
+                    isAdjacent = true;
+                    continue;
+                }
+
+                glm::vec3 before[3], after[3];
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    before[corner] = position(corners[corner]);
+                    after[corner] = corners[corner] == from ? target : before[corner];
+                }
+                glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+                glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+                if (glm::dot(normalBefore, normalAfter) <= 0.0f)
+                {
+                    isValid = false;
+                    break;
+                }
+            }
+            isValid = isValid && isAdjacent;
+        }
+        if (!isValid)
+            continue;
+
+        // Fold each wedge into its partner: shared triangles degenerate and go, the rest are rewired
+        for (const auto& move : moves)
+        {
+            GLuint from = move.first;
+            GLuint to = move.second;
+            for (GLuint triangle : vertexTriangles[from])
+            {
+                if (isTriangleRemoved[triangle])
+                    continue;
+                GLushort* corners = &triangles[triangle * 3];
+                if (corners[0] == to || corners[1] == to || corners[2] == to)
+                {
+                    isTriangleRemoved[triangle] = 1;
+                    --liveTriangles;
+                    continue;
+                }
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    if (corners[corner] == from)
+                        corners[corner] = static_cast<GLushort>(to);
+                }
+                vertexTriangles[to].push_back(triangle);
+            }
+            isVertexRemoved[from] = 1;
+            for (int i = 0; i < 10; ++i)
+                quadrics[to].m[i] += quadrics[from].m[i];
+            ++versions[to];
+        }
+
+        // Costs of the collapses into and out of the merged vertices changed
+        std::vector<std::pair<GLuint, GLuint>> landed(moves);
+        for (const auto& move : landed)
+        {
+            GLuint to = move.second;
+            for (GLuint triangle : vertexTriangles[to])
+            {
+                if (isTriangleRemoved[triangle])
+                    continue;
+                for (int corner = 0; corner < 3; ++corner)
+                {
+                    GLuint other = triangles[triangle * 3 + corner];
+                    if (other == to)
+                        continue;
+                    queueCollapse(other, to);
+                    queueCollapse(to, other);
+                }
+            }
+        }
+    }
+
+    std::vector<GLushort> reduced;
+    reduced.reserve(liveTriangles * 3);
+    for (size_t triangle = 0; triangle < triangleCount; ++triangle)
+    {
+        if (!isTriangleRemoved[triangle])
+            reduced.insert(reduced.end(), triangles.begin() + triangle * 3, triangles.begin() + triangle * 3 + 3);
+    }
+    return reduced;
+}
+
+
+// Adds the squared-distance quadric of the plane n.p + d = 0
+void UAddPlaneQuadric(Quadric& quadric, const glm::vec3& normal, float distance, float weight)
+{
+    const double plane[4] = { normal.x, normal.y, normal.z, distance };
+    int entry = 0;
+    for (int row = 0; row < 4; ++row)
+        for (int column = row; column < 4; ++column)
+            quadric.m[entry++] += weight * plane[row] * plane[column];
+}
+
+
+// Sum of weighted squared distances from a position to the quadric's planes
+double UQuadricError(const Quadric& quadric, const glm::vec3& position)
+{
+    const double p[4] = { position.x, position.y, position.z, 1.0 };
+    double error = 0.0;
+    int entry = 0;
+    for (int row = 0; row < 4; ++row)
+    {
+        for (int column = row; column < 4; ++column)
+        {
+            // Off-diagonal terms appear twice in p^T Q p
+            double term = quadric.m[entry++] * p[row] * p[column];
+            error += row == column ? term : 2.0 * term;
+        }
+    }
+    return error;
+}
+
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    UDeleteVertexArrays(1, &mesh.vao);
+    UDeleteBuffers(2, mesh.vbos);
+    mesh.parts.clear();
+}
+
+
+// Builds the indirect command buffer and per-draw data buffer for a mesh's part table
+void UCreateIndirectDraws(const GLMesh& mesh, const glm::mat4& model, GLIndirectDraws& draws)
+{
+    std::vector<DrawElementsIndirectCommand>& commands = draws.commands;
+    std::vector<GLDrawData> drawData;
+    commands.clear();
+    draws.partOrder.clear();
+    draws.batches.clear();
+
+    // Parts grouped by shader variant, so each variant's commands are one contiguous batch
+    for (GLuint part = 0; part < mesh.parts.size(); ++part)
+        draws.partOrder.push_back(part);
+    std::stable_sort(draws.partOrder.begin(), draws.partOrder.end(), [&mesh](GLuint a, GLuint b) {
+        return gMaterials[mesh.parts[a].material].features < gMaterials[mesh.parts[b].material].features;
+    });
+
+    for (GLuint partIndex : draws.partOrder)
+    {
+        const GLMeshPart& part = mesh.parts[partIndex];
+        GLuint features = gMaterials[part.material].features | SHADER_FEATURE_DRAW_PARAMETERS;
+        if (draws.batches.empty() || draws.batches.back().features != features)
+        {
+            GLIndirectBatch batch = { features, static_cast<GLsizei>(commands.size()), 0 };
+            draws.batches.push_back(batch);
+        }
+        draws.batches.back().commandCount += MAX_LOD_LEVELS;
+
+        // A command for every possible level; levels the part lacks keep an instance count of 0
+        for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+        {
+            GLuint partLevel = std::min(level, part.lodCount - 1);
+            DrawElementsIndirectCommand command;
+            command.count = part.lodIndexCount[partLevel];
+            command.instanceCount = 0;
+            command.firstIndex = part.lodFirstIndex[partLevel];
+            command.baseVertex = part.baseVertex;
+            command.baseInstance = 0;
+            commands.push_back(command);
+
+            GLDrawData data;
+            data.model = model;
+            data.uvScale = *gMaterials[part.material].uvScale;
+            data.textureLayer = gMaterials[part.material].textureLayer;
+            data.padding = 0;
+            drawData.push_back(data);
+        }
+    }
+    draws.drawCount = static_cast<GLsizei>(commands.size());
+
+    glGenBuffers(1, &draws.commandBuffer);
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, draws.commandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    glGenBuffers(1, &draws.drawDataBuffer);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, draws.drawDataBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, drawData.size() * sizeof(GLDrawData), drawData.data(), GL_STATIC_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyIndirectDraws(GLIndirectDraws& draws)
+{
+    UDeleteBuffers(1, &draws.commandBuffer);
+    UDeleteBuffers(1, &draws.drawDataBuffer);
+    draws.drawCount = 0;
+    draws.commands.clear();
+    draws.partOrder.clear();
+    draws.batches.clear();
+}
+
+
+// Creates the instance buffer and wires it into a VAO as per-instance attributes
+void UCreateInstanceBuffer(GLuint vao, GLInstanceBuffer& instances)
+{
+    instances.capacity = INITIAL_INSTANCE_CAPACITY;
+    instances.dirtyBegin = 0;
+    instances.dirtyEnd = 0;
+
+    instances.isLayoutChanged = true;
+    instances.version = 0;
+
+    glGenBuffers(1, &instances.buffer);
+    UBindBuffer(GL_ARRAY_BUFFER, instances.buffer);
+    glBufferData(GL_ARRAY_BUFFER, instances.capacity * sizeof(GLInstanceData), NULL, GL_DYNAMIC_DRAW);
+    UBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    UBindVertexArray(vao);
+
+    // The attributes read through a separate binding, so culling can swap in the visible instances
+    // with one glBindVertexBuffer instead of respecifying every attribute
+    // The model matrix takes one attribute per column; each instance advances them once
+    for (GLuint column = 0; column < 4; ++column)
+    {
+        glVertexAttribFormat(INSTANCE_MODEL_LOCATION + column, 4, GL_FLOAT, GL_FALSE,
+            static_cast<GLuint>(offsetof(GLInstanceData, model) + sizeof(glm::vec4) * column));
+        glVertexAttribBinding(INSTANCE_MODEL_LOCATION + column, INSTANCE_BINDING);
+        glEnableVertexAttribArray(INSTANCE_MODEL_LOCATION + column);
+    }
+
+    glVertexAttribFormat(INSTANCE_VARIATION_LOCATION, 4, GL_FLOAT, GL_FALSE, static_cast<GLuint>(offsetof(GLInstanceData, variation)));
+    glVertexAttribBinding(INSTANCE_VARIATION_LOCATION, INSTANCE_BINDING);
+    glEnableVertexAttribArray(INSTANCE_VARIATION_LOCATION);
+
+    glVertexBindingDivisor(INSTANCE_BINDING, 1);
+    UBindVertexBuffer(INSTANCE_BINDING, instances.buffer, 0, sizeof(GLInstanceData));
+
+    UBindVertexArray(0);
+}
+
+
+void UDestroyInstanceBuffer(GLInstanceBuffer& instances)
+{
+    UDeleteBuffers(1, &instances.buffer);
+    instances.capacity = 0;
+    instances.instances.clear();
+    instances.handleSlots.clear();
+    instances.slotHandles.clear();
+    instances.freeHandles.clear();
+    instances.movedSlots.clear();
+    instances.lods.clear();
+}
+
+
+// Widens the range of instances USyncInstanceBuffer uploads
+void UMarkInstancesDirty(GLInstanceBuffer& instances, size_t begin, size_t end)
+{
+    if (instances.dirtyBegin >= instances.dirtyEnd)
+    {
+        instances.dirtyBegin = begin;
+        instances.dirtyEnd = end;
+        return;
+    }
+    instances.dirtyBegin = std::min(instances.dirtyBegin, begin);
+    instances.dirtyEnd = std::max(instances.dirtyEnd, end);
+}
+
+
+// Appends instances and writes a handle for each to handles (may be NULL)
+void UAddInstances(GLInstanceBuffer& instances, const GLInstanceData* data, size_t count, GLuint* handles)
+{
+    size_t first = instances.instances.size();
+    instances.instances.insert(instances.instances.end(), data, data + count);
+    instances.lods.resize(instances.instances.size(), 0);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        GLuint handle;
+        if (!instances.freeHandles.empty())
+        {
+            handle = instances.freeHandles.back();
+            instances.freeHandles.pop_back();
+        }
+        else
+        {
+            handle = static_cast<GLuint>(instances.handleSlots.size());
+            instances.handleSlots.push_back(0);
+        }
+        instances.handleSlots[handle] = static_cast<GLuint>(first + i);
+        instances.slotHandles.push_back(handle);
+        if (handles)
+            handles[i] = handle;
+    }
+
+    UMarkInstancesDirty(instances, first, instances.instances.size());
+    instances.isLayoutChanged = true;
+    ++instances.version;
+}
+
+
+// Removes instances by handle; the last instance moves into each hole so the buffer stays dense.
+// Unknown or already removed handles, repeats within the call included, are skipped and make it return false.
+bool URemoveInstances(GLInstanceBuffer& instances, const GLuint* handles, size_t count)
+{
+    bool isValid = true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!UIsInstanceHandleValid(instances, handles[i]))
+        {
+            cout << "Cannot remove instance " << handles[i] << ": no such instance" << endl;
+            isValid = false;
+            continue;
+        }
+
+        GLuint slot = instances.handleSlots[handles[i]];
+        GLuint last = static_cast<GLuint>(instances.instances.size() - 1);
+
+        instances.instances[slot] = instances.instances[last];
+        instances.slotHandles[slot] = instances.slotHandles[last];
+        instances.lods[slot] = instances.lods[last];
+        instances.handleSlots[instances.slotHandles[slot]] = slot;
+        instances.instances.pop_back();
+        instances.slotHandles.pop_back();
+        instances.lods.pop_back();
+        instances.handleSlots[handles[i]] = INSTANCE_SLOT_FREE;
+        instances.freeHandles.push_back(handles[i]);
+
+        if (slot != last)
+            UMarkInstancesDirty(instances, slot, slot + 1);
+    }
+    instances.isLayoutChanged = true;
+    ++instances.version;
+    return isValid;
+}
+
+
+// Overwrites instances by handle; unknown or removed handles are skipped and make it return false
+bool UUpdateInstances(GLInstanceBuffer& instances, const GLuint* handles, const GLInstanceData* data, size_t count)
+{
+    bool isValid = true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!UIsInstanceHandleValid(instances, handles[i]))
+        {
+            cout << "Cannot update instance " << handles[i] << ": no such instance" << endl;
+            isValid = false;
+            continue;
+        }
+
+        GLuint slot = instances.handleSlots[handles[i]];
+        instances.instances[slot] = data[i];
+        UMarkInstancesDirty(instances, slot, slot + 1);
+        instances.movedSlots.push_back(slot);
+    }
+
+    // Nothing refits while culling is off, so the list is capped: past one entry per instance a rebuild
+    // costs no more than the refit would
+    if (instances.movedSlots.size() > instances.instances.size())
+    {
+        instances.movedSlots.clear();
+        instances.isLayoutChanged = true;
+    }
+    ++instances.version;
+    return isValid;
+}
+
+
+// True if the handle was given out by UAddInstances and its instance has not been removed since
+bool UIsInstanceHandleValid(const GLInstanceBuffer& instances, GLuint handle)
+{
+    return handle < instances.handleSlots.size() && instances.handleSlots[handle] != INSTANCE_SLOT_FREE;
+}
+
+
+// Uploads the changed range once per frame; the GL buffer is only reallocated when it runs out of room
+void USyncInstanceBuffer(GLInstanceBuffer& instances)
+{
+    size_t count = instances.instances.size();
+    UBindBuffer(GL_ARRAY_BUFFER, instances.buffer);
+
+    if (count > instances.capacity)
+    {
+        instances.capacity = std::max(instances.capacity * 2, count);
+        glBufferData(GL_ARRAY_BUFFER, instances.capacity * sizeof(GLInstanceData), NULL, GL_DYNAMIC_DRAW);
+        instances.dirtyBegin = 0;
+        instances.dirtyEnd = count;
+    }
+
+    size_t end = std::min(instances.dirtyEnd, count);
+    if (instances.dirtyBegin < end)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, instances.dirtyBegin * sizeof(GLInstanceData),
+            (end - instances.dirtyBegin) * sizeof(GLInstanceData), &instances.instances[instances.dirtyBegin]);
+        ++gRenderStats.bufferUploads;
+    }
+    instances.dirtyBegin = 0;
+    instances.dirtyEnd = 0;
+
+    UBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Lays houses out on a square grid centered on the origin, each turned and tinted a little differently.
+// The first house is untinted and unturned and takes the middle lot, so one house looks exactly like the
+// original scene. The middle lot is at the origin only for an odd side; for an even side the origin is a
+// lot corner and the first house sits half a lot off it in x and z.
+void UAddNeighborhood(GLInstanceBuffer& instances, int houseCount)
+{
+    const int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(houseCount))));
+    const float gridOffset = (side - 1) * 0.5f * HOUSE_SPACING;
+
+    std::vector<GLInstanceData> houses(houseCount);
+    for (int i = 0; i < houseCount; ++i)
+    {
+        // Cheap integer hash, so the same house always gets the same variation
+        unsigned int hash = static_cast<unsigned int>(i) * 2654435761u;
+
+        // Lot 0 of the grid is its center house; the rest fill in row by row
+        int lot = (i + (side * side) / 2) % (side * side);
+        glm::vec3 position((lot % side) * HOUSE_SPACING - gridOffset, 0.0f, (lot / side) * HOUSE_SPACING - gridOffset);
+        float turn = glm::radians(90.0f * (hash & 3));
+
+        houses[i].model = glm::translate(position) * glm::rotate(turn, glm::vec3(0.0f, 1.0f, 0.0f));
+        houses[i].variation = glm::vec4(
+            1.0f - 0.2f * ((hash >> 8) & 0xFF) / 255.0f,
+            1.0f - 0.2f * ((hash >> 16) & 0xFF) / 255.0f,
+            1.0f - 0.2f * ((hash >> 24) & 0xFF) / 255.0f,
+            1.0f);
+    }
+
+    UAddInstances(instances, houses.data(), houses.size(), NULL);
+}
+
+
+/* Places the neighborhood's point lights: a porch light at every front door, a glow at every window
+ * and a street lamp at every corner of the lot grid
+ * The door and window parts are flat, so each light sits just off the part's thinnest side, away from the house's middle.
+ */
+void UAddNeighborhoodLights(ClusteredLights& clustered, const GLMesh& mesh, const GLInstanceBuffer& instances, int houseCount)
+{
+    const float LIGHT_OFFSET = 0.1f;    // Mesh-space distance in front of the door or window
+    const glm::vec3 meshCenter = (mesh.bounds.min + mesh.bounds.max) * 0.5f;
+
+    std::vector<GLPointLight> houseLights;
+    for (const GLMeshPart& part : mesh.parts)
+    {
+        GLPointLight light;
+        if (part.material == MATERIAL_FRONT_DOOR)
+        {
+            light.positionRadius.w = 3.0f;
+            light.color = glm::vec4(1.0f, 0.7f, 0.4f, 0.0f);
+        }
+        else if (part.material == MATERIAL_TOP_WINDOW || part.material == MATERIAL_FRONT_WINDOW)
+        {
+            light.positionRadius.w = 2.0f;
+            light.color = glm::vec4(0.8f, 0.65f, 0.45f, 0.0f);
+        }
+        else
+            continue;
+
+        glm::vec3 center = (part.bounds.min + part.bounds.max) * 0.5f;
+        glm::vec3 size = part.bounds.max - part.bounds.min;
+        int axis = size.x <= size.y && size.x <= size.z ? 0 : (size.y <= size.z ? 1 : 2);
+        center[axis] += center[axis] >= meshCenter[axis] ? LIGHT_OFFSET : -LIGHT_OFFSET;
+        light.positionRadius = glm::vec4(center, light.positionRadius.w);
+        houseLights.push_back(light);
+    }
+
+    const glm::mat4 meshModel = UHouseModelMatrix();
+    for (const GLInstanceData& house : instances.instances)
+    {
+        for (const GLPointLight& houseLight : houseLights)
+        {
+            GLPointLight light = houseLight;
+            glm::vec3 position(house.model * meshModel * glm::vec4(glm::vec3(houseLight.positionRadius), 1.0f));
+            light.positionRadius = glm::vec4(position, houseLight.positionRadius.w);
+            clustered.lights.push_back(light);
+        }
+    }
+
+    // Street lamps on the corners between lots, as UAddNeighborhood lays them out
+    const int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(houseCount))));
+    const float gridOffset = side * 0.5f * HOUSE_SPACING;
+    for (int row = 0; row <= side; ++row)
+    {
+        for (int column = 0; column <= side; ++column)
+        {
+            GLPointLight light;
+            light.positionRadius = glm::vec4(column * HOUSE_SPACING - gridOffset, 3.0f, row * HOUSE_SPACING - gridOffset, 6.0f);
+            light.color = glm::vec4(1.5f, 1.5f, 1.7f, 0.0f);
+            clustered.lights.push_back(light);
+        }
+    }
+}
+
+
+// Uploads the lights, which stay put, and sizes the cluster lists
+void UCreateClusteredLights(ClusteredLights& clustered)
+{
+    clustered.ranges.assign(CLUSTER_COUNT, GLClusterRange());
+
+    // Never empty, since a zero-sized buffer cannot be bound
+    glGenBuffers(1, &clustered.lightBuffer);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.lightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(clustered.lights.size(), 1) * sizeof(GLPointLight),
+        clustered.lights.empty() ? NULL : clustered.lights.data(), GL_STATIC_DRAW);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyClusteredLights(ClusteredLights& clustered)
+{
+    UDeleteBuffers(1, &clustered.lightBuffer);
+    clustered.lights.clear();
+}
+
+
+// Depth slice of a view depth, before clamping; the shader computes the same from ClusterData
+float UClusterSlice(float depth)
+{
+    return std::log(depth / CAMERA_NEAR) * (CLUSTER_SLICES / std::log(CAMERA_FAR / CAMERA_NEAR));
+}
+
+
+/* Bins every point light into the clusters its sphere of influence touches, as offset and count lists
+ * A light's clusters are a box of tiles and slices: the slices its depth range spans, and the tiles covered by the
+ * projection of its view-space bounding box. Two passes, counting then filling, keep each cluster's list contiguous.
+ */
+void UAssignLights(ClusteredLights& clustered, const glm::mat4& view, const glm::mat4& projection)
+{
+    std::vector<GLuint>& lightClusters = clustered.lightClusters;
+    lightClusters.clear();
+    for (GLClusterRange& range : clustered.ranges)
+        range.count = 0;
+
+    for (GLuint lightIndex = 0; lightIndex < clustered.lights.size(); ++lightIndex)
+    {
+        const GLPointLight& light = clustered.lights[lightIndex];
+        glm::vec3 center(view * glm::vec4(glm::vec3(light.positionRadius), 1.0f));
+        float radius = light.positionRadius.w;
+
+        // The camera looks down -z
+        float nearDepth = std::max(-center.z - radius, CAMERA_NEAR);
+        float farDepth = std::min(-center.z + radius, CAMERA_FAR);
+        if (nearDepth > farDepth)
+            continue;
+
+        // Projected extent of the bounding box; corners in front of the near plane are pulled onto it,
+        // which can only widen the extent
+        glm::vec2 ndcMin(1.0f), ndcMax(-1.0f);
+        const float depths[2] = { nearDepth, farDepth };
+        for (float depth : depths)
+        {
+            for (int corner = 0; corner < 4; ++corner)
+            {
+                float x = center.x + ((corner & 1) ? radius : -radius);
+                float y = center.y + ((corner & 2) ? radius : -radius);
+                glm::vec2 ndc(projection[0][0] * x / depth, projection[1][1] * y / depth);
+                ndcMin = glm::min(ndcMin, ndc);
+                ndcMax = glm::max(ndcMax, ndc);
+            }
+        }
+        if (ndcMax.x < -1.0f || ndcMax.y < -1.0f || ndcMin.x > 1.0f || ndcMin.y > 1.0f)
+            continue;
+
+        GLuint tileMinX = static_cast<GLuint>(glm::clamp((ndcMin.x * 0.5f + 0.5f) * CLUSTER_TILES_X, 0.0f, CLUSTER_TILES_X - 1.0f));
+        GLuint tileMaxX = static_cast<GLuint>(glm::clamp((ndcMax.x * 0.5f + 0.5f) * CLUSTER_TILES_X, 0.0f, CLUSTER_TILES_X - 1.0f));
+        GLuint tileMinY = static_cast<GLuint>(glm::clamp((ndcMin.y * 0.5f + 0.5f) * CLUSTER_TILES_Y, 0.0f, CLUSTER_TILES_Y - 1.0f));
+        GLuint tileMaxY = static_cast<GLuint>(glm::clamp((ndcMax.y * 0.5f + 0.5f) * CLUSTER_TILES_Y, 0.0f, CLUSTER_TILES_Y - 1.0f));
+        GLuint sliceMin = static_cast<GLuint>(glm::clamp(UClusterSlice(nearDepth), 0.0f, CLUSTER_SLICES - 1.0f));
+        GLuint sliceMax = static_cast<GLuint>(glm::clamp(UClusterSlice(farDepth), 0.0f, CLUSTER_SLICES - 1.0f));
+
+        const GLuint box[7] = { lightIndex, tileMinX, tileMaxX, tileMinY, tileMaxY, sliceMin, sliceMax };
+        lightClusters.insert(lightClusters.end(), box, box + 7);
+        for (GLuint slice = sliceMin; slice <= sliceMax; ++slice)
+            for (GLuint y = tileMinY; y <= tileMaxY; ++y)
+                for (GLuint x = tileMinX; x <= tileMaxX; ++x)
+                    ++clustered.ranges[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x].count;
+    }
+
+    GLuint total = 0;
+    for (GLClusterRange& range : clustered.ranges)
+    {
+        range.offset = total;
+        total += range.count;
+        range.count = 0;
+    }
+
+    clustered.indices.resize(total);
+    for (size_t i = 0; i < lightClusters.size(); i += 7)
+    {
+        for (GLuint slice = lightClusters[i + 5]; slice <= lightClusters[i + 6]; ++slice)
+            for (GLuint y = lightClusters[i + 3]; y <= lightClusters[i + 4]; ++y)
+                for (GLuint x = lightClusters[i + 1]; x <= lightClusters[i + 2]; ++x)
+                {
+                    GLClusterRange& range = clustered.ranges[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x];
+                    clustered.indices[range.offset + range.count++] = lightClusters[i];
+                }
+    }
+}
+
+
+// Creates the caster program and the depth cube, which starts out stale
+bool UCreateShadowMap(GLShadowMap& shadow)
+{
+    ShaderProgramBuild build;
+    UBeginShaderProgram(shadowVertexShaderSource, shadowFragmentShaderSource, build);
+    if (!UFinishProgram(build, shadow.program))
+    {
+        cout << "Shadows are not available" << endl;
+        return false;
+    }
+    shadow.modelUniform = UGetUniformLocation(shadow.program, "model");
+    shadow.viewProjectionUniform = UGetUniformLocation(shadow.program, "uViewProjection");
+    shadow.lightUniform = UGetUniformLocation(shadow.program, "uShadowLight");
+
+    // The static cube and the composite one, of identical format so one can be copied into the other
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    for (GLuint texture : textures)
+    {
+        UBindTexture(0, GL_TEXTURE_CUBE_MAP, texture);
+        glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+    UBindTexture(0, GL_TEXTURE_CUBE_MAP, 0);
+    shadow.staticTexture = textures[0];
+    shadow.compositeTexture = textures[1];
+    shadow.sampledTexture = shadow.staticTexture;
+
+    // Depth only
+    glGenFramebuffers(1, &shadow.framebuffer);
+    UBindFramebuffer(shadow.framebuffer);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    UBindFramebuffer(gIsHeadless ? gHeadlessTarget.framebuffer : 0);
+
+    shadow.isValid = false;
+    return true;
+}
+
+
+void UDestroyShadowMap(GLShadowMap& shadow)
+{
+    UDeleteFramebuffers(1, &shadow.framebuffer);
+    UDeleteTextures(1, &shadow.staticTexture);
+    UDeleteTextures(1, &shadow.compositeTexture);
+    UDeleteProgram(shadow.program);
+    shadow.isValid = false;
+}
+
+
+/* Brings the shadow map up to date for this frame and picks the cube the frame samples
+ * The static casters are redrawn only when the light has moved past SHADOW_MOVE_THRESHOLD since the
+ * cached cube was drawn, or the instance buffer changed. Dynamic casters never touch the cached cube:
+ * it is copied into the composite cube on the GPU and they are drawn into the copy.
+ */
+void UUpdateShadowMap(GLShadowMap& shadow, const glm::vec3& lightPosition, GLInstanceBuffer& casters,
+    const std::vector<GLInstanceData>& dynamicCasters)
+{
+    bool isLightMoved = glm::length(lightPosition - shadow.lightPosition) > SHADOW_MOVE_THRESHOLD;
+    bool isStale = !shadow.isValid || isLightMoved || shadow.casterVersion != casters.version;
+    shadow.sampledTexture = shadow.staticTexture;
+    if (!isStale && dynamicCasters.empty())
+        return;
+
+    UBindFramebuffer(shadow.framebuffer);
+    UViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    if (UUseProgram(shadow.program))
+        ++gRenderStats.programSwitches;
+
+    if (isStale)
+    {
+        shadow.lightPosition = lightPosition;
+        shadow.casterVersion = casters.version;
+        shadow.isValid = true;
+
+        // Every house casts, including those outside the view
+        USyncInstanceBuffer(casters);
+        UBindVertexBuffer(INSTANCE_BINDING, casters.buffer, 0, sizeof(GLInstanceData));
+        URenderShadowCasters(shadow, shadow.staticTexture, true, static_cast<GLuint>(casters.instances.size()));
+        ++gRenderStats.shadowUpdates;
+    }
+
+    if (!dynamicCasters.empty())
+    {
+        // All six faces at once; the cached cube stays as it is for the next frame
+        glCopyImageSubData(shadow.staticTexture, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+            shadow.compositeTexture, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 6);
+
+        // Drawn from the cached cube's light position, so moving and static shadows line up
+        size_t size = dynamicCasters.size() * sizeof(GLInstanceData);
+        StreamBlock block = UStreamAllocate(gStreamBuffer, size, gStreamBuffer.storageAlignment);
+        memcpy(block.data, dynamicCasters.data(), size);
+        UBindVertexBuffer(INSTANCE_BINDING, block.buffer, block.offset, sizeof(GLInstanceData));
+        URenderShadowCasters(shadow, shadow.compositeTexture, false, static_cast<GLuint>(dynamicCasters.size()));
+        shadow.sampledTexture = shadow.compositeTexture;
+    }
+
+    // Back to the frame's own target
+    UBindFramebuffer(gIsHeadless ? gHeadlessTarget.framebuffer : 0);
+    UViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+}
+
+
+// Draws the bound instances into each face of a shadow cube, at full detail, on top of its depths unless isClearing
+void URenderShadowCasters(const GLShadowMap& shadow, GLuint texture, bool isClearing, GLuint instanceCount)
+{
+    // Face order of GL_TEXTURE_CUBE_MAP_POSITIVE_X onwards, with the up vectors cube map lookups expect
+    const glm::vec3 directions[6] = {
+        glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)
+    };
+    const glm::vec3 ups[6] = {
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f),
+        glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+    };
+
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR, SHADOW_FAR);
+    glm::mat4 model = UHouseModelMatrix();
+    glUniformMatrix4fv(shadow.modelUniform, 1, GL_FALSE, glm::value_ptr(model));
+    glUniform4f(shadow.lightUniform, shadow.lightPosition.x, shadow.lightPosition.y, shadow.lightPosition.z, SHADOW_FAR);
+    gRenderStats.uniformUploads += 2;
+
+    for (GLuint face = 0; face < 6; ++face)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, texture, 0);
+        if (isClearing)
+            glClear(GL_DEPTH_BUFFER_BIT);
+
+        glm::mat4 viewProjection = projection * glm::lookAt(shadow.lightPosition, shadow.lightPosition + directions[face], ups[face]);
+        glUniformMatrix4fv(shadow.viewProjectionUniform, 1, GL_FALSE, glm::value_ptr(viewProjection));
+        ++gRenderStats.uniformUploads;
+
+        for (const GLMeshPart& part : gMesh.parts)
+        {
+            glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, part.indexCount, GL_UNSIGNED_SHORT,
+                (void*)(part.firstIndex * sizeof(GLushort)), instanceCount, part.baseVertex, 0);
+            ++gRenderStats.drawCalls;
+            gRenderStats.indices += static_cast<unsigned long long>(part.indexCount) * instanceCount;
+        }
+    }
+}
+
+
+// Bounds of a box after a transform: the center moves, the extents sum over the absolute matrix
+BoundingBox UTransformBounds(const BoundingBox& box, const glm::mat4& transform)
+{
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 extent = (box.max - box.min) * 0.5f;
+
+    glm::vec3 newCenter(transform * glm::vec4(center, 1.0f));
+    glm::vec3 newExtent;
+    for (int row = 0; row < 3; ++row)
+    {
+        newExtent[row] = std::fabs(transform[0][row]) * extent.x
+            + std::fabs(transform[1][row]) * extent.y
+            + std::fabs(transform[2][row]) * extent.z;
+    }
+
+    BoundingBox result;
+    result.min = newCenter - newExtent;
+    result.max = newCenter + newExtent;
+    return result;
+}
+
+
+// Brings the BVH up to date with the instance buffer: a rebuild after adds or removes,
+// otherwise a refit of only the leaves holding moved instances and their ancestors
+void UUpdateInstanceBvh(InstanceBvh& bvh, GLInstanceBuffer& instances, const BoundingBox& meshBounds, const glm::mat4& meshModel)
+{
+    if (instances.isLayoutChanged)
+    {
+        GLuint count = static_cast<GLuint>(instances.instances.size());
+        bvh.bounds.resize(count);
+        bvh.slotLeaves.resize(count);
+        bvh.items.resize(count);
+        for (GLuint slot = 0; slot < count; ++slot)
+        {
+            bvh.bounds[slot] = UTransformBounds(meshBounds, instances.instances[slot].model * meshModel);
+            bvh.items[slot] = slot;
+        }
+
+        bvh.nodes.clear();
+        bvh.nodes.reserve(2 * count / BVH_LEAF_SIZE + 1);
+        bvh.nodes.push_back(BvhNode());
+        bvh.nodes[0].parent = 0;
+        if (count > 0)
+            UBuildBvhNode(bvh, 0, 0, count);
+        bvh.isNodeDirty.assign(bvh.nodes.size(), 0);
+
+        instances.isLayoutChanged = false;
+        instances.movedSlots.clear();
+        return;
+    }
+
+    if (instances.movedSlots.empty())
+        return;
+
+    // Flag each moved instance's leaf and its ancestors, stopping at the first one already flagged
+    for (GLuint slot : instances.movedSlots)
+    {
+        bvh.bounds[slot] = UTransformBounds(meshBounds, instances.instances[slot].model * meshModel);
+        for (GLuint node = bvh.slotLeaves[slot]; !bvh.isNodeDirty[node]; node = bvh.nodes[node].parent)
+        {
+            bvh.isNodeDirty[node] = 1;
+            if (node == 0)
+                break;
+        }
+    }
+    instances.movedSlots.clear();
+
+    // Children come after their parents, so a backward pass refits every flagged node once, bottom up
+    for (size_t i = bvh.nodes.size(); i-- > 0; )
+    {
+        if (!bvh.isNodeDirty[i])
+            continue;
+        bvh.isNodeDirty[i] = 0;
+
+        BvhNode& node = bvh.nodes[i];
+        if (node.left != 0)
+        {
+            const BoundingBox& left = bvh.nodes[node.left].bounds;
+            const BoundingBox& right = bvh.nodes[node.left + 1].bounds;
+            node.bounds.min = glm::min(left.min, right.min);
+            node.bounds.max = glm::max(left.max, right.max);
+            continue;
+        }
+
+        node.bounds = bvh.bounds[bvh.items[node.firstItem]];
+        for (GLuint item = node.firstItem + 1; item < node.firstItem + node.itemCount; ++item)
+        {
+            node.bounds.min = glm::min(node.bounds.min, bvh.bounds[bvh.items[item]].min);
+            node.bounds.max = glm::max(node.bounds.max, bvh.bounds[bvh.items[item]].max);
+        }
+    }
+}
+
+
+// Builds the subtree over items [begin, end) by splitting at the median centroid along the widest axis
+void UBuildBvhNode(InstanceBvh& bvh, GLuint nodeIndex, GLuint begin, GLuint end)
+{
+    BoundingBox bounds = bvh.bounds[bvh.items[begin]];
+    BoundingBox centroids;
+    centroids.min = (bounds.min + bounds.max) * 0.5f;
+    centroids.max = centroids.min;
+    for (GLuint item = begin + 1; item < end; ++item)
+    {
+        const BoundingBox& box = bvh.bounds[bvh.items[item]];
+        glm::vec3 centroid = (box.min + box.max) * 0.5f;
+        bounds.min = glm::min(bounds.min, box.min);
+        bounds.max = glm::max(bounds.max, box.max);
+        centroids.min = glm::min(centroids.min, centroid);
+        centroids.max = glm::max(centroids.max, centroid);
+    }
+
+    bvh.nodes[nodeIndex].bounds = bounds;
+    bvh.nodes[nodeIndex].left = 0;
+    bvh.nodes[nodeIndex].firstItem = begin;
+    bvh.nodes[nodeIndex].itemCount = end - begin;
+
+    if (end - begin <= BVH_LEAF_SIZE)
+    {
+        for (GLuint item = begin; item < end; ++item)
+            bvh.slotLeaves[bvh.items[item]] = nodeIndex;
+        return;
+    }
+
+    glm::vec3 size = centroids.max - centroids.min;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+    GLuint middle = begin + (end - begin) / 2;
+    std::nth_element(bvh.items.begin() + begin, bvh.items.begin() + middle, bvh.items.begin() + end,
+        [&bvh, axis](GLuint a, GLuint b) {
+            return bvh.bounds[a].min[axis] + bvh.bounds[a].max[axis] < bvh.bounds[b].min[axis] + bvh.bounds[b].max[axis];
+        });
+
+    // Both children are appended before either is built, keeping right == left + 1
+    GLuint left = static_cast<GLuint>(bvh.nodes.size());
+    bvh.nodes[nodeIndex].left = left;
+    bvh.nodes.push_back(BvhNode());
+    bvh.nodes.push_back(BvhNode());
+    bvh.nodes[left].parent = nodeIndex;
+    bvh.nodes[left + 1].parent = nodeIndex;
+
+    UBuildBvhNode(bvh, left, begin, middle);
+    UBuildBvhNode(bvh, left + 1, middle, end);
+}
+
+
+// Gribb-Hartmann plane extraction from the rows of projection * view
+void UExtractFrustum(const glm::mat4& viewProjection, Frustum& frustum)
+{
+    const glm::mat4& m = viewProjection;
+    const float planes[6][4] = {
+        { m[0][3] + m[0][0], m[1][3] + m[1][0], m[2][3] + m[2][0], m[3][3] + m[3][0] },     // Left
+        { m[0][3] - m[0][0], m[1][3] - m[1][0], m[2][3] - m[2][0], m[3][3] - m[3][0] },     // Right
+        { m[0][3] + m[0][1], m[1][3] + m[1][1], m[2][3] + m[2][1], m[3][3] + m[3][1] },     // Bottom
+        { m[0][3] - m[0][1], m[1][3] - m[1][1], m[2][3] - m[2][1], m[3][3] - m[3][1] },     // Top
+        { m[0][3] + m[0][2], m[1][3] + m[1][2], m[2][3] + m[2][2], m[3][3] + m[3][2] },     // Near
+        { m[0][3] - m[0][2], m[1][3] - m[1][2], m[2][3] - m[2][2], m[3][3] - m[3][2] }      // Far
+    };
+
+    for (int lane = 0; lane < 8; ++lane)
+    {
+        const float* plane = planes[std::min(lane, 5)];
+        frustum.a[lane] = plane[0];
+        frustum.b[lane] = plane[1];
+        frustum.c[lane] = plane[2];
+        frustum.d[lane] = plane[3];
+    }
+}
+
+
+// Classifies a box against the frustum. Per plane, the box's center distance is compared with its
+// projected radius; SSE builds test four planes per instruction, others take UTestFrustumScalar.
+FrustumTest UTestFrustum(const Frustum& frustum, const BoundingBox& box)
+{
+#ifdef CS330_SSE
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 extent = (box.max - box.min) * 0.5f;
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 centerX = _mm_set1_ps(center.x), centerY = _mm_set1_ps(center.y), centerZ = _mm_set1_ps(center.z);
+    const __m128 extentX = _mm_set1_ps(extent.x), extentY = _mm_set1_ps(extent.y), extentZ = _mm_set1_ps(extent.z);
+    __m128 isOutside = zero;
+    __m128 isCrossing = zero;
+
+    for (int lane = 0; lane < 8; lane += 4)
+    {
+        __m128 a = _mm_load_ps(frustum.a + lane);
+        __m128 b = _mm_load_ps(frustum.b + lane);
+        __m128 c = _mm_load_ps(frustum.c + lane);
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, centerX), _mm_mul_ps(b, centerY)),
+            _mm_add_ps(_mm_mul_ps(c, centerZ), _mm_load_ps(frustum.d + lane)));
+        __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, a), extentX), _mm_mul_ps(_mm_andnot_ps(signMask, b), extentY)),
+            _mm_mul_ps(_mm_andnot_ps(signMask, c), extentZ));
+
+        isOutside = _mm_or_ps(isOutside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        isCrossing = _mm_or_ps(isCrossing, _mm_cmplt_ps(_mm_sub_ps(distance, radius), zero));
+    }
+
+    if (_mm_movemask_ps(isOutside))
+        return FRUSTUM_OUTSIDE;
+    return _mm_movemask_ps(isCrossing) ? FRUSTUM_INTERSECTS : FRUSTUM_INSIDE;
+#else
+    return UTestFrustumScalar(frustum, box);
+#endif
+}
+
+
+// One plane at a time, summing in the SSE path's order so both round alike; --self-check compares the two
+FrustumTest UTestFrustumScalar(const Frustum& frustum, const BoundingBox& box)
+{
+    glm::vec3 center = (box.min + box.max) * 0.5f;
+    glm::vec3 extent = (box.max - box.min) * 0.5f;
+
+    FrustumTest result = FRUSTUM_INSIDE;
+    for (int plane = 0; plane < 6; ++plane)
+    {
+        float distance = (frustum.a[plane] * center.x + frustum.b[plane] * center.y) + (frustum.c[plane] * center.z + frustum.d[plane]);
+        float radius = std::fabs(frustum.a[plane]) * extent.x + std::fabs(frustum.b[plane]) * extent.y + std::fabs(frustum.c[plane]) * extent.z;
+        if (distance + radius < 0.0f)
+            return FRUSTUM_OUTSIDE;
+        if (distance - radius < 0.0f)
+            result = FRUSTUM_INTERSECTS;
+    }
+    return result;
+}
+
+
+// Collects the instances inside the frustum. Subtrees fully inside are taken without further tests.
+void UCullInstances(const InstanceBvh& bvh, const GLInstanceBuffer& instances, const Frustum& frustum,
+    std::vector<GLuint>& visibleSlots, CullStats& stats)
+{
+    visibleSlots.clear();
+    stats.nodesTested = 0;
+
+    GLuint stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    if (!instances.instances.empty())
+        stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode& node = bvh.nodes[stack[--stackSize]];
+        ++stats.nodesTested;
+
+        FrustumTest test = UTestFrustum(frustum, node.bounds);
+        if (test == FRUSTUM_OUTSIDE)
+            continue;
+
+        if (test == FRUSTUM_INSIDE || node.left == 0)
+        {
+            for (GLuint item = node.firstItem; item < node.firstItem + node.itemCount; ++item)
+            {
+                // Leaves that cross a plane still test their instances one by one
+                if (test == FRUSTUM_INTERSECTS && node.itemCount > 1 && UTestFrustum(frustum, bvh.bounds[bvh.items[item]]) == FRUSTUM_OUTSIDE)
+                    continue;
+                visibleSlots.push_back(bvh.items[item]);
+            }
+            continue;
+        }
+
+        assert(stackSize + 2 <= BVH_STACK_SIZE);
+        stack[stackSize++] = node.left;
+        stack[stackSize++] = node.left + 1;
+    }
+
+    stats.visibleInstances = static_cast<GLuint>(visibleSlots.size());
+    stats.culledInstances = static_cast<GLuint>(instances.instances.size() - visibleSlots.size());
+    gRenderStats.visibleInstances += stats.visibleInstances;
+    gRenderStats.culledInstances += stats.culledInstances;
+}
+
+
+// Picks each visible house's detail level from its projected size, then orders the houses by level so
+// that each level is one contiguous range of instances, drawn through baseInstance
+void USelectLods(GLInstanceBuffer& instances, const InstanceBvh& bvh, const std::vector<GLuint>& visibleSlots,
+    const glm::vec3& viewPosition, float projectionScale, std::vector<GLInstanceData>& visible, GLuint lodBuckets[])
+{
+    GLuint counts[MAX_LOD_LEVELS] = {};
+    for (GLuint slot : visibleSlots)
+    {
+        GLuint level = 0;
+        if (gIsLodEnabled)
+        {
+            // Bounding sphere radius over distance, scaled to a fraction of half the screen height
+            const BoundingBox& box = bvh.bounds[slot];
+            float radius = glm::length(box.max - box.min) * 0.5f;
+            float distance = std::max(glm::distance(viewPosition, (box.min + box.max) * 0.5f), 0.001f);
+            float screenSize = radius * projectionScale / distance;
+
+            // Move at most as far as the hysteresis band allows from the level drawn last frame
+            level = instances.lods[slot];
+            while (level + 1 < MAX_LOD_LEVELS && screenSize < LOD_SCREEN_SIZES[level] * (1.0f - LOD_HYSTERESIS))
+                ++level;
+            while (level > 0 && screenSize > LOD_SCREEN_SIZES[level - 1] * (1.0f + LOD_HYSTERESIS))
+                --level;
+        }
+        instances.lods[slot] = static_cast<GLubyte>(level);
+        ++counts[level];
+    }
+
+    lodBuckets[0] = 0;
+    for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+        lodBuckets[level + 1] = lodBuckets[level] + counts[level];
+
+    GLuint next[MAX_LOD_LEVELS];
+    std::copy(lodBuckets, lodBuckets + MAX_LOD_LEVELS, next);
+    visible.resize(visibleSlots.size());
+    for (GLuint slot : visibleSlots)
+        visible[next[instances.lods[slot]]++] = instances.instances[slot];
+}
+
+
+// Streams this frame's visible instances into the stream buffer; the occlusion pass also reads them as storage
+void UUploadVisibleInstances(const std::vector<GLInstanceData>& visible)
+{
+    gVisibleInstanceBlock = UStreamAllocate(gStreamBuffer, std::max<size_t>(visible.size(), 1) * sizeof(GLInstanceData),
+        gStreamBuffer.storageAlignment);
+    if (!visible.empty())
+        memcpy(gVisibleInstanceBlock.data, visible.data(), visible.size() * sizeof(GLInstanceData));
+}
+
+
+// Places the --moving-house house for the given scene time: half size, circling the middle lot and facing along its path
+void UUpdateDynamicCasters(std::vector<GLInstanceData>& dynamicCasters, double time)
+{
+    dynamicCasters.clear();
+    if (!gIsHouseMoving)
+        return;
+
+    float angle = static_cast<float>(std::fmod(time * MOVING_HOUSE_ANGULAR_VELOCITY, static_cast<double>(glm::radians(360.0f))));
+    GLInstanceData house;
+    house.model = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::translate(glm::vec3(MOVING_HOUSE_RADIUS, 0.0f, 0.0f))
+        * glm::scale(glm::vec3(0.5f));
+    house.variation = glm::vec4(0.8f, 0.9f, 1.0f, 1.0f);
+    dynamicCasters.push_back(house);
+}
+
+
+// Adds the moving houses to this frame's instances at full detail, at the end of the level 0 range
+void UAddDynamicInstances(std::vector<GLInstanceData>& visible, GLuint lodBuckets[], const std::vector<GLInstanceData>& dynamic)
+{
+    if (dynamic.empty())
+        return;
+
+    visible.insert(visible.begin() + lodBuckets[1], dynamic.begin(), dynamic.end());
+    for (GLuint level = 1; level <= MAX_LOD_LEVELS; ++level)
+        lodBuckets[level] += static_cast<GLuint>(dynamic.size());
+}
+
+
+// Orders houses nearest first by view depth of their bounds' centers. USelectLods keeps the order within
+// each detail level, so the depth test rejects hidden fragments before they are shaded.
+void USortFrontToBack(const InstanceBvh& bvh, const glm::vec3& viewPosition, const glm::vec3& viewDirection, std::vector<GLuint>& slots)
+{
+    std::sort(slots.begin(), slots.end(), [&](GLuint a, GLuint b)
+    {
+        float depthA = glm::dot((bvh.bounds[a].min + bvh.bounds[a].max) * 0.5f - viewPosition, viewDirection);
+        float depthB = glm::dot((bvh.bounds[b].min + bvh.bounds[b].max) * 0.5f - viewPosition, viewDirection);
+        return depthA < depthB;
+    });
+}
+
+
+void UCreateSampleCounter(GLSampleCounter& counter)
+{
+    glGenQueries(2, counter.queries);
+    counter.isPending[0] = counter.isPending[1] = false;
+    counter.frame = 0;
+}
+
+
+// Collects the outstanding results, then deletes the queries
+void UDestroySampleCounter(GLSampleCounter& counter)
+{
+    UCollectSampleCount(counter, 0);
+    UCollectSampleCount(counter, 1);
+    glDeleteQueries(2, counter.queries);
+}
+
+
+// Picks up the count of the frame before last, which used the same query, and starts counting this frame's
+void UBeginSampleCount(GLSampleCounter& counter)
+{
+    unsigned slot = counter.frame & 1;
+    UCollectSampleCount(counter, slot);
+    glBeginQuery(GL_SAMPLES_PASSED, counter.queries[slot]);
+}
+
+
+void UEndSampleCount(GLSampleCounter& counter)
+{
+    glEndQuery(GL_SAMPLES_PASSED);
+    counter.isPending[counter.frame & 1] = true;
+    ++counter.frame;
+}
+
+
+void UCollectSampleCount(GLSampleCounter& counter, unsigned slot)
+{
+    if (!counter.isPending[slot])
+        return;
+
+    GLuint64 samples = 0;
+    glGetQueryObjectui64v(counter.queries[slot], GL_QUERY_RESULT, &samples);
+    counter.isPending[slot] = false;
+    gRenderStats.shadedSamples += samples;
+    ++gRenderStats.sampledFrames;
+}
+
+
+// Creates the occlusion culling programs and buffers; the pyramid textures follow the framebuffer size
+bool UCreateOcclusionCulling(GLOcclusionCulling& occlusion, const GLIndirectDraws& draws)
+{
+    char lodHeader[64];
+    snprintf(lodHeader, sizeof(lodHeader), "#define MAX_LOD_LEVELS %u\n", MAX_LOD_LEVELS);
+
+    // Submit all four before checking any, so they compile together
+    ShaderProgramBuild builds[4];
+    UBeginComputeProgram(hiZDepthComputeShaderSource, builds[0]);
+    UBeginComputeProgram(hiZDownsampleComputeShaderSource, builds[1]);
+    UBeginComputeProgram(UShaderWithHeader(occlusionCullComputeShaderSource, lodHeader).c_str(), builds[2]);
+    UBeginComputeProgram(UShaderWithHeader(occlusionCommandComputeShaderSource, lodHeader).c_str(), builds[3]);
+
+    bool isDepthOk = UFinishProgram(builds[0], occlusion.depthProgram);
+    bool isDownsampleOk = UFinishProgram(builds[1], occlusion.downsampleProgram);
+    bool isCullOk = UFinishProgram(builds[2], occlusion.cullProgram);
+    bool isCommandOk = UFinishProgram(builds[3], occlusion.commandProgram);
+    if (!isDepthOk || !isDownsampleOk || !isCullOk || !isCommandOk)
+    {
+        cout << "Occlusion culling is not available" << endl;
+        return false;
+    }
+
+    UUseProgram(occlusion.depthProgram);
+    glUniform1i(UGetUniformLocation(occlusion.depthProgram, "uDepth"), OCCLUSION_TEXTURE_UNIT);
+
+    UUseProgram(occlusion.cullProgram);
+    glUniform1i(UGetUniformLocation(occlusion.cullProgram, "uHiZ"), OCCLUSION_TEXTURE_UNIT);
+    occlusion.cullViewProjection = UGetUniformLocation(occlusion.cullProgram, "uViewProjection");
+    occlusion.cullMeshModel = UGetUniformLocation(occlusion.cullProgram, "uMeshModel");
+    occlusion.cullBoundsMin = UGetUniformLocation(occlusion.cullProgram, "uBoundsMin");
+    occlusion.cullBoundsMax = UGetUniformLocation(occlusion.cullProgram, "uBoundsMax");
+    occlusion.cullCandidateCount = UGetUniformLocation(occlusion.cullProgram, "uCandidateCount");
+    occlusion.cullLodBuckets = UGetUniformLocation(occlusion.cullProgram, "uLodBuckets");
+
+    occlusion.commandLodBuckets = UGetUniformLocation(occlusion.commandProgram, "uLodBuckets");
+    occlusion.commandCount = UGetUniformLocation(occlusion.commandProgram, "uCommandCount");
+    UUseProgram(0);
+
+    occlusion.depthTexture = 0;
+    occlusion.hiZTexture = 0;
+    occlusion.width = 0;
+    occlusion.height = 0;
+    occlusion.hasPyramid = false;
+
+    glGenBuffers(1, &occlusion.instanceBuffer);
+    occlusion.instanceCapacity = 0;
+
+    // The command buffer starts as a copy of the indirect path's; the GPU only rewrites instance ranges
+    GLsizeiptr commandSize = draws.commands.size() * sizeof(DrawElementsIndirectCommand);
+    glGenBuffers(1, &occlusion.commandBuffer);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, commandSize, draws.commands.data(), GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &occlusion.counterBuffer);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.counterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_LOD_LEVELS * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+    glGenBuffers(1, &occlusion.readbackBuffer);
+    UBindBuffer(GL_COPY_WRITE_BUFFER, occlusion.readbackBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, MAX_LOD_LEVELS * sizeof(GLuint), NULL, GL_STREAM_READ);
+    occlusion.readbackFence = 0;
+    occlusion.readbackCandidates = 0;
+
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return true;
+}
+
+
+void UDestroyOcclusionCulling(GLOcclusionCulling& occlusion)
+{
+    UDestroyShaderProgram(occlusion.depthProgram);
+    UDestroyShaderProgram(occlusion.downsampleProgram);
+    UDestroyShaderProgram(occlusion.cullProgram);
+    UDestroyShaderProgram(occlusion.commandProgram);
+    UResizeHiZ(occlusion, 0, 0);
+    UDeleteBuffers(1, &occlusion.instanceBuffer);
+    UDeleteBuffers(1, &occlusion.commandBuffer);
+    UDeleteBuffers(1, &occlusion.counterBuffer);
+    UDeleteBuffers(1, &occlusion.readbackBuffer);
+    if (occlusion.readbackFence)
+        glDeleteSync(occlusion.readbackFence);
+}
+
+
+// (Re)creates the depth copy and pyramid for a framebuffer size; a size of 0 just releases them
+void UResizeHiZ(GLOcclusionCulling& occlusion, GLsizei width, GLsizei height)
+{
+    UDeleteTextures(1, &occlusion.depthTexture);
+    UDeleteTextures(1, &occlusion.hiZTexture);
+    occlusion.depthTexture = 0;
+    occlusion.hiZTexture = 0;
+    occlusion.width = width;
+    occlusion.height = height;
+    occlusion.hasPyramid = false;
+    if (width == 0 || height == 0)
+        return;
+
+    occlusion.levelCount = 1;
+    while ((std::max(width, height) >> occlusion.levelCount) > 0)
+        ++occlusion.levelCount;
+
+    glGenTextures(1, &occlusion.depthTexture);
+    UBindTexture(OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, occlusion.depthTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenTextures(1, &occlusion.hiZTexture);
+    UBindTexture(OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, occlusion.hiZTexture);
+    glTexStorage2D(GL_TEXTURE_2D, occlusion.levelCount, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+
+// Copies the frame's depth buffer and reduces it to a max-depth pyramid for the next frame's test
+void UBuildHiZ(GLOcclusionCulling& occlusion, const glm::mat4& viewProjection)
+{
+    if (occlusion.width != gFramebufferWidth || occlusion.height != gFramebufferHeight)
+        UResizeHiZ(occlusion, gFramebufferWidth, gFramebufferHeight);
+
+    // Depth buffers cannot be bound as images, so the copy goes through a depth texture
+    UBindTexture(OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, occlusion.depthTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, occlusion.width, occlusion.height);
+
+    UUseProgram(occlusion.depthProgram);
+    glBindImageTexture(1, occlusion.hiZTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glDispatchCompute((occlusion.width + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE, (occlusion.height + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE, 1);
+
+    UUseProgram(occlusion.downsampleProgram);
+    for (GLsizei level = 1; level < occlusion.levelCount; ++level)
+    {
+        GLsizei levelWidth = std::max(occlusion.width >> level, 1);
+        GLsizei levelHeight = std::max(occlusion.height >> level, 1);
+
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        glBindImageTexture(0, occlusion.hiZTexture, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, occlusion.hiZTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((levelWidth + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE, (levelHeight + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE, 1);
+    }
+
+    // The cull pass samples the pyramid with texelFetch
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    UUseProgram(0);
+
+    occlusion.viewProjection = viewProjection;
+    occlusion.hasPyramid = true;
+}
+
+
+// Tests the frustum-visible houses (the visible instance buffer, bucketed by level) against the pyramid,
+// compacts the survivors and writes the indirect commands that draw them
+void UCullOcclusion(GLOcclusionCulling& occlusion, const GLuint lodBuckets[], const BoundingBox& meshBounds, const glm::mat4& meshModel)
+{
+    GLuint candidateCount = lodBuckets[MAX_LOD_LEVELS];
+
+    // Stats from an earlier frame, once the GPU is done with it; the render thread never waits for them
+    if (occlusion.readbackFence)
+    {
+        GLenum status = glClientWaitSync(occlusion.readbackFence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+        {
+            GLuint counts[MAX_LOD_LEVELS];
+            UBindBuffer(GL_COPY_READ_BUFFER, occlusion.readbackBuffer);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(counts), counts);
+            UBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+            GLuint passed = 0;
+            for (GLuint level = 0; level < MAX_LOD_LEVELS; ++level)
+                passed += counts[level];
+            gCullStats.occludedInstances = occlusion.readbackCandidates - passed;
+            gRenderStats.occludedInstances += gCullStats.occludedInstances;
+
+            glDeleteSync(occlusion.readbackFence);
+            occlusion.readbackFence = 0;
+        }
+    }
+
+    if (candidateCount > occlusion.instanceCapacity)
+    {
+        occlusion.instanceCapacity = std::max<size_t>(occlusion.instanceCapacity * 2, candidateCount);
+        UBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.instanceBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, occlusion.instanceCapacity * sizeof(GLInstanceData), NULL, GL_DYNAMIC_COPY);
+    }
+
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusion.counterBuffer);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    UBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    UBindBufferRange(GL_SHADER_STORAGE_BUFFER, OCCLUSION_CANDIDATE_BINDING, gVisibleInstanceBlock.buffer, gVisibleInstanceBlock.offset, gVisibleInstanceBlock.size);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_VISIBLE_BINDING, occlusion.instanceBuffer);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_COUNTER_BINDING, occlusion.counterBuffer);
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, OCCLUSION_COMMAND_BINDING, occlusion.commandBuffer);
+
+    UBindTexture(OCCLUSION_TEXTURE_UNIT, GL_TEXTURE_2D, occlusion.hiZTexture);
+
+    UUseProgram(occlusion.cullProgram);
+    glUniformMatrix4fv(occlusion.cullViewProjection, 1, GL_FALSE, glm::value_ptr(occlusion.viewProjection));
+    glUniformMatrix4fv(occlusion.cullMeshModel, 1, GL_FALSE, glm::value_ptr(meshModel));
+    glUniform3fv(occlusion.cullBoundsMin, 1, glm::value_ptr(meshBounds.min));
+    glUniform3fv(occlusion.cullBoundsMax, 1, glm::value_ptr(meshBounds.max));
+    glUniform1ui(occlusion.cullCandidateCount, candidateCount);
+    glUniform1uiv(occlusion.cullLodBuckets, MAX_LOD_LEVELS + 1, lodBuckets);
+    gRenderStats.uniformUploads += 6;
+    glDispatchCompute((candidateCount + OCCLUSION_GROUP_SIZE - 1) / OCCLUSION_GROUP_SIZE, 1, 1);
+
+    GLuint commandCount = static_cast<GLuint>(gIndirectDraws.commands.size());
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    UUseProgram(occlusion.commandProgram);
+    glUniform1uiv(occlusion.commandLodBuckets, MAX_LOD_LEVELS + 1, lodBuckets);
+    glUniform1ui(occlusion.commandCount, commandCount);
+    gRenderStats.uniformUploads += 2;
+    glDispatchCompute((commandCount + OCCLUSION_GROUP_SIZE - 1) / OCCLUSION_GROUP_SIZE, 1, 1);
+
+    // Keep a copy of the counts for the stats, read back once a later frame finds it ready
+    if (!occlusion.readbackFence)
+    {
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        UBindBuffer(GL_COPY_READ_BUFFER, occlusion.counterBuffer);
+        UBindBuffer(GL_COPY_WRITE_BUFFER, occlusion.readbackBuffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, MAX_LOD_LEVELS * sizeof(GLuint));
+        UBindBuffer(GL_COPY_READ_BUFFER, 0);
+        UBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        occlusion.readbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        occlusion.readbackCandidates = candidateCount;
+    }
+}
+
+
+// Draws the houses that passed the Hi-Z test with the commands the GPU wrote for them
+void URenderPartsOcclusionCulled(const GLOcclusionCulling& occlusion, bool isDepthOnly)
+{
+    UBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, gIndirectDraws.drawDataBuffer);
+    UBindVertexBuffer(INSTANCE_BINDING, occlusion.instanceBuffer, 0, sizeof(GLInstanceData));
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, occlusion.commandBuffer);
+
+    // Levels a part does not have use its coarsest indices, so each command draws exactly its own bucket.
+    // The instance counts stay on the GPU, so these draws add nothing to the index stats.
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+    UDrawIndirectBatches(gIndirectDraws, isDepthOnly);
+
+    UBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+// Decodes an image file and flips it to OpenGL's bottom-up row order
+unsigned char* ULoadImage(const char* filename, int& width, int& height, int& channels, int desiredChannels)
+{
+    unsigned char* image = stbi_load(filename, &width, &height, &channels, desiredChannels);
+    if (image)
+    {
+        if (desiredChannels != 0)
+            channels = desiredChannels;
+        flipImageVertically(image, width, height, channels);
+    }
+
+    return image;
+}
+
+/*Generate and load the texture*/
+bool UCreateTexture(const char* filename, GLuint& textureId)
+{
+    int width, height, channels;
+    unsigned char* image = ULoadImage(filename, width, height, channels, 4);
+    if (image)
+    {
+        glGenTextures(1, &textureId);
+        UBindTexture(0, GL_TEXTURE_2D, textureId);
+
+        // set the texture wrapping parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // set texture filtering parameters
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        // The mip chain is built on the CPU, so every driver gets the same levels
+        std::vector<unsigned char> mips = UBuildMipChain(image, width, height, gMipFilter);
+        GLsizei levels = UMipLevelCount(width, height);
+        glTexStorage2D(GL_TEXTURE_2D, levels, GL_RGBA8, width, height);
+        UPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        size_t offset = 0;
+        for (GLsizei level = 0; level < levels; ++level)
+        {
+            GLsizei levelWidth = std::max(width >> level, 1);
+            GLsizei levelHeight = std::max(height >> level, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, levelWidth, levelHeight, GL_RGBA, GL_UNSIGNED_BYTE, mips.data() + offset);
+            offset += static_cast<size_t>(levelWidth) * levelHeight * 4;
+        }
+        UPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+        stbi_image_free(image);
+        UBindTexture(0, GL_TEXTURE_2D, 0); // Unbind the texture
+
+        return true;
+    }
+
+
+    // Error loading the image
+    return false;
+}
+
+/* Generate a texture array with one layer per image
+ * Every image is resampled to a common square power-of-two size: the size class of the
+ * largest image, capped at MAX_TEXTURE_LAYER_SIZE, so the whole scene binds as one texture.
+ * Layers baked into the compressed cache load from it directly; otherwise decoding, flipping
+ * and resampling run on gThreadPool, and this thread only streams finished layers through a
+ * pixel buffer object into the texture.
+ */
+bool UCreateTextureArray(const char* const filenames[], GLsizei layerCount, GLuint& textureId)
+{
+    int layerSize = UTextureLayerSize(filenames, layerCount);
+    if (layerSize == 0)
+        return false;
+
+    if (ULoadCompressedTextureArray(filenames, layerCount, layerSize, textureId))
+        return true;
+
+    std::vector<std::future<std::vector<unsigned char>>> decodes;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        const char* filename = filenames[layer];
+        decodes.push_back(gThreadPool.Submit([filename, layerSize] { return UDecodeTextureLayer(filename, layerSize); }));
+    }
+
+    GLsizei levels = UMipLevelCount(layerSize, layerSize);
+
+    glGenTextures(1, &textureId);
+    UBindTexture(0, GL_TEXTURE_2D_ARRAY, textureId);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, layerSize, layerSize, layerCount);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // One pixel buffer region per layer and its mip chain, so each upload can start as soon as its decode is done
+    GLsizeiptr layerBytes = 0;
+    for (GLsizei level = 0; level < levels; ++level)
+        layerBytes += static_cast<GLsizeiptr>(std::max(layerSize >> level, 1)) * std::max(layerSize >> level, 1) * 4;
+    GLuint pixelBuffer;
+    glGenBuffers(1, &pixelBuffer);
+    UBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, layerBytes * layerCount, NULL, GL_STREAM_DRAW);
+
+    // Upload layers in the order their decodes finish
+    bool isLoaded = true;
+    std::vector<GLsizei> pending;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+        pending.push_back(layer);
+
+    while (!pending.empty())
+    {
+        // Nothing finished yet: block on the oldest decode instead of spinning
+        auto ready = std::find_if(pending.begin(), pending.end(), [&decodes](GLsizei layer) {
+            return decodes[layer].wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        if (ready == pending.end())
+            ready = pending.begin();
+
+        GLsizei layer = *ready;
+        pending.erase(ready);
+
+        std::vector<unsigned char> pixels = decodes[layer].get();
+        if (pixels.empty())
+        {
+            cout << "Failed to load texture " << filenames[layer] << endl;
+            isLoaded = false;
+            continue;
+        }
+
+        void* destination = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, layerBytes * layer, layerBytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (!destination)
+        {
+            // The remaining layers would fail the same way
+            cout << "Failed to map the pixel buffer for texture " << filenames[layer] << endl;
+            isLoaded = false;
+            break;
+        }
+        memcpy(destination, pixels.data(), layerBytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        GLsizeiptr offset = layerBytes * layer;
+        for (GLsizei level = 0; level < levels; ++level)
+        {
+            GLsizei levelSize = std::max(layerSize >> level, 1);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                (void*)offset);
+            offset += static_cast<GLsizeiptr>(levelSize) * levelSize * 4;
+        }
+    }
+
+    UBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    UDeleteBuffers(1, &pixelBuffer);
+
+    UBindTexture(0, GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
+
+    if (!isLoaded)
+    {
+        UDeleteTextures(1, &textureId);
+        textureId = 0;
+    }
+    return isLoaded;
+}
+
+// Decodes, flips and resamples one texture layer and builds its mip chain; runs on a worker thread, so no GL calls
+std::vector<unsigned char> UDecodeTextureLayer(const char* filename, int layerSize)
+{
+    std::vector<unsigned char> layerPixels;
+
+    int width, height, channels;
+    unsigned char* image = ULoadImage(filename, width, height, channels, 4);
+    if (image)
+    {
+        std::vector<unsigned char> resized(static_cast<size_t>(layerSize) * layerSize * 4);
+        UResizeImage(image, width, height, resized.data(), layerSize, layerSize, 4);
+        stbi_image_free(image);
+        layerPixels = UBuildMipChain(resized.data(), layerSize, layerSize, gMipFilter);
+    }
+
+    return layerPixels;
+}
+
+// The common layer size of a set of images; only the headers are read, so it is known before any decode
+// starts. Returns 0 if an image cannot be read.
+int UTextureLayerSize(const char* const filenames[], GLsizei layerCount)
+{
+    int largestEdge = 1;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        int width, height, channels;
+        if (!stbi_info(filenames[layer], &width, &height, &channels))
+        {
+            cout << "Failed to load texture " << filenames[layer] << endl;
+            return 0;
+        }
+        largestEdge = std::max(largestEdge, std::max(width, height));
+    }
+
+    int layerSize = 1;
+    while (layerSize < largestEdge && layerSize < MAX_TEXTURE_LAYER_SIZE)
+        layerSize *= 2;
+
+    return layerSize;
+}
+
+
+// FNV-1a hash of a source image's bytes, the layer size and mip filter it is baked with and the cache version;
+// a cache file only loads if it was baked from the same hash
+bool UHashTextureSource(const char* filename, int layerSize, uint64_t& hash)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    hash = 14695981039346656037ULL;
+    auto mix = [&hash](unsigned char byte) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    };
+
+    char buffer[1 << 16];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+    {
+        for (std::streamsize i = 0; i < file.gcount(); ++i)
+            mix(static_cast<unsigned char>(buffer[i]));
+    }
+
+    const uint64_t parameters[3] = { static_cast<uint64_t>(layerSize), static_cast<uint64_t>(gMipFilter), TEXTURE_CACHE_VERSION };
+    for (uint64_t parameter : parameters)
+    {
+        for (int byte = 0; byte < 8; ++byte)
+            mix(static_cast<unsigned char>(parameter >> (byte * 8)));
+    }
+
+    return true;
+}
+
+
+/* Compresses every image, with its CPU-built mip chain, into a KTX2 file next to it
+ * Layers are BC1, or BC3 if any image has transparency (a texture array has a single format).
+ * Decoding and compression run on gThreadPool.
+ */
+bool UBakeTextures(const char* const filenames[], GLsizei layerCount)
+{
+    int layerSize = UTextureLayerSize(filenames, layerCount);
+    if (layerSize == 0)
+        return false;
+
+    std::vector<std::future<std::vector<unsigned char>>> decodes;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        const char* filename = filenames[layer];
+        decodes.push_back(gThreadPool.Submit([filename, layerSize] { return UDecodeTextureLayer(filename, layerSize); }));
+    }
+
+    std::vector<std::vector<unsigned char>> layers;
+    bool hasAlpha = false;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        layers.push_back(decodes[layer].get());
+        if (layers.back().empty())
+        {
+            cout << "Failed to load texture " << filenames[layer] << endl;
+            return false;
+        }
+        for (size_t i = 3; i < layers.back().size() && !hasAlpha; i += 4)
+            hasAlpha = layers.back()[i] != 255;
+    }
+
+    GLenum format = hasAlpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    std::vector<std::future<bool>> bakes;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        const char* filename = filenames[layer];
+        std::vector<unsigned char>* pixels = &layers[layer];
+        bakes.push_back(gThreadPool.Submit([filename, pixels, layerSize, format] {
+            uint64_t hash;
+            if (!UHashTextureSource(filename, layerSize, hash))
+                return false;
+            CompressedImage image = UCompressImage(*pixels, layerSize, format);
+            return UWriteKtx2(std::string(filename) + TEXTURE_CACHE_EXTENSION, hash, image);
+        }));
+    }
+
+    bool isBaked = true;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        if (!bakes[layer].get())
+        {
+            cout << "Failed to write the texture cache of " << filenames[layer] << endl;
+            isBaked = false;
+        }
+    }
+
+    if (isBaked)
+        cout << "Baked " << layerCount << " textures as " << (hasAlpha ? "BC3" : "BC1") << " at " << layerSize << "x" << layerSize << endl;
+    return isBaked;
+}
+
+
+/* Loads the texture array from the compressed cache
+ * Every layer must have a cache file baked from its current source, at the current layer size and in
+ * one shared format; anything else leaves the array to the decoding path. Files are read and checked
+ * on gThreadPool.
+ */
+bool ULoadCompressedTextureArray(const char* const filenames[], GLsizei layerCount, int layerSize, GLuint& textureId)
+{
+    if (!GLEW_EXT_texture_compression_s3tc)
+        return false;
+
+    std::vector<std::future<CompressedImage>> reads;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        const char* filename = filenames[layer];
+        reads.push_back(gThreadPool.Submit([filename, layerSize] {
+            CompressedImage image = {};
+            uint64_t hash;
+            if (!UHashTextureSource(filename, layerSize, hash)
+                || !UReadKtx2(std::string(filename) + TEXTURE_CACHE_EXTENSION, hash, image))
+                image.format = 0;
+            return image;
+        }));
+    }
+
+    std::vector<CompressedImage> images;
+    bool isCached = true;
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        images.push_back(reads[layer].get());
+        const CompressedImage& image = images.back();
+        if (image.format == 0 || image.format != images.front().format || image.size != layerSize)
+            isCached = false;
+    }
+
+    if (!isCached)
+    {
+        cout << "The compressed texture cache is missing or stale, decoding the source images (run with --bake-textures to rebuild it)" << endl;
+        return false;
+    }
+
+    GLsizei levels = static_cast<GLsizei>(images.front().levelOffsets.size());
+    glGenTextures(1, &textureId);
+    UBindTexture(0, GL_TEXTURE_2D_ARRAY, textureId);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, images.front().format, layerSize, layerSize, layerCount);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // The mips were baked with the layers, so there is no glGenerateMipmap here
+    for (GLsizei layer = 0; layer < layerCount; ++layer)
+    {
+        const CompressedImage& image = images[layer];
+        for (GLsizei level = 0; level < levels; ++level)
+        {
+            GLsizei levelSize = std::max(layerSize >> level, 1);
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, levelSize, levelSize, 1, image.format,
+                static_cast<GLsizei>(image.levelSizes[level]), image.data.data() + image.levelOffsets[level]);
+        }
+    }
+    UBindTexture(0, GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
+
+    cout << "Loaded " << layerCount << " textures from the compressed cache" << endl;
+    return true;
+}
+
+
+// Block-compresses every level of a square RGBA mip chain
+CompressedImage UCompressImage(const std::vector<unsigned char>& mips, int size, GLenum format)
+{
+    const size_t blockBytes = format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+
+    CompressedImage image;
+    image.format = format;
+    image.size = size;
+
+    const unsigned char* pixels = mips.data();
+    for (int levelSize = size; ; levelSize /= 2)
+    {
+        // Levels under 4x4 still take one whole block; their edge texels are repeated into it
+        int blocks = (levelSize + 3) / 4;
+        image.levelOffsets.push_back(image.data.size());
+        image.levelSizes.push_back(blocks * blocks * blockBytes);
+        image.data.resize(image.data.size() + blocks * blocks * blockBytes);
+
+        for (int blockY = 0; blockY < blocks; ++blockY)
+        {
+            for (int blockX = 0; blockX < blocks; ++blockX)
+            {
+                unsigned char block[64];
+                for (int i = 0; i < 16; ++i)
+                {
+                    int x = std::min(blockX * 4 + i % 4, levelSize - 1);
+                    int y = std::min(blockY * 4 + i / 4, levelSize - 1);
+                    memcpy(block + i * 4, &pixels[(static_cast<size_t>(y) * levelSize + x) * 4], 4);
+                }
+
+                unsigned char* output = &image.data[image.levelOffsets.back() + (blockY * blocks + blockX) * blockBytes];
+                if (blockBytes == 16)
+                {
+                    UCompressBc3AlphaBlock(block, output);
+                    output += 8;
+                }
+                UCompressBc1Block(block, output);
+            }
+        }
+
+        if (levelSize == 1)
+            break;
+        pixels += static_cast<size_t>(levelSize) * levelSize * 4;
+    }
+
+    return image;
+}
+
+
+// Compresses the colors of a 4x4 RGBA block into a BC1 block: two RGB565 endpoints on the colors'
+// principal axis, and 2-bit indices into the four-color palette between them
+void UCompressBc1Block(const unsigned char pixels[64], unsigned char* output)
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+            mean[c] += pixels[i * 4 + c] / 16.0f;
+    }
+
+    // Covariance of the colors: xx, xy, xz, yy, yz, zz
+    float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    for (int i = 0; i < 16; ++i)
+    {
+        float r = pixels[i * 4] - mean[0];
+        float g = pixels[i * 4 + 1] - mean[1];
+        float b = pixels[i * 4 + 2] - mean[2];
+        covariance[0] += r * r;
+        covariance[1] += r * g;
+        covariance[2] += r * b;
+        covariance[3] += g * g;
+        covariance[4] += g * b;
+        covariance[5] += b * b;
+    }
+
+    // A few power iterations are enough to find the dominant axis of 16 colors
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iteration = 0; iteration < 4; ++iteration)
+    {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+        };
+        float largest = std::max(std::fabs(next[0]), std::max(std::fabs(next[1]), std::fabs(next[2])));
+        if (largest < 1e-6f)
+            break;
+        for (int c = 0; c < 3; ++c)
+            axis[c] = next[c] / largest;
+    }
+
+    // The block's extreme colors along the axis become the endpoints
+    int minPixel = 0;
+    int maxPixel = 0;
+    float minDot = 0.0f;
+    float maxDot = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        float dot = pixels[i * 4] * axis[0] + pixels[i * 4 + 1] * axis[1] + pixels[i * 4 + 2] * axis[2];
+        if (i == 0 || dot < minDot)
+        {
+            minDot = dot;
+            minPixel = i;
+        }
+        if (i == 0 || dot > maxDot)
+        {
+            maxDot = dot;
+            maxPixel = i;
+        }
+    }
+
+    auto toRgb565 = [pixels](int i) {
+        return static_cast<uint16_t>(((pixels[i * 4] * 31 + 127) / 255) << 11
+            | ((pixels[i * 4 + 1] * 63 + 127) / 255) << 5
+            | (pixels[i * 4 + 2] * 31 + 127) / 255);
+    };
+    uint16_t color0 = toRgb565(maxPixel);
+    uint16_t color1 = toRgb565(minPixel);
+
+    // The four-color palette is only used while color0 > color1
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        int palette[4][3];
+        const uint16_t endpoints[2] = { color0, color1 };
+        for (int e = 0; e < 2; ++e)
+        {
+            int r = endpoints[e] >> 11;
+            int g = (endpoints[e] >> 5) & 63;
+            int b = endpoints[e] & 31;
+            palette[e][0] = (r << 3) | (r >> 2);
+            palette[e][1] = (g << 2) | (g >> 4);
+            palette[e][2] = (b << 3) | (b >> 2);
+        }
+        for (int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int bestIndex = 0;
+            int bestError = 0;
+            for (int index = 0; index < 4; ++index)
+            {
+                int error = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int difference = pixels[i * 4 + c] - palette[index][c];
+                    error += difference * difference;
+                }
+                if (index == 0 || error < bestError)
+                {
+                    bestError = error;
+                    bestIndex = index;
+                }
+            }
+            indices |= static_cast<uint32_t>(bestIndex) << (i * 2);
+        }
+    }
+
+    output[0] = static_cast<unsigned char>(color0);
+    output[1] = static_cast<unsigned char>(color0 >> 8);
+    output[2] = static_cast<unsigned char>(color1);
+    output[3] = static_cast<unsigned char>(color1 >> 8);
+    for (int byte = 0; byte < 4; ++byte)
+        output[4 + byte] = static_cast<unsigned char>(indices >> (byte * 8));
+}
+
+
+// Compresses the alpha of a 4x4 RGBA block into the first half of a BC3 block: the block's alpha range
+// and 3-bit indices into the eight values spread across it
+void UCompressBc3AlphaBlock(const unsigned char pixels[64], unsigned char* output)
+{
+    int alpha0 = 0;
+    int alpha1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        alpha0 = std::max(alpha0, static_cast<int>(pixels[i * 4 + 3]));
+        alpha1 = std::min(alpha1, static_cast<int>(pixels[i * 4 + 3]));
+    }
+
+    // Index 0 is alpha0, 1 is alpha1 and 2-7 step from alpha0 to alpha1
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        int palette[8] = { alpha0, alpha1 };
+        for (int step = 1; step < 7; ++step)
+            palette[step + 1] = ((7 - step) * alpha0 + step * alpha1) / 7;
 
-    GLfloat frontDoor[] = {
-        -0.9f, -0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -0.9f, 0.35f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -0.7f, 0.35f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -0.7f, -0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+        for (int i = 0; i < 16; ++i)
+        {
+            int bestIndex = 0;
+            for (int index = 1; index < 8; ++index)
+            {
+                if (std::abs(pixels[i * 4 + 3] - palette[index]) < std::abs(pixels[i * 4 + 3] - palette[bestIndex]))
+                    bestIndex = index;
+            }
+            indices |= static_cast<uint64_t>(bestIndex) << (i * 3);
+        }
+    }
+
+    output[0] = static_cast<unsigned char>(alpha0);
+    output[1] = static_cast<unsigned char>(alpha1);
+    for (int byte = 0; byte < 6; ++byte)
+        output[2 + byte] = static_cast<unsigned char>(indices >> (byte * 8));
+}
+
+
+/* Writes a compressed image as a KTX 2.0 file
+ * Layout: identifier, header, index, level index, data format descriptor, one key/value entry
+ * holding the source hash, then the levels, smallest first as the format requires.
+ */
+bool UWriteKtx2(const std::string& path, uint64_t sourceHash, const CompressedImage& image)
+{
+    const bool isBc3 = image.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    const uint32_t blockBytes = isBc3 ? 16 : 8;
+    const uint32_t levelCount = static_cast<uint32_t>(image.levelOffsets.size());
+
+    std::vector<unsigned char> file;
+    auto append32 = [&file](uint32_t value) {
+        for (int byte = 0; byte < 4; ++byte)
+            file.push_back(static_cast<unsigned char>(value >> (byte * 8)));
+    };
+    auto append64 = [&file](uint64_t value) {
+        for (int byte = 0; byte < 8; ++byte)
+            file.push_back(static_cast<unsigned char>(value >> (byte * 8)));
+    };
+    auto set64 = [&file](size_t offset, uint64_t value) {
+        for (int byte = 0; byte < 8; ++byte)
+            file[offset + byte] = static_cast<unsigned char>(value >> (byte * 8));
     };
 
-    GLushort frontDoorIndices[] = {
-        0,1,2,
-        2,0,3,
-        3,2,1
+    const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    file.insert(file.end(), identifier, identifier + sizeof(identifier));
+
+    // Header: vkFormat, typeSize, width, height, depth, layers, faces, levels, supercompression
+    append32(isBc3 ? VK_FORMAT_BC3_UNORM_BLOCK : VK_FORMAT_BC1_RGB_UNORM_BLOCK);
+    append32(1);
+    append32(image.size);
+    append32(image.size);
+    append32(0);
+    append32(0);
+    append32(1);
+    append32(levelCount);
+    append32(0);
+
+    // Index: data format descriptor, key/value data and supercompression data ranges
+    const uint32_t sampleCount = isBc3 ? 2 : 1;
+    const uint32_t dfdOffset = 80 + levelCount * 24;
+    const uint32_t dfdLength = 4 + 24 + 16 * sampleCount;
+    char hashText[17];
+    snprintf(hashText, sizeof(hashText), "%016llx", static_cast<unsigned long long>(sourceHash));
+    const uint32_t keyValueLength = static_cast<uint32_t>(strlen(TEXTURE_CACHE_HASH_KEY) + 1 + strlen(hashText) + 1);
+    const uint32_t keyValuePadding = (4 - keyValueLength % 4) % 4;
+    append32(dfdOffset);
+    append32(dfdLength);
+    append32(dfdOffset + dfdLength);
+    append32(4 + keyValueLength + keyValuePadding);
+    append64(0);
+    append64(0);
+
+    // Level index, base level first; the offsets are filled in once the data is placed
+    const size_t levelIndexOffset = file.size();
+    for (uint32_t level = 0; level < levelCount; ++level)
+    {
+        append64(0);
+        append64(image.levelSizes[level]);
+        append64(image.levelSizes[level]);
+    }
+
+    // Basic data format descriptor: BC1 color, or BC3 alpha and color, linear BT.709
+    append32(dfdLength);
+    append32(0);
+    append32(2 | (24 + 16 * sampleCount) << 16);
+    append32((isBc3 ? 130 : 128) | 1 << 8 | 1 << 16);
+    append32(3 | 3 << 8);
+    append32(blockBytes);
+    append32(0);
+    if (isBc3)
+    {
+        append32(0 | 63 << 16 | 15 << 24);
+        append32(0);
+        append32(0);
+        append32(0xFFFFFFFF);
+    }
+    append32((isBc3 ? 64 : 0) | 63 << 16);
+    append32(0);
+    append32(0);
+    append32(0xFFFFFFFF);
+
+    // Key/value data; the entry's value padding to 4 bytes counts toward the key/value data length
+    append32(keyValueLength);
+    file.insert(file.end(), TEXTURE_CACHE_HASH_KEY, TEXTURE_CACHE_HASH_KEY + strlen(TEXTURE_CACHE_HASH_KEY) + 1);
+    file.insert(file.end(), hashText, hashText + strlen(hashText) + 1);
+    file.resize(file.size() + keyValuePadding);
+
+    // Levels, smallest first, each aligned to the block size
+    for (uint32_t level = levelCount; level-- > 0;)
+    {
+        file.resize((file.size() + blockBytes - 1) / blockBytes * blockBytes);
+        set64(levelIndexOffset + level * 24, file.size());
+        const unsigned char* levelData = image.data.data() + image.levelOffsets[level];
+        file.insert(file.end(), levelData, levelData + image.levelSizes[level]);
+    }
+
+    std::ofstream output(path, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(file.data()), file.size());
+    return static_cast<bool>(output);
+}
+
+
+// Reads a KTX2 file written by UWriteKtx2; fails on anything else, or if it was baked from a different hash
+bool UReadKtx2(const std::string& path, uint64_t sourceHash, CompressedImage& image)
+{
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (!input)
+        return false;
+
+    std::vector<unsigned char> file(static_cast<size_t>(input.tellg()));
+    input.seekg(0);
+    if (!input.read(reinterpret_cast<char*>(file.data()), file.size()))
+        return false;
+
+    auto read32 = [&file](size_t offset) {
+        uint32_t value = 0;
+        for (int byte = 0; byte < 4; ++byte)
+            value |= static_cast<uint32_t>(file[offset + byte]) << (byte * 8);
+        return value;
+    };
+    auto read64 = [&file](size_t offset) {
+        uint64_t value = 0;
+        for (int byte = 0; byte < 8; ++byte)
+            value |= static_cast<uint64_t>(file[offset + byte]) << (byte * 8);
+        return value;
+    };
+
+    const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    if (file.size() < 80 || memcmp(file.data(), identifier, sizeof(identifier)) != 0)
+        return false;
+
+    uint32_t vkFormat = read32(12);
+    uint32_t width = read32(20);
+    uint32_t levelCount = read32(40);
+    if ((vkFormat != VK_FORMAT_BC1_RGB_UNORM_BLOCK && vkFormat != VK_FORMAT_BC3_UNORM_BLOCK)
+        || width == 0 || read32(24) != width || read32(32) != 0 || read32(36) != 1 || read32(44) != 0
+        || levelCount == 0 || file.size() < 80 + static_cast<size_t>(levelCount) * 24)
+        return false;
+
+    // The source hash is the only key/value entry the cache cares about
+    char hashText[17];
+    snprintf(hashText, sizeof(hashText), "%016llx", static_cast<unsigned long long>(sourceHash));
+    std::string expectedEntry = std::string(TEXTURE_CACHE_HASH_KEY) + '\0' + hashText + '\0';
+    size_t keyValueOffset = read32(56);
+    size_t keyValueLength = read32(60);
+    if (keyValueOffset + keyValueLength > file.size() || keyValueLength < 4 + expectedEntry.size()
+        || read32(keyValueOffset) != expectedEntry.size()
+        || memcmp(&file[keyValueOffset + 4], expectedEntry.data(), expectedEntry.size()) != 0)
+        return false;
+
+    // Only whole mip chains of whole blocks upload
+    const uint64_t blockBytes = vkFormat == VK_FORMAT_BC3_UNORM_BLOCK ? 16 : 8;
+    uint32_t expectedLevels = 1;
+    while ((width >> expectedLevels) > 0)
+        ++expectedLevels;
+    if (levelCount != expectedLevels)
+        return false;
+
+    image.format = vkFormat == VK_FORMAT_BC3_UNORM_BLOCK ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    image.size = static_cast<int>(width);
+    image.data.clear();
+    image.levelOffsets.clear();
+    image.levelSizes.clear();
+    for (uint32_t level = 0; level < levelCount; ++level)
+    {
+        uint64_t offset = read64(80 + level * 24);
+        uint64_t length = read64(80 + level * 24 + 8);
+        uint64_t blocks = ((width >> level) + 3) / 4;
+        if (offset > file.size() || length > file.size() - offset || length != std::max<uint64_t>(blocks, 1) * std::max<uint64_t>(blocks, 1) * blockBytes)
+            return false;
+
+        image.levelOffsets.push_back(image.data.size());
+        image.levelSizes.push_back(static_cast<size_t>(length));
+        image.data.insert(image.data.end(), file.begin() + static_cast<size_t>(offset), file.begin() + static_cast<size_t>(offset + length));
+    }
+
+    return true;
+}
+
+
+// Levels of a full mip chain down to 1x1
+int UMipLevelCount(int width, int height)
+{
+    int levels = 1;
+    while ((std::max(width, height) >> levels) > 0)
+        ++levels;
+    return levels;
+}
+
+
+/* Builds the full mip chain of an 8-bit sRGB RGBA image; the result holds every level, base level first
+ * Color is filtered in linear light and alpha as is, all in integer arithmetic, so scalar, SSE2 and AVX2
+ * builds produce the same bytes on every machine. Levels halve each axis (odd sizes drop their last
+ * texel), as glGenerateMipmap's do.
+ */
+std::vector<unsigned char> UBuildMipChain(const unsigned char* rgba, int width, int height, MipFilter filter)
+{
+    // 15-bit linear to 8-bit sRGB, built once from SRGB_TO_LINEAR in integers: each linear value takes the
+    // code whose decoded value is nearest, so decoding and re-encoding returns every code unchanged
+    struct SrgbTables
+    {
+        unsigned char toSrgb[LINEAR_MAX + 1];
+
+        SrgbTables()
+        {
+            int code = 0;
+            for (int i = 0; i <= LINEAR_MAX; ++i)
+            {
+                while (code < 255 && 2 * i >= SRGB_TO_LINEAR[code] + SRGB_TO_LINEAR[code + 1])
+                    ++code;
+                toSrgb[i] = static_cast<unsigned char>(code);
+            }
+        }
+    };
+    static const SrgbTables tables;
+
+    const MipKernel& kernel = MIP_KERNELS[filter];
+    const int levels = UMipLevelCount(width, height);
+
+    size_t totalBytes = 0;
+    for (int level = 0; level < levels; ++level)
+        totalBytes += static_cast<size_t>(std::max(width >> level, 1)) * std::max(height >> level, 1) * 4;
+
+    std::vector<unsigned char> mips(totalBytes);
+    size_t baseBytes = static_cast<size_t>(width) * height * 4;
+    memcpy(mips.data(), rgba, baseBytes);
+
+    std::vector<int16_t> level(baseBytes);
+    for (size_t i = 0; i < baseBytes; i += 4)
+    {
+        level[i] = SRGB_TO_LINEAR[rgba[i]];
+        level[i + 1] = SRGB_TO_LINEAR[rgba[i + 1]];
+        level[i + 2] = SRGB_TO_LINEAR[rgba[i + 2]];
+        level[i + 3] = static_cast<int16_t>((rgba[i + 3] * LINEAR_MAX + 127) / 255);
+    }
+
+    std::vector<int16_t> rows;
+    size_t offset = baseBytes;
+    int levelWidth = width;
+    int levelHeight = height;
+    for (int next = 1; next < levels; ++next)
+    {
+        // Vertical then horizontal pass; an axis already at 1 texel is passed through
+        int nextWidth = std::max(levelWidth / 2, 1);
+        int nextHeight = std::max(levelHeight / 2, 1);
+
+        if (nextHeight < levelHeight)
+        {
+            rows.resize(static_cast<size_t>(levelWidth) * nextHeight * 4);
+            UDownsampleRows(level.data(), levelWidth, levelHeight, rows.data(), kernel);
+        }
+        else
+            rows = level;
+
+        if (nextWidth < levelWidth)
+        {
+            level.resize(static_cast<size_t>(nextWidth) * nextHeight * 4);
+            UDownsampleColumns(rows.data(), levelWidth, nextHeight, level.data(), kernel);
+        }
+        else
+            level = rows;
+
+        levelWidth = nextWidth;
+        levelHeight = nextHeight;
+
+        unsigned char* destination = mips.data() + offset;
+        for (size_t i = 0; i < level.size(); i += 4)
+        {
+            destination[i] = tables.toSrgb[level[i]];
+            destination[i + 1] = tables.toSrgb[level[i + 1]];
+            destination[i + 2] = tables.toSrgb[level[i + 2]];
+            destination[i + 3] = static_cast<unsigned char>((level[i + 3] * 255 + LINEAR_MAX / 2) / LINEAR_MAX);
+        }
+        offset += level.size();
+    }
+
+    return mips;
+}
+
+
+// Fixed-point sum to a linear value: round, then clamp the kernel's overshoot (as the SIMD saturating packs do)
+inline int16_t UResolveMipSum(int sum)
+{
+    int value = (sum + (1 << (MIP_WEIGHT_BITS - 1))) >> MIP_WEIGHT_BITS;
+    return static_cast<int16_t>(std::min(std::max(value, 0), LINEAR_MAX));
+}
+
+
+// Halves the height of a linear RGBA image: output row y weighs source rows 2y + firstOffset + t, clamped to the edges
+void UDownsampleRows(const int16_t* source, int width, int height, int16_t* destination, const MipKernel& kernel)
+{
+    const int rowElements = width * 4;
+    const int nextHeight = height / 2;
+
+    for (int y = 0; y < nextHeight; ++y)
+    {
+        const int16_t* taps[8];
+        for (int t = 0; t < kernel.tapCount; ++t)
+            taps[t] = source + static_cast<size_t>(std::min(std::max(2 * y + kernel.firstOffset + t, 0), height - 1)) * rowElements;
+        int16_t* output = destination + static_cast<size_t>(y) * rowElements;
+
+        // Each madd weighs a pair of rows: interleaving them puts a texel of both rows side by side
+        int i = 0;
+#ifdef CS330_AVX2
+        for (; gMipSimd >= MIP_SIMD_AVX2 && i + 16 <= rowElements; i += 16)
+        {
+            __m256i sumLow = _mm256_setzero_si256();
+            __m256i sumHigh = _mm256_setzero_si256();
+            for (int t = 0; t < kernel.tapCount; t += 2)
+            {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(taps[t] + i));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(taps[t + 1] + i));
+                __m256i weights = _mm256_set1_epi32(static_cast<int>(static_cast<uint16_t>(kernel.weights[t]) | static_cast<uint32_t>(static_cast<uint16_t>(kernel.weights[t + 1])) << 16));
+                sumLow = _mm256_add_epi32(sumLow, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weights));
+                sumHigh = _mm256_add_epi32(sumHigh, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weights));
+            }
+            const __m256i round = _mm256_set1_epi32(1 << (MIP_WEIGHT_BITS - 1));
+            sumLow = _mm256_srai_epi32(_mm256_add_epi32(sumLow, round), MIP_WEIGHT_BITS);
+            sumHigh = _mm256_srai_epi32(_mm256_add_epi32(sumHigh, round), MIP_WEIGHT_BITS);
+
+            // The unpacks and the pack work within 128-bit lanes, so they cancel out and the order is kept
+            __m256i values = _mm256_max_epi16(_mm256_packs_epi32(sumLow, sumHigh), _mm256_setzero_si256());
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), values);
+        }
+#endif
+#ifdef CS330_SSE
+        for (; gMipSimd >= MIP_SIMD_SSE2 && i + 8 <= rowElements; i += 8)
+        {
+            __m128i sumLow = _mm_setzero_si128();
+            __m128i sumHigh = _mm_setzero_si128();
+            for (int t = 0; t < kernel.tapCount; t += 2)
+            {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[t] + i));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(taps[t + 1] + i));
+                __m128i weights = _mm_set1_epi32(static_cast<int>(static_cast<uint16_t>(kernel.weights[t]) | static_cast<uint32_t>(static_cast<uint16_t>(kernel.weights[t + 1])) << 16));
+                sumLow = _mm_add_epi32(sumLow, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+                sumHigh = _mm_add_epi32(sumHigh, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+            }
+            const __m128i round = _mm_set1_epi32(1 << (MIP_WEIGHT_BITS - 1));
+            sumLow = _mm_srai_epi32(_mm_add_epi32(sumLow, round), MIP_WEIGHT_BITS);
+            sumHigh = _mm_srai_epi32(_mm_add_epi32(sumHigh, round), MIP_WEIGHT_BITS);
+            __m128i values = _mm_max_epi16(_mm_packs_epi32(sumLow, sumHigh), _mm_setzero_si128());
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), values);
+        }
+#endif
+        for (; i < rowElements; ++i)
+        {
+            int sum = 0;
+            for (int t = 0; t < kernel.tapCount; ++t)
+                sum += taps[t][i] * kernel.weights[t];
+            output[i] = UResolveMipSum(sum);
+        }
+    }
+}
+
+
+// Halves the width of a linear RGBA image: output texel x weighs source texels 2x + firstOffset + t, clamped to the edges
+void UDownsampleColumns(const int16_t* source, int width, int height, int16_t* destination, const MipKernel& kernel)
+{
+    const int nextWidth = width / 2;
+
+    // Each row is copied with its edge texels repeated into the padding, so no tap needs a bounds check
+    const int padding = kernel.tapCount;
+    std::vector<int16_t> padded(static_cast<size_t>(width + 2 * padding) * 4);
+
+    for (int y = 0; y < height; ++y)
+    {
+        const int16_t* row = source + static_cast<size_t>(y) * width * 4;
+        for (int x = -padding; x < width + padding; ++x)
+            memcpy(&padded[static_cast<size_t>(x + padding) * 4], row + std::min(std::max(x, 0), width - 1) * 4, 4 * sizeof(int16_t));
+        int16_t* output = destination + static_cast<size_t>(y) * nextWidth * 4;
+
+        for (int x = 0; x < nextWidth; ++x)
+        {
+            const int16_t* texel = &padded[static_cast<size_t>(2 * x + kernel.firstOffset + padding) * 4];
+#ifdef CS330_SSE
+            if (gMipSimd >= MIP_SIMD_SSE2)
+            {
+                // Interleaving two neighbouring texels lets one madd weigh both for all four channels
+                __m128i sum = _mm_setzero_si128();
+                for (int t = 0; t < kernel.tapCount; t += 2)
+                {
+                    __m128i pair = _mm_loadu_si128(reinterpret_cast<const __m128i*>(texel + t * 4));
+                    __m128i interleaved = _mm_unpacklo_epi16(pair, _mm_srli_si128(pair, 8));
+                    __m128i weights = _mm_set1_epi32(static_cast<int>(static_cast<uint16_t>(kernel.weights[t]) | static_cast<uint32_t>(static_cast<uint16_t>(kernel.weights[t + 1])) << 16));
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(interleaved, weights));
+                }
+                sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (MIP_WEIGHT_BITS - 1))), MIP_WEIGHT_BITS);
+                __m128i values = _mm_max_epi16(_mm_packs_epi32(sum, sum), _mm_setzero_si128());
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(output + x * 4), values);
+                continue;
+            }
+#endif
+            for (int c = 0; c < 4; ++c)
+            {
+                int sum = 0;
+                for (int t = 0; t < kernel.tapCount; ++t)
+                    sum += texel[t * 4 + c] * kernel.weights[t];
+                output[x * 4 + c] = UResolveMipSum(sum);
+            }
+        }
+    }
+}
+
+
+// Resamples an 8-bit image to a new size with bilinear filtering
+void UResizeImage(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, int channels)
+{
+    const float scaleX = static_cast<float>(srcWidth) / dstWidth;
+    const float scaleY = static_cast<float>(srcHeight) / dstHeight;
+
+    for (int y = 0; y < dstHeight; ++y)
+    {
+        // Sample at pixel centers, clamped to the image edges
+        float sy = std::max((y + 0.5f) * scaleY - 0.5f, 0.0f);
+        int y0 = std::min(static_cast<int>(sy), srcHeight - 1);
+        int y1 = std::min(y0 + 1, srcHeight - 1);
+        float fy = sy - y0;
+
+        for (int x = 0; x < dstWidth; ++x)
+        {
+            float sx = std::max((x + 0.5f) * scaleX - 0.5f, 0.0f);
+            int x0 = std::min(static_cast<int>(sx), srcWidth - 1);
+            int x1 = std::min(x0 + 1, srcWidth - 1);
+            float fx = sx - x0;
+
+            for (int c = 0; c < channels; ++c)
+            {
+                float top = src[(y0 * srcWidth + x0) * channels + c] * (1.0f - fx) + src[(y0 * srcWidth + x1) * channels + c] * fx;
+                float bottom = src[(y1 * srcWidth + x0) * channels + c] * (1.0f - fx) + src[(y1 * srcWidth + x1) * channels + c] * fx;
+                dst[(y * dstWidth + x) * channels + c] = static_cast<unsigned char>(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
+
+void UDestroyTexture(GLuint textureId)
+{
+    UDeleteTextures(1, &textureId);
+}
+
+// Inserts extra directives (extensions, defines) right after a shader's #version line,
+// since the GLSL macro cannot carry preprocessor lines of its own
+std::string UShaderWithHeader(const char* source, const char* header)
+{
+    std::string shader(source);
+    size_t versionEnd = shader.find('\n') + 1;
+    shader.insert(versionEnd, header);
+    return shader;
+}
+
+// Starts compiling the object shader variant with the given ShaderFeature bits
+void UBeginShaderVariant(GLuint features, ShaderProgramBuild& build)
+{
+    std::string header = "#version 440 core\n";
+    if (features & SHADER_FEATURE_DRAW_PARAMETERS)
+        header += "#extension GL_ARB_shader_draw_parameters : require\n";
+    for (GLuint bit = 0; bit < SHADER_FEATURE_COUNT; ++bit)
+    {
+        if (features & (1u << bit))
+            header += std::string("#define ") + SHADER_FEATURE_NAMES[bit] + "\n";
+    }
+
+    std::string vertexSource = header + objectVertexShaderSource;
+    std::string fragmentSource = header + (features & SHADER_FEATURE_DEPTH_ONLY ? depthOnlyFragmentShaderSource : objectFragmentShaderSource);
+    UBeginShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), build);
+}
+
+
+// Starts compiling a vertex and fragment shader program; UFinishShaderProgram checks it
+void UBeginShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, ShaderProgramBuild& build)
+{
+    const GLenum stages[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    const char* const sources[] = { vtxShaderSource, fragShaderSource };
+    UBeginProgram(stages, sources, 2, build);
+}
+
+
+// Starts compiling a compute-only program; UFinishProgram checks it
+void UBeginComputeProgram(const char* source, ShaderProgramBuild& build)
+{
+    const GLenum stage = GL_COMPUTE_SHADER;
+    UBeginProgram(&stage, &source, 1, build);
+}
+
+
+/* Loads a program from the binary cache, or submits its stages for compiling and linking without waiting
+ * Nothing here reads a compile or link status, which is what would block on the driver.
+ */
+void UBeginProgram(const GLenum stages[], const char* const sources[], GLsizei stageCount, ShaderProgramBuild& build)
+{
+    build.programId = glCreateProgram();
+    build.shaderCount = 0;
+    build.hash = UHashProgramSources(stages, sources, stageCount);
+    build.isCached = gIsProgramCacheEnabled && ULoadProgramBinary(build);
+    if (build.isCached)
+        return;
+
+    for (GLsizei i = 0; i < stageCount; ++i)
+    {
+        GLuint shaderId = glCreateShader(stages[i]);
+        glShaderSource(shaderId, 1, &sources[i], NULL);
+        glCompileShader(shaderId);
+        glAttachShader(build.programId, shaderId);
+
+        build.shaders[build.shaderCount] = shaderId;
+        build.stages[build.shaderCount] = stages[i];
+        ++build.shaderCount;
+    }
+
+    if (gIsProgramCacheEnabled)
+        glProgramParameteri(build.programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(build.programId);
+}
+
+
+// Finishes a vertex and fragment shader program and resolves its uniform locations
+bool UFinishShaderProgram(ShaderProgramBuild& build, GLuint& programId, GLProgramUniforms& uniforms)
+{
+    if (!UFinishProgram(build, programId))
+        return false;
+
+    UUseProgram(programId);    // Uses the shader program
+
+    // Resolve uniform locations once; URender never looks them up by name
+    uniforms.model = UGetUniformLocation(programId, "model");
+    uniforms.objectColor = UGetUniformLocation(programId, "objectColor");
+    uniforms.uvScale = UGetUniformLocation(programId, "uvScale");
+    uniforms.texture = UGetUniformLocation(programId, "uTexture");
+    uniforms.textureLayer = UGetUniformLocation(programId, "uTextureLayer");
+    uniforms.drawOffset = UGetUniformLocation(programId, "uDrawOffset");
+    uniforms.shadowMap = UGetUniformLocation(programId, "uShadowMap");
+
+    return true;
+}
+
+
+// Counted, so the render stats show that frames never look a uniform up by name
+GLint UGetUniformLocation(GLuint program, const GLchar* name)
+{
+    ++gRenderStats.uniformLookups;
+    return glGetUniformLocation(program, name);
+}
+
+
+// Waits for a program UBeginProgram submitted, prints any compile or link errors and stores a fresh build in the cache
+bool UFinishProgram(ShaderProgramBuild& build, GLuint& programId)
+{
+    // Compilation and linkage error reporting
+    int success = 1;
+    char infoLog[512];
+
+    // The first status query is where a parallel compile is waited for
+    for (GLsizei i = 0; i < build.shaderCount && success; ++i)
+    {
+        glGetShaderiv(build.shaders[i], GL_COMPILE_STATUS, &success);
+        if (!success)
+        {
+            const char* stageName = build.stages[i] == GL_VERTEX_SHADER ? "VERTEX"
+                : build.stages[i] == GL_FRAGMENT_SHADER ? "FRAGMENT" : "COMPUTE";
+            glGetShaderInfoLog(build.shaders[i], sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::" << stageName << "::COMPILATION_FAILED\n" << infoLog << std::endl;
+        }
+    }
+
+    if (success && !build.isCached)
+    {
+        glGetProgramiv(build.programId, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glGetProgramInfoLog(build.programId, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        }
+    }
+
+    // The program keeps the compiled code
+    for (GLsizei i = 0; i < build.shaderCount; ++i)
+    {
+        glDetachShader(build.programId, build.shaders[i]);
+        glDeleteShader(build.shaders[i]);
+    }
+    build.shaderCount = 0;
+
+    if (!success)
+    {
+        UDeleteProgram(build.programId);
+        return false;
+    }
+
+    if (!build.isCached && gIsProgramCacheEnabled)
+        UStoreProgramBinary(build);
+
+    programId = build.programId;
+    return true;
+}
+
+
+// FNV-1a over the driver's identity and every stage; a new driver or any source change gives a new hash
+uint64_t UHashProgramSources(const GLenum stages[], const char* const sources[], GLsizei stageCount)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
     };
 
-    glGenVertexArrays(1, &mesh.vao11); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao11);
+    // Binaries only load on the driver that wrote them, so its strings are part of the key
+    const GLenum driverStrings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : driverStrings)
+    {
+        const char* text = reinterpret_cast<const char*>(glGetString(name));
+        if (text)
+            mix(text, strlen(text) + 1);
+    }
+
+    for (GLsizei i = 0; i < stageCount; ++i)
+    {
+        mix(&stages[i], sizeof(stages[i]));
+        mix(sources[i], strlen(sources[i]) + 1);
+    }
+
+    mix(&PROGRAM_CACHE_VERSION, sizeof(PROGRAM_CACHE_VERSION));
+    return hash;
+}
+
+
+std::string UProgramCachePath(uint64_t hash)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "program-%016llx.bin", static_cast<unsigned long long>(hash));
+    return path;
+}
+
+
+// Links a program from its cache file; fails if there is none, or the driver rejects it (e.g. after an update)
+bool ULoadProgramBinary(ShaderProgramBuild& build)
+{
+    std::ifstream input(UProgramCachePath(build.hash), std::ios::binary);
+    if (!input)
+        return false;
+
+    ProgramCacheHeader header;
+    if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, "CSPB", 4) != 0
+        || header.version != PROGRAM_CACHE_VERSION || header.hash != build.hash || header.binaryLength == 0)
+        return false;
+
+    std::vector<char> binary(header.binaryLength);
+    if (!input.read(binary.data(), binary.size()))
+        return false;
+
+    glProgramBinary(build.programId, header.binaryFormat, binary.data(), header.binaryLength);
+    GLint success = 0;
+    glGetProgramiv(build.programId, GL_LINK_STATUS, &success);
+    if (success)
+        return true;
+
+    // Start over with a clean program for the compile
+    UDeleteProgram(build.programId);
+    build.programId = glCreateProgram();
+    return false;
+}
+
+
+// Writes a freshly linked program to its cache file; a failure only costs the next launch a compile
+void UStoreProgramBinary(const ShaderProgramBuild& build)
+{
+    GLint length = 0;
+    glGetProgramiv(build.programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    GLsizei written = 0;
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(build.programId, length, &written, &binaryFormat, binary.data());
+    if (written <= 0)
+        return;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, "CSPB", 4);
+    header.version = PROGRAM_CACHE_VERSION;
+    header.hash = build.hash;
+    header.binaryFormat = binaryFormat;
+    header.binaryLength = static_cast<uint32_t>(written);
+
+    std::string path = UProgramCachePath(build.hash);
+    std::ofstream output(path, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(binary.data(), written);
+    if (!output)
+        cout << "Failed to write the program cache " << path << endl;
+}
+
+
+void UDestroyShaderProgram(GLuint programId)
+{
+    UDeleteProgram(programId);
+}
+
+
+// Creates the stream buffer's immutable storage and maps it for good
+bool UCreateStreamBuffer(GLStreamBuffer& stream, GLsizeiptr regionSize)
+{
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &stream.uniformAlignment);
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &stream.storageAlignment);
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &stream.buffer);
+    UBindBuffer(GL_COPY_WRITE_BUFFER, stream.buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, regionSize * STREAM_REGION_COUNT, NULL, flags);
+    stream.mapping = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, regionSize * STREAM_REGION_COUNT, flags));
+    UBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (!stream.mapping)
+    {
+        cout << "Failed to map the stream buffer" << endl;
+        UDeleteBuffers(1, &stream.buffer);
+        return false;
+    }
+
+    stream.regionSize = regionSize;
+    stream.region = 0;
+    stream.head = 0;
+    for (GLuint region = 0; region < STREAM_REGION_COUNT; ++region)
+        stream.fences[region] = 0;
+    stream.retiredBuffers.clear();
+    return true;
+}
+
+
+void UDestroyStreamBuffer(GLStreamBuffer& stream)
+{
+    for (GLuint region = 0; region < STREAM_REGION_COUNT; ++region)
+    {
+        if (stream.fences[region])
+            glDeleteSync(stream.fences[region]);
+    }
+
+    // Deleting a mapped buffer unmaps it
+    UDeleteBuffers(1, &stream.buffer);
+    if (!stream.retiredBuffers.empty())
+        UDeleteBuffers(static_cast<GLsizei>(stream.retiredBuffers.size()), stream.retiredBuffers.data());
+    stream.retiredBuffers.clear();
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos11);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos11[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(frontDoor), frontDoor, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    mesh.nFrontDoorIndices = sizeof(frontDoorIndices) / sizeof(frontDoorIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos11[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(frontDoorIndices), frontDoorIndices, GL_STATIC_DRAW);
+// Moves to the next region, waiting for the GPU to finish the frame that last used it
+void UBeginStreamFrame(GLStreamBuffer& stream)
+{
+    // Every binding of a buffer a grow replaced was made last frame; this frame binds the new one
+    if (!stream.retiredBuffers.empty())
+    {
+        UDeleteBuffers(static_cast<GLsizei>(stream.retiredBuffers.size()), stream.retiredBuffers.data());
+        stream.retiredBuffers.clear();
+    }
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    stream.region = (stream.region + 1) % STREAM_REGION_COUNT;
+    stream.head = 0;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    GLsync& fence = stream.fences[stream.region];
+    if (!fence)
+        return;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED)
+    {
+        ++gRenderStats.streamStalls;
 
-    //=====================================================================================================================================
-        //Garage
+        // Flush once, so the fence is sure to be submitted, then wait in 1 ms steps
+        GLbitfield waitFlags = GL_SYNC_FLUSH_COMMANDS_BIT;
+        do
+        {
+            status = glClientWaitSync(fence, waitFlags, 1000000);
+            waitFlags = 0;
+        } while (status == GL_TIMEOUT_EXPIRED);
+    }
 
-    GLfloat garage[] = {
-        0.3f,  0.4f, 0.01f,   0.0f, 0.0f, 1.0f,    1.0f, 1.0f, // Top Right (Front) - Vertex 0
-         0.3f, -0.2f, 0.01f,   0.0f, 0.0f, 1.0f,    1.0f, 0.0f, // Bottom Right (Front) - Vertex 1
-        -0.3f, -0.2f, 0.01f,   0.0f, 0.0f, 1.0f,    0.0f, 0.0f, // Bottom Left (Front) - Vertex 2
-        -0.3f,  0.4f, 0.01f,   0.0f, 0.0f, 1.0f,    0.0f, 1.0f, // Top Left (Front) - Vertex 3
-    };
+    glDeleteSync(fence);
+    fence = 0;
+}
 
-    GLushort garageIndices[] = {
-        0,1,2,
-        2,0,3,
-        3,2,1
-    };
 
-    glGenVertexArrays(1, &mesh.vao12); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao12);
+// Fences the current region once every command reading it has been issued
+void UEndStreamFrame(GLStreamBuffer& stream)
+{
+    stream.fences[stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos12);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos12[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(garage), garage, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    mesh.nGarageIndices = sizeof(garageIndices) / sizeof(garageIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos12[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(garageIndices), garageIndices, GL_STATIC_DRAW);
+/* Suballocates a block of the current frame's region
+ * The alignment is the binding's offset alignment (uniform or storage). A frame that outgrows its region
+ * grows the whole buffer; blocks already handed out this frame stay valid, in the buffer they name.
+ * If the grow fails, the block's writes go to a CPU scratch area and the GPU reads the start of the region.
+ */
+StreamBlock UStreamAllocate(GLStreamBuffer& stream, GLsizeiptr size, GLint alignment)
+{
+    GLsizeiptr offset = (stream.head + alignment - 1) / alignment * alignment;
+    if (offset + size > stream.regionSize)
+    {
+        if (!UGrowStreamBuffer(stream, size + alignment))
+        {
+            stream.overflow.resize(std::max<size_t>(stream.overflow.size(), static_cast<size_t>(size)));
+            StreamBlock block;
+            block.data = stream.overflow.data();
+            block.buffer = stream.buffer;
+            block.offset = stream.region * stream.regionSize;
+            block.size = std::min(size, stream.regionSize);
+            return block;
+        }
+        offset = 0;
+    }
+    stream.head = offset + size;
+
+    StreamBlock block;
+    block.buffer = stream.buffer;
+    block.offset = stream.region * stream.regionSize + offset;
+    block.data = stream.mapping + block.offset;
+    block.size = size;
+    return block;
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Replaces the buffer with one whose regions are at least twice as large; the old one stays alive, mapped
+// and bound until the next frame, since this frame's earlier blocks and bindings still use it.
+// On failure the current buffer is kept and false returned.
+bool UGrowStreamBuffer(GLStreamBuffer& stream, GLsizeiptr minimumRegionSize)
+{
+    GLsizeiptr regionSize = stream.regionSize * 2;
+    while (regionSize < minimumRegionSize)
+        regionSize *= 2;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    UBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, regionSize * STREAM_REGION_COUNT, NULL, flags);
+    unsigned char* mapping = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, regionSize * STREAM_REGION_COUNT, flags));
+    UBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if (!mapping)
+    {
+        cout << "Failed to map a stream buffer of " << regionSize * STREAM_REGION_COUNT << " bytes" << endl;
+        UDeleteBuffers(1, &buffer);
+        return false;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    stream.retiredBuffers.push_back(stream.buffer);
 
-//=========================================================================================================================================
-    // Office Window
+    // The new buffer's regions have no pending GPU reads
+    for (GLuint region = 0; region < STREAM_REGION_COUNT; ++region)
+    {
+        if (stream.fences[region])
+            glDeleteSync(stream.fences[region]);
+        stream.fences[region] = 0;
+    }
 
-    GLfloat frontWindow[] = {
-        // Right Window
-        -1.05f, 0.4f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -1.05f, 0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -1.2f, 0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -1.2f, 0.4f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
+    stream.buffer = buffer;
+    stream.mapping = mapping;
+    stream.regionSize = regionSize;
+    stream.head = 0;
+    return true;
+}
 
-        //Left Window
-        -1.3f, 0.4f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 1.0f, // Top Right
-        -1.3f, 0.1f, -0.19f,        0.0f, 0.0f, 1.0f,       1.0f, 0.0f, // Bottom Right
-        -1.45f, 0.1f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 0.0f, // Bottom Left
-        -1.45f, 0.4f, -0.19f,       0.0f, 0.0f, 1.0f,       0.0f, 1.0f, // Top Left
-    };
 
-    GLushort frontWindowIndices[] = {
-        0,1,2,
-        2,0,3,
-        3,2,1,
+// Prints the average number of GL calls URender issued per frame
+void UPrintRenderStats()
+{
+    if (gRenderStats.frames == 0)
+        return;
+
+    const double frames = static_cast<double>(gRenderStats.frames);
+    cout << "INFO: GL calls per frame over " << gRenderStats.frames << " frames:"
+        << " draws " << gRenderStats.drawCalls / frames
+        << ", uniform uploads " << gRenderStats.uniformUploads / frames
+        << ", uniform lookups " << gRenderStats.uniformLookups / frames
+        << ", buffer uploads " << gRenderStats.bufferUploads / frames
+        << ", program switches " << gRenderStats.programSwitches / frames
+        << ", texture binds " << gRenderStats.textureBinds / frames
+        << ", VAO binds " << gRenderStats.vaoBinds / frames
+        << ", indices " << gRenderStats.indices / frames << endl;
+    if (gRenderStats.visibleInstances + gRenderStats.culledInstances > 0)
+    {
+        cout << "INFO: Houses per frame: visible " << gRenderStats.visibleInstances / frames
+            << ", culled " << gRenderStats.culledInstances / frames
+            << ", occluded " << gRenderStats.occludedInstances / frames << endl;
+    }
+    if (gRenderStats.sampledFrames > 0)
+    {
+        // Samples per pixel of the frame is the average overdraw, counting background pixels as zero
+        double samplesPerFrame = static_cast<double>(gRenderStats.shadedSamples) / gRenderStats.sampledFrames;
+        cout << "INFO: House samples shaded per frame " << samplesPerFrame << ", "
+            << samplesPerFrame / (static_cast<double>(gFramebufferWidth) * gFramebufferHeight) << " per pixel"
+            << (gIsDepthPrepassEnabled ? " with" : " without") << " the depth prepass" << endl;
+    }
+    if (gIsShadowEnabled)
+        cout << "INFO: Shadow map redraws: " << gRenderStats.shadowUpdates << " of " << gRenderStats.frames << " frames" << endl;
+    if (!gClusteredLights.lights.empty())
+    {
+        cout << "INFO: Point lights: " << gClusteredLights.lights.size() << ", cluster assignments per frame "
+            << gRenderStats.lightAssignments / frames << endl;
+    }
+    if (gRenderStats.stateCalls > 0)
+    {
+        cout << "INFO: State cache filtered " << gRenderStats.filteredStateCalls << " of " << gRenderStats.stateCalls
+            << " state calls, " << gRenderStats.filteredStateCalls / frames << " per frame" << endl;
+    }
+    if (gRenderStats.streamStalls > 0)
+        cout << "INFO: Stream buffer waits for the GPU: " << gRenderStats.streamStalls << " frames" << endl;
+}
 
-        4,5,6,
-        6,4,7,
-        7,6,5
-    };
 
-    glGenVertexArrays(1, &mesh.vao13); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao13);
+// Forgets every cached value, e.g. for a new context or after code outside the wrappers changed state
+void UInvalidateStateCache()
+{
+    gStateCache.program = STATE_UNKNOWN;
+    gStateCache.vertexArray = STATE_UNKNOWN;
+    gStateCache.activeTexture = STATE_UNKNOWN;
+    for (GLuint unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+        std::fill(gStateCache.textures[unit], gStateCache.textures[unit] + STATE_TEXTURE_TARGET_COUNT, STATE_UNKNOWN);
+    std::fill(gStateCache.buffers, gStateCache.buffers + STATE_BUFFER_TARGET_COUNT, STATE_UNKNOWN);
+    std::fill(gStateCache.vertexBuffers, gStateCache.vertexBuffers + STATE_VERTEX_BINDING_COUNT, STATE_UNKNOWN);
+    gStateCache.framebuffer = STATE_UNKNOWN;
+    gStateCache.renderbuffer = STATE_UNKNOWN;
+    gStateCache.isViewportKnown = false;
+    std::fill(gStateCache.capabilities, gStateCache.capabilities + STATE_CAPABILITY_COUNT, STATE_UNKNOWN);
+    gStateCache.depthFunc = STATE_UNKNOWN;
+    gStateCache.depthMask = STATE_UNKNOWN;
+    gStateCache.colorMask = STATE_UNKNOWN;
+    gStateCache.blendSource = STATE_UNKNOWN;
+    gStateCache.blendDestination = STATE_UNKNOWN;
+    gStateCache.isClearColorKnown = false;
+    gStateCache.packAlignment = STATE_UNKNOWN;
+    gStateCache.unpackAlignment = STATE_UNKNOWN;
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos13);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos13[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(frontWindow), frontWindow, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    mesh.nFrontWindowIndices = sizeof(frontWindowIndices) / sizeof(frontWindowIndices[0]);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos13[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(frontWindowIndices), frontWindowIndices, GL_STATIC_DRAW);
+// Records a state call; true if it changes the cached value and so has to reach GL
+bool UCacheState(GLuint& cached, GLuint value)
+{
+    ++gRenderStats.stateCalls;
+    if (cached == value)
+    {
+        ++gRenderStats.filteredStateCalls;
+        return false;
+    }
+    cached = value;
+    return true;
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Index of a value in one of the tracked lists, or count if it is not tracked
+GLuint UStateIndex(const GLenum* values, GLuint count, GLenum value)
+{
+    return static_cast<GLuint>(std::find(values, values + count, value) - values);
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
-//==========================================================================================================================================
-    // Fence
+bool UUseProgram(GLuint program)
+{
+    if (!UCacheState(gStateCache.program, program))
+        return false;
+    glUseProgram(program);
+    return true;
+}
 
-    //GLfloat fence[] = {
-    //    0.5f, -0.2f, -0.3f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f, //0
-    //    0.5f, 0.3f, -0.3f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f, //1
-    //    1.5f, 0.3f, -0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f, //2
-    //    1.5f, -0.2f, -0.3f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,//3
-    //    1.5f, -0.2f, -2.0f,     0.0f, 0.0f, -1.0f,       1.0f, 1.0f,//4
-    //    1.5f, 0.3f, -2.0f,     0.0f, 0.0f, -1.0f,       1.0f, 0.0f,//5
-    //    -2.0f, -0.2f, -2.0f,     0.0f, 0.0f, -1.0f,       0.0f, 0.0f,//6
-    //    -2.0f, 0.3f, -0.3f,     0.0f, 0.0f, -1.0f,       0.0f, 1.0f,//7
-    //    -2.0f, -0.2f, -0.5f,     0.0f, 0.0f, 1.0f,       1.0f, 1.0f,//8
-    //    -2.0f, 0.3f, -0.5f,     0.0f, 0.0f, 1.0f,       1.0f, 0.0f,//9
-    //    -1.5f, -0.2f, -0.5f,     0.0f, 0.0f, 1.0f,       0.0f, 0.0f,//10
-    //    -1.5f, 0.3f, -0.5f,     0.0f, 0.0f, 1.0f,       0.0f, 1.0f,//11
-    //};
 
-    //GLushort fenceIndices[] = {
-    //    0,1,3,
-    //    0,3,2,
-    //    1,2,3,
-    //    3,4,2,
-    //    2,5,4,
-    //    4,6,5,
-    //    6,7,5,
-    //    6,8,7,
-    //    8,9,7,
-    //    8,10,11,
-    //    11,8,9,
-    //    9,11,10
-    //};
+// The element array and vertex buffer bindings belong to the vertex array, so they are unknown after a switch
+bool UBindVertexArray(GLuint vertexArray)
+{
+    if (!UCacheState(gStateCache.vertexArray, vertexArray))
+        return false;
+    glBindVertexArray(vertexArray);
+    gStateCache.buffers[UStateIndex(STATE_BUFFER_TARGETS, STATE_BUFFER_TARGET_COUNT, GL_ELEMENT_ARRAY_BUFFER)] = STATE_UNKNOWN;
+    std::fill(gStateCache.vertexBuffers, gStateCache.vertexBuffers + STATE_VERTEX_BINDING_COUNT, STATE_UNKNOWN);
+    return true;
+}
 
-    //glGenVertexArrays(1, &mesh.vao14); // we can also generate multiple VAOs or buffers at the same time
-    //glBindVertexArray(mesh.vao14);
 
-    //// Create 2 buffers: first one for the vertex data; second one for the indices
-    //glGenBuffers(2, mesh.vbos14);
-    //glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos14[0]); // Activates the buffer
-    //glBufferData(GL_ARRAY_BUFFER, sizeof(fence), fence, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+// Binds a texture to a unit and leaves that unit active, so texture calls that follow apply to it.
+// True if the bind itself reached GL.
+bool UBindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+    if (UCacheState(gStateCache.activeTexture, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+
+    GLuint targetIndex = UStateIndex(STATE_TEXTURE_TARGETS, STATE_TEXTURE_TARGET_COUNT, target);
+    if (unit < STATE_TEXTURE_UNITS && targetIndex < STATE_TEXTURE_TARGET_COUNT
+        && !UCacheState(gStateCache.textures[unit][targetIndex], texture))
+        return false;
+    glBindTexture(target, texture);
+    return true;
+}
 
-    //mesh.nFenceIndices = sizeof(fenceIndices) / sizeof(fenceIndices[0]);
-    //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos14[1]);
-    //glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(fenceIndices), fenceIndices, GL_STATIC_DRAW);
 
-    //// Create Vertex Attribute Pointers
-    //glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    //glEnableVertexAttribArray(0);
+bool UBindBuffer(GLenum target, GLuint buffer)
+{
+    GLuint targetIndex = UStateIndex(STATE_BUFFER_TARGETS, STATE_BUFFER_TARGET_COUNT, target);
+    if (targetIndex < STATE_BUFFER_TARGET_COUNT && !UCacheState(gStateCache.buffers[targetIndex], buffer))
+        return false;
+    glBindBuffer(target, buffer);
+    return true;
+}
 
-    //glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    //glEnableVertexAttribArray(1);
 
-    //glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    //glEnableVertexAttribArray(2);
+// The buffer, offset and stride count as one call
+bool UBindVertexBuffer(GLuint binding, GLuint buffer, GLintptr offset, GLsizei stride)
+{
+    if (binding < STATE_VERTEX_BINDING_COUNT)
+    {
+        ++gRenderStats.stateCalls;
+        if (gStateCache.vertexBuffers[binding] == buffer && gStateCache.vertexBufferOffsets[binding] == offset
+            && gStateCache.vertexBufferStrides[binding] == stride)
+        {
+            ++gRenderStats.filteredStateCalls;
+            return false;
+        }
+        gStateCache.vertexBuffers[binding] = buffer;
+        gStateCache.vertexBufferOffsets[binding] = offset;
+        gStateCache.vertexBufferStrides[binding] = stride;
+    }
+    glBindVertexBuffer(binding, buffer, offset, stride);
+    return true;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+bool UBindFramebuffer(GLuint framebuffer)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(2, mesh.vbos);
+    if (!UCacheState(gStateCache.framebuffer, framebuffer))
+        return false;
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    return true;
 }
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+
+bool UBindRenderbuffer(GLuint renderbuffer)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    if (!UCacheState(gStateCache.renderbuffer, renderbuffer))
+        return false;
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    return true;
+}
+
+
+bool UViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    ++gRenderStats.stateCalls;
+    GLint* viewport = gStateCache.viewport;
+    if (gStateCache.isViewportKnown && viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height)
     {
-        flipImageVertically(image, width, height, channels);
+        ++gRenderStats.filteredStateCalls;
+        return false;
+    }
+    viewport[0] = x;
+    viewport[1] = y;
+    viewport[2] = width;
+    viewport[3] = height;
+    gStateCache.isViewportKnown = true;
+    glViewport(x, y, width, height);
+    return true;
+}
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// Indexed bindings are not tracked, but they also set the target's generic binding
+void UBindBufferBase(GLenum target, GLuint index, GLuint buffer)
+{
+    glBindBufferBase(target, index, buffer);
+    GLuint targetIndex = UStateIndex(STATE_BUFFER_TARGETS, STATE_BUFFER_TARGET_COUNT, target);
+    if (targetIndex < STATE_BUFFER_TARGET_COUNT)
+        gStateCache.buffers[targetIndex] = buffer;
+}
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+void UBindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    glBindBufferRange(target, index, buffer, offset, size);
+    GLuint targetIndex = UStateIndex(STATE_BUFFER_TARGETS, STATE_BUFFER_TARGET_COUNT, target);
+    if (targetIndex < STATE_BUFFER_TARGET_COUNT)
+        gStateCache.buffers[targetIndex] = buffer;
+}
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
 
-        return true;
-    }
+bool UEnable(GLenum capability)
+{
+    GLuint index = UStateIndex(STATE_CAPABILITIES, STATE_CAPABILITY_COUNT, capability);
+    if (index < STATE_CAPABILITY_COUNT && !UCacheState(gStateCache.capabilities[index], GL_TRUE))
+        return false;
+    glEnable(capability);
+    return true;
+}
 
 
-    // Error loading the image
-    return false;
+bool UDisable(GLenum capability)
+{
+    GLuint index = UStateIndex(STATE_CAPABILITIES, STATE_CAPABILITY_COUNT, capability);
+    if (index < STATE_CAPABILITY_COUNT && !UCacheState(gStateCache.capabilities[index], GL_FALSE))
+        return false;
+    glDisable(capability);
+    return true;
 }
 
-void UDestroyTexture(GLuint textureId)
+
+bool UDepthFunc(GLenum func)
 {
-    glGenTextures(1, &textureId);
+    if (!UCacheState(gStateCache.depthFunc, func))
+        return false;
+    glDepthFunc(func);
+    return true;
 }
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+
+bool UDepthMask(GLboolean flag)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    if (!UCacheState(gStateCache.depthMask, flag))
+        return false;
+    glDepthMask(flag);
+    return true;
+}
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+bool UColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha)
+{
+    GLuint mask = (red ? 1u : 0u) | (green ? 2u : 0u) | (blue ? 4u : 0u) | (alpha ? 8u : 0u);
+    if (!UCacheState(gStateCache.colorMask, mask))
+        return false;
+    glColorMask(red, green, blue, alpha);
+    return true;
+}
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+// Both factors count as one call
+bool UBlendFunc(GLenum source, GLenum destination)
+{
+    ++gRenderStats.stateCalls;
+    if (gStateCache.blendSource == source && gStateCache.blendDestination == destination)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-
+        ++gRenderStats.filteredStateCalls;
         return false;
     }
+    gStateCache.blendSource = source;
+    gStateCache.blendDestination = destination;
+    glBlendFunc(source, destination);
+    return true;
+}
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+
+bool UClearColor(const glm::vec4& color)
+{
+    ++gRenderStats.stateCalls;
+    if (gStateCache.isClearColorKnown && gStateCache.clearColor == color)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        ++gRenderStats.filteredStateCalls;
+        return false;
+    }
+    gStateCache.clearColor = color;
+    gStateCache.isClearColorKnown = true;
+    glClearColor(color.r, color.g, color.b, color.a);
+    return true;
+}
+
 
+// Only the row alignments are tracked; other pixel store parameters go straight to GL
+bool UPixelStorei(GLenum name, GLint value)
+{
+    GLuint* cached = name == GL_PACK_ALIGNMENT ? &gStateCache.packAlignment
+        : name == GL_UNPACK_ALIGNMENT ? &gStateCache.unpackAlignment : NULL;
+    if (cached != NULL && !UCacheState(*cached, static_cast<GLuint>(value)))
         return false;
+    glPixelStorei(name, value);
+    return true;
+}
+
+
+// GL keeps a deleted program in use until another is bound, so the cached binding is dropped rather than reset
+void UDeleteProgram(GLuint program)
+{
+    glDeleteProgram(program);
+    if (gStateCache.program == program)
+        gStateCache.program = STATE_UNKNOWN;
+}
+
+
+// Deleting a bound object unbinds it; the names may come back from the next glGen call
+void UDeleteVertexArrays(GLsizei count, const GLuint* vertexArrays)
+{
+    glDeleteVertexArrays(count, vertexArrays);
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (gStateCache.vertexArray == vertexArrays[i])
+            gStateCache.vertexArray = 0;
     }
+}
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+void UDeleteTextures(GLsizei count, const GLuint* textures)
+{
+    glDeleteTextures(count, textures);
+    for (GLsizei i = 0; i < count; ++i)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        for (GLuint unit = 0; unit < STATE_TEXTURE_UNITS; ++unit)
+            std::replace(gStateCache.textures[unit], gStateCache.textures[unit] + STATE_TEXTURE_TARGET_COUNT, textures[i], 0u);
+    }
+}
 
-        return false;
+
+// The element array binding of vertex arrays other than the bound one is not tracked, so it is dropped
+void UDeleteBuffers(GLsizei count, const GLuint* buffers)
+{
+    glDeleteBuffers(count, buffers);
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        std::replace(gStateCache.buffers, gStateCache.buffers + STATE_BUFFER_TARGET_COUNT, buffers[i], 0u);
+        std::replace(gStateCache.vertexBuffers, gStateCache.vertexBuffers + STATE_VERTEX_BINDING_COUNT, buffers[i], 0u);
     }
+    gStateCache.buffers[UStateIndex(STATE_BUFFER_TARGETS, STATE_BUFFER_TARGET_COUNT, GL_ELEMENT_ARRAY_BUFFER)] = STATE_UNKNOWN;
+}
 
-    glUseProgram(programId);    // Uses the shader program
 
-    return true;
+// Deleting the bound framebuffer reverts the binding to the default one
+void UDeleteFramebuffers(GLsizei count, const GLuint* framebuffers)
+{
+    glDeleteFramebuffers(count, framebuffers);
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (gStateCache.framebuffer == framebuffers[i])
+            gStateCache.framebuffer = 0;
+    }
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+// Deleting the bound renderbuffer unbinds it
+void UDeleteRenderbuffers(GLsizei count, const GLuint* renderbuffers)
 {
-    glDeleteProgram(programId);
+    glDeleteRenderbuffers(count, renderbuffers);
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        if (gStateCache.renderbuffer == renderbuffers[i])
+            gStateCache.renderbuffer = 0;
+    }
 }
 